@@ -0,0 +1,104 @@
+#!/bin/sh
+# Flashes images of several sizes into stm32sim over a matrix of baud rates and adapter latency
+# timers. Per-phase times, throughput and round trips go to $BENCH_OUT/bench.csv and bench.json,
+# and throughput is compared with bench/baseline.csv.
+#
+# usage: sh bench/bench.sh [--update], from the repository root after make all sim
+# --update replaces the baseline with this run's results.
+
+SIZES=${BENCH_SIZES:-"4096 32768"}
+BAUDS=${BENCH_BAUDS:-"115200 460800 921600"}
+LATENCIES=${BENCH_LATENCIES:-"1 16"}
+# Throughput drop in percent reported as a regression
+TOLERANCE=${BENCH_TOLERANCE:-20}
+OUT=${BENCH_OUT:-build/bench}
+BASELINE=bench/baseline.csv
+LINK=$OUT/tty
+# Tenths of a second to wait for stm32sim to create its link
+START_TIMEOUT=50
+
+mkdir -p "$OUT"
+rm -f "$OUT/bench.csv" "$OUT/bench.log" "$LINK"
+export XDG_CACHE_HOME="$OUT/cache"
+failed=0
+
+for size in $SIZES; do
+    # Random contents, so no block is skipped as blank
+    head -c "$size" /dev/urandom > "$OUT/image.bin"
+    for latency in $LATENCIES; do
+        for baud in $BAUDS; do
+            ./stm32sim -a "$latency" "$LINK" >> "$OUT/bench.log" 2>&1 &
+            sim=$!
+            # stm32sim may also exit straight away, e.g. when it cannot allocate a pty
+            waited=0
+            while [ ! -e "$LINK" ] && [ "$waited" -lt "$START_TIMEOUT" ]; do
+                kill -0 "$sim" 2> /dev/null || break
+                sleep 0.1
+                waited=$((waited + 1))
+            done
+            echo "$size bytes at $baud baud, $latency ms latency"
+            if [ ! -e "$LINK" ]; then
+                echo "stm32sim did not start, see $OUT/bench.log"
+                failed=$((failed + 1))
+                kill "$sim" 2> /dev/null
+                wait "$sim" 2> /dev/null
+                continue
+            fi
+            ./flash -g sim -p "$LINK" -b "$baud" -l "$latency" -f -T "$OUT/bench.csv" \
+              "$OUT/image.bin" >> "$OUT/bench.log" 2>&1
+            kill "$sim"
+            wait "$sim" 2> /dev/null
+        done
+    done
+done
+
+if [ "$failed" -gt 0 ]; then
+    echo "$failed run(s) failed"
+    exit 1
+fi
+
+# CSV to a JSON array of objects
+awk -F, '
+    NR == 1 { for (i = 1; i <= NF; i++) key[i] = $i; next }
+    {
+        printf "%s  {", (NR > 2 ? ",\n" : "[\n")
+        for (i = 1; i <= NF; i++) printf "%s\"%s\": %s", (i > 1 ? ", " : ""), key[i], $i
+        printf "}"
+    }
+    END { print (NR > 1 ? "\n]" : "[]") }
+' "$OUT/bench.csv" > "$OUT/bench.json"
+
+if [ "${1:-}" = "--update" ]; then
+    cp "$OUT/bench.csv" "$BASELINE"
+    echo "Baseline updated"
+    exit 0
+fi
+if [ ! -f "$BASELINE" ]; then
+    echo "No baseline, run with --update to store one"
+    exit 0
+fi
+
+# Matches runs on bytes, baud and latency and compares bytes_per_s
+awk -F, -v tolerance="$TOLERANCE" '
+    FNR == 1 { for (i = 1; i <= NF; i++) column[$i] = i; next }
+    {
+        key = $column["bytes"] "," $column["baud"] "," $column["latency_ms"]
+        rate = $column["bytes_per_s"]
+    }
+    NR == FNR { baseline[key] = rate; next }
+    FNR == 2 {
+        printf "%8s %8s %8s %12s %12s %8s\n", "bytes", "baud", "latency", "bytes/s", "baseline", \
+          "change"
+    }
+    {
+        change = key in baseline && baseline[key] > 0 ? (rate / baseline[key] - 1) * 100 : 0
+        flag = ""
+        if ($column["status"] != 0) flag = "  FAILED"
+        else if (change < -tolerance) flag = "  REGRESSION"
+        if (flag != "") regressions++
+        printf "%8s %8s %8s %12.0f %12s %+7.1f%%%s\n", $column["bytes"], $column["baud"], \
+          $column["latency_ms"], rate, (key in baseline ? sprintf("%.0f", baseline[key]) : "-"), \
+          change, flag
+    }
+    END { exit regressions > 0 }
+' "$BASELINE" "$OUT/bench.csv"
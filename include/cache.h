@@ -0,0 +1,25 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+// Small key/value files kept in the user's cache directory (~/.cache/stm32handsfree on Linux,
+// %LOCALAPPDATA%\stm32handsfree on Windows), one "key value" line per entry
+
+#define CACHE_OK 0
+#define CACHE_ERR_IO 1
+#define CACHE_ERR_MISSING 2
+
+#define CACHE_KEY_LENGTH 128
+#define CACHE_VALUE_LENGTH 128
+#define CACHE_PATH_LENGTH 512
+
+int cache_get(const char* name, const char* key, char* value, size_t size);
+// Replaces the entry for key, or removes it when value is NULL. The file is rewritten and
+// renamed into place under a lock shared with other processes, so readers never see a partial
+// update and concurrent writers never lose each other's entries.
+int cache_put(const char* name, const char* key, const char* value);
+// Path of the file name in the cache directory, for data kept in a format of its own
+int cache_path(const char* name, char* path, size_t size);
+
+#endif // CACHE_H
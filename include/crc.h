@@ -0,0 +1,15 @@
+#ifndef CRC_H
+#define CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 as computed by the STM32 CRC unit: polynomial 0x04C11DB7, MSB first, fed with 32-bit
+// little-endian words and no final XOR
+#define CRC_POLYNOMIAL 0x04C11DB7
+#define CRC_INIT 0xFFFFFFFF
+
+// Continues crc over size bytes of data, size must be a multiple of 4
+uint32_t crc_update(uint32_t crc, const unsigned char* data, size_t size);
+
+#endif // CRC_H
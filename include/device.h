@@ -0,0 +1,42 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEVICE_MAX_REGIONS 6
+#define DEVICE_UID_LENGTH 12
+
+// Run of equally sized pages / sectors
+struct device_region {
+    uint16_t count;
+    uint32_t size;
+    // Typical erase time of one page / sector
+    uint16_t erase_time; // milliseconds
+};
+
+// Flash geometry of the parts the system bootloader reports through Get ID
+struct device {
+    uint16_t pid;
+    const char* name;
+    uint32_t flash_base;
+    // Pages / sectors from flash_base on, numbered as the Erase commands expect them, for the
+    // largest flash size sharing the product ID
+    struct device_region regions[DEVICE_MAX_REGIONS];
+    // Typical mass erase time
+    uint16_t mass_erase_time; // milliseconds
+    // 96-bit unique device ID
+    uint32_t uid_addr;
+};
+
+// Entry for a Get ID product ID, NULL if unknown
+const struct device* device_find(uint16_t pid);
+uint32_t device_flash_size(const struct device* device);
+size_t device_page_count(const struct device* device);
+uint32_t device_page_addr(const struct device* device, size_t page);
+uint32_t device_page_size(const struct device* device, size_t page);
+unsigned int device_page_erase_time(const struct device* device, size_t page);
+// Page holding addr, -1 outside flash
+long device_page(const struct device* device, uint32_t addr);
+
+#endif // DEVICE_H
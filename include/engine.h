@@ -0,0 +1,23 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "flash.h"
+#include "session.h"
+
+// Flashes count adapters from the calling thread at baud, with the adapters' latency timers set
+// to latency milliseconds (0 leaves them alone). Each board is a state machine over its
+// non-blocking ttyUSB, with reset delays and reply timeouts on its own timerfd, and all of them
+// are multiplexed by a single epoll loop. sessions must be initialized, results receives the
+// outcome of every board. Returns the number of boards flashed, or a negative value if the loop
+// could not be set up. Linux only.
+int engine_flash(
+  const struct adapter* adapters,
+  struct session* sessions,
+  struct flash_result* results,
+  int count,
+  const struct flash_plan* plan,
+  const struct flash_options* options,
+  unsigned int baud,
+  unsigned int latency);
+
+#endif // ENGINE_H
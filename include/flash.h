@@ -0,0 +1,152 @@
+#ifndef FLASH_H
+#define FLASH_H
+
+#include "image.h"
+#include "stm32.h"
+#include "stub.h"
+
+#include <stdio.h>
+
+#define FLASH_ERROR_LENGTH 128
+
+// How flash_image() checks what it wrote
+#define FLASH_VERIFY_NONE 0
+// Read every block back
+#define FLASH_VERIFY_READ 1
+// Read back the first and last block of every segment and every FLASH_SAMPLE_STRIDE-th block
+#define FLASH_VERIFY_SAMPLE 2
+// Compare each segment's CRC computed by the target, falling back to a full read-back when the
+// bootloader lacks Get Checksum
+#define FLASH_VERIFY_CRC 3
+
+#define FLASH_SAMPLE_STRIDE 16
+
+// How far flash_image() got, so that a retry, e.g. at a lower baud rate, can pick up from the
+// last acknowledged block instead of starting over
+struct flash_progress {
+    int erased;
+    // Blocks acknowledged by the bootloader
+    size_t written;
+    size_t verified;
+    // The programming stub failed, later attempts use the bootloader's own commands only
+    int rom_only;
+};
+
+struct flash_options {
+    // FLASH_VERIFY_*
+    int verify;
+    // Progress messages, NULL for none
+    FILE* log;
+    // Resumed from and updated as blocks complete, NULL to always start over
+    struct flash_progress* progress;
+    // Only erase and program the pages whose contents differ from the image
+    int delta;
+    // Range of the image identifying it, e.g. its GNU build-id note, at most
+    // STM32_MAX_TRANSFER bytes. Devices whose flash already holds the same bytes are left alone,
+    // and the range is programmed last so that an interrupted flash never matches. Size 0 for
+    // none.
+    uint32_t identity_addr;
+    size_t identity_size;
+    // image_hash() of the image, remembered per device unique ID so that devices already
+    // carrying it are skipped. NULL to always flash.
+    const char* image_hash;
+    // Flash devices already carrying image_hash too. Their entry is still dropped before the
+    // flash starts, so one that fails never looks current.
+    int force;
+    // image_hash() of the image, to send full flashes from the frames packets_open() keeps for it.
+    // NULL to encode every block as it is written.
+    const char* packets_hash;
+    // SRAM programming stub for full flashes of the parts it supports, NULL to program through the
+    // bootloader alone. The stub is started at baud, the bootloader's line rate, and moves the
+    // link to stub_baud.
+    const struct stub* stub;
+    unsigned int baud;
+    unsigned int stub_baud;
+};
+
+// One Write Memory command worth of a segment
+struct flash_block {
+    uint32_t addr;
+    const unsigned char* data;
+    size_t size;
+    // Index of the segment the block belongs to
+    size_t segment;
+    // All 0xFF, which erased flash already reads as, so the block is never written
+    int blank;
+};
+
+// Image split into bootloader-sized blocks, shared by every board flashing the same image
+struct flash_plan {
+    struct flash_block* blocks;
+    size_t count;
+    // Blocks moved to the end by flash_plan_defer()
+    size_t deferred;
+};
+
+// Word aligned range of flash and the CRC it should hold
+struct flash_checksum {
+    uint32_t addr;
+    uint32_t size;
+    uint32_t crc;
+};
+
+// Steps of flashing one board, timed separately
+#define FLASH_PHASE_FIND 0    // locating the COM port / ttyUSB
+#define FLASH_PHASE_ENTER 1   // reset into the bootloader
+#define FLASH_PHASE_PROGRAM 2 // bootloader session or STM32CubeProgrammer run
+#define FLASH_PHASE_EXIT 3    // reset into the application
+#define FLASH_PHASES 4
+
+// Outcome of flashing one board
+struct flash_result {
+    int status;
+    char error[FLASH_ERROR_LENGTH];
+    double elapsed; // seconds
+    // Summed over every attempt of the baud rate ladder, in microseconds
+    uint64_t phase_time[FLASH_PHASES];
+    // Rate of the successful attempt, 0 if there was none
+    unsigned int baud;
+    // Packet round trips over every attempt
+    struct stm32_stats round_trip;
+};
+
+int flash_plan_init(struct flash_plan* plan, const struct image* image);
+void flash_plan_free(struct flash_plan* plan);
+// Contents of size bytes at addr, NULL unless they lie within a single segment of the plan
+const unsigned char* flash_plan_at(const struct flash_plan* plan, uint32_t addr, size_t size);
+// Moves the blocks overlapping size bytes at addr to the end of the plan. They are written in a
+// pass of their own, once the blocks before them have been written and verified.
+void flash_plan_defer(struct flash_plan* plan, uint32_t addr, size_t size);
+// Pages of the part behind stm that plan touches, chosen when erasing them one by one is expected
+// to take less time than a mass erase. Returns the page count and a malloc()ed list in pages, or 0
+// when the flash should be mass erased, e.g. for parts missing from the device table.
+size_t flash_plan_pages(const struct flash_plan* plan, const struct stm32* stm, uint16_t** pages);
+// Whether FLASH_VERIFY_SAMPLE reads back the block at index
+int flash_block_sampled(const struct flash_plan* plan, size_t index);
+// Checksum of the segment starting at block first, padded like its last block. Stops early at a
+// gap left by deferred blocks and where they start. Returns the index of the block after the
+// range covered.
+size_t flash_plan_checksum(
+  const struct flash_plan* plan, size_t first, struct flash_checksum* checksum);
+// Whether size bytes of data all hold the erased value 0xFF
+int flash_blank(const unsigned char* data, size_t size);
+// Copies block to data padded to whole flash words, returns the padded size
+size_t flash_block_payload(const struct flash_block* block, unsigned char* data);
+
+// Image cache keyed by product and unique device ID. flash_cache_lookup() returns whether the
+// device was last flashed with hash and forgets the entry otherwise, so that an interrupted
+// flash never leaves a stale match behind. flash_cache_store() records a completed flash.
+int flash_cache_lookup(uint16_t pid, const unsigned char* uid, const char* hash);
+void flash_cache_store(uint16_t pid, const unsigned char* uid, const char* hash);
+// Drops the device's entry, e.g. before a forced flash
+void flash_cache_forget(uint16_t pid, const unsigned char* uid);
+
+// Erases, programs and optionally verifies image through an initialized bootloader session. Only
+// the pages the image covers are erased unless a mass erase is quicker. In delta mode, pages are
+// compared through the bootloader's Get Checksum command when available and by reading them
+// back otherwise; parts missing from the device table are flashed in full. Full flashes go through
+// options->stub when it supports the part, falling back to the bootloader on the next attempt if
+// it fails.
+int flash_image(struct stm32* stm, const struct image* image, const struct flash_options* options);
+
+#endif // FLASH_H
@@ -0,0 +1,59 @@
+#ifndef GPIO_H
+#define GPIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct session;
+
+// BOOT0/NRST control through the FT232R's CBUS pins, see session.c for the bit layout.
+// Implementations return FT_OK on success and keep their state in the session.
+struct gpio_backend {
+    const char* name;
+    int (*open)(struct session* session);
+    int (*close)(struct session* session);
+    int (*get_latency)(struct session* session, unsigned char* latency);
+    int (*set_latency)(struct session* session, unsigned char latency);
+    // Writes one CBUS value, pin directions in the high nibble and output levels in the low one
+    int (*write)(struct session* session, unsigned char value);
+};
+
+// CBUS2 -> BOOT0, CBUS3 -> NRST
+#define CBUS_BOOT0 0x04
+#define CBUS_NRST 0x08
+
+#define GPIO_OK 0
+#define GPIO_ERR_TIMING 1
+
+// Margins the reset sequences must keep, well above the STM32's own minimums
+#define CBUS_MIN_RESET_PULSE 1000 // microseconds NRST is held low
+#define CBUS_MIN_BOOT_SETUP 1000  // microseconds BOOT0 is stable before NRST is released
+
+struct cbus_event {
+    unsigned char value;
+    uint64_t time; // timestamp_us()
+};
+
+// Every CBUS write the simulated backend received, in order
+struct cbus_timeline {
+    struct cbus_event* events;
+    size_t count;
+    size_t capacity;
+};
+
+// The FT232R through libftdi / D2XX
+extern const struct gpio_backend gpio_ftdi;
+// BOOT0/NRST wired to RTS/DTR instead of CBUS, driven through the same CBUS values
+extern const struct gpio_backend gpio_dtr;
+// Simulated FT232R appending each write to the session's timeline
+extern const struct gpio_backend gpio_sim;
+
+// Level the target sees on pin for a CBUS value, undriven pins follow the board's pulls
+int cbus_level(unsigned char value, unsigned char pin);
+void cbus_timeline_free(struct cbus_timeline* timeline);
+// Checks the pin timing of every reset in timeline and that the pins are released at the end.
+// Prints the timeline, the resets and any violation to stream unless it is NULL.
+int cbus_timeline_check(const struct cbus_timeline* timeline, FILE* stream);
+
+#endif // GPIO_H
@@ -0,0 +1,48 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Contiguous range of the firmware image and its load address
+struct segment {
+    uint32_t addr;
+    size_t size;
+    unsigned char* data;
+};
+
+struct image {
+    struct segment* segments;
+    size_t count;
+};
+
+// Hex SHA-256 over every segment's address, size and contents, with terminator
+#define IMAGE_HASH_LENGTH 65
+
+#define IMAGE_OK 0
+#define IMAGE_ERR_IO 1
+#define IMAGE_ERR_FORMAT 2
+
+#define IMAGE_FORMAT_BIN 0
+#define IMAGE_FORMAT_HEX 1
+#define IMAGE_FORMAT_SREC 2
+#define IMAGE_FORMAT_ELF 3
+
+// Loads an Intel HEX, Motorola S-record or ELF file with the load addresses it carries, or a raw
+// binary to be placed at addr. The file is memory mapped and only the ranges it populates become
+// segments, sorted by address.
+int image_load(struct image* image, const char* path, uint32_t addr);
+// Loads a raw binary to be placed at addr
+int image_load_bin(struct image* image, const char* path, uint32_t addr);
+// IMAGE_FORMAT_* of the file at path, judged by its contents
+int image_format(const char* path);
+// Total number of bytes across all segments
+size_t image_size(const struct image* image);
+void image_hash(const struct image* image, char* hash);
+// Contents of size bytes at addr, NULL unless they lie within a single segment
+const unsigned char* image_at(const struct image* image, uint32_t addr, size_t size);
+// Locates a GNU build-id note (NT_GNU_BUILD_ID) linked into the image, header included
+int image_find_build_id(const struct image* image, uint32_t* addr, size_t* size);
+void image_free(struct image* image);
+
+#endif // IMAGE_H
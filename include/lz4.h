@@ -0,0 +1,15 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+
+// LZ4 block format compressor, for the stub's decompressor in stub/stub.c
+
+// Largest output lz4_compress() can produce for size bytes of input
+#define LZ4_BOUND(size) ((size) + (size) / 255 + 16)
+
+// Compresses size bytes of src into dst, which must hold LZ4_BOUND(size) bytes. Returns the
+// compressed size.
+size_t lz4_compress(const unsigned char* src, size_t size, unsigned char* dst);
+
+#endif // LZ4_H
@@ -0,0 +1,56 @@
+#ifndef PACKETS_H
+#define PACKETS_H
+
+#include "flash.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Write Memory frames of an image, encoded once and kept in the cache directory as
+// "packets-<image hash>-<product ID>-<chunk size>". The file holds a header, then one entry per
+// non-blank block sorted by address, then each block's address frame followed by its data frame,
+// ready to go on the wire. Files are mapped read-only, so every board and process flashing the
+// same image shares one copy. When an image changes, the frames of the blocks it has in common
+// with the family's previous image are copied over and only the others are encoded again, and the
+// previous image's file is removed.
+
+#define PACKETS_OK 0
+#define PACKETS_ERR_IO 1
+#define PACKETS_ERR_FORMAT 2
+
+struct packets_entry {
+    uint32_t addr;
+    // From the start of the file to the address frame
+    uint32_t offset;
+    // Payload size, the data frame is 2 bytes longer
+    uint32_t size;
+};
+
+struct packets {
+    const unsigned char* map;
+    size_t map_size;
+    const struct packets_entry* entries;
+    size_t count;
+#ifdef _WIN32
+    void* file;
+    void* mapping;
+#endif
+};
+
+// Maps the frames of plan for product pid, building the file first when the cache lacks it.
+// hash is image_hash() of the image the plan was made from. When log is not NULL, says whether
+// the frames were encoded and how many were carried over from the previous image. packets is left
+// empty on failure, with packets_find() finding nothing.
+int packets_open(
+  struct packets* packets,
+  const struct flash_plan* plan,
+  const char* hash,
+  uint16_t pid,
+  FILE* log);
+void packets_close(struct packets* packets);
+// Frames of the block at addr for stm32_write_encoded(), with its payload size in size. NULL when
+// the file has no block at addr, e.g. when it is blank.
+const unsigned char* packets_find(const struct packets* packets, uint32_t addr, size_t* size);
+
+#endif // PACKETS_H
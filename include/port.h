@@ -0,0 +1,77 @@
+#ifndef PORT_H
+#define PORT_H
+
+#include <stddef.h>
+
+// Byte stream used to talk to the STM32 system bootloader. Implementations fill in the function
+// table and keep their own state behind handle.
+struct port {
+    void* handle;
+    // Longest the adapter holds back a short reply in milliseconds, 0 if unknown
+    unsigned int latency;
+    // Writes all of data, returns 0 on success
+    int (*write)(struct port* port, const unsigned char* data, size_t size);
+    // Reads exactly size bytes within timeout milliseconds, returns 0 on success
+    int (*read)(struct port* port, unsigned char* data, size_t size, unsigned int timeout);
+    // Optional: writes request and reads exactly reply_size bytes within timeout milliseconds,
+    // letting the implementation overlap the two. NULL falls back to write followed by read.
+    int (*transfer)(
+      struct port* port,
+      const unsigned char* request,
+      size_t request_size,
+      unsigned char* reply,
+      size_t reply_size,
+      unsigned int timeout);
+    // Optional: changes the line rate without closing the port, NULL if the implementation cannot
+    int (*set_baud)(struct port* port, unsigned int baud);
+    // Optional: asserts (1) or clears (0) DTR and RTS together, NULL if the implementation cannot
+    int (*set_lines)(struct port* port, int dtr, int rts);
+    // Discards any pending input
+    int (*flush)(struct port* port);
+    int (*close)(struct port* port);
+};
+
+#define PORT_OK 0
+#define PORT_ERR_IO 1
+#define PORT_ERR_TIMEOUT 2
+
+static inline int port_write(struct port* port, const unsigned char* data, size_t size) {
+    return port->write(port, data, size);
+}
+
+static inline int port_read(
+  struct port* port, unsigned char* data, size_t size, unsigned int timeout) {
+    return port->read(port, data, size, timeout);
+}
+
+static inline int port_transfer(
+  struct port* port,
+  const unsigned char* request,
+  size_t request_size,
+  unsigned char* reply,
+  size_t reply_size,
+  unsigned int timeout) {
+    if (port->transfer)
+        return port->transfer(port, request, request_size, reply, reply_size, timeout);
+    int status = port->write(port, request, request_size);
+    if (status == PORT_OK) status = port->read(port, reply, reply_size, timeout);
+    return status;
+}
+
+static inline int port_set_baud(struct port* port, unsigned int baud) {
+    return port->set_baud ? port->set_baud(port, baud) : PORT_ERR_IO;
+}
+
+static inline int port_set_lines(struct port* port, int dtr, int rts) {
+    return port->set_lines ? port->set_lines(port, dtr, rts) : PORT_ERR_IO;
+}
+
+static inline int port_flush(struct port* port) {
+    return port->flush(port);
+}
+
+static inline int port_close(struct port* port) {
+    return port->close(port);
+}
+
+#endif // PORT_H
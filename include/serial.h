@@ -0,0 +1,33 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "port.h"
+
+// Opens a COM port / tty configured for the STM32 system bootloader (8 data bits, even parity,
+// 1 stop bit, no flow control). On Linux the adapter's latency timer is set to latency
+// milliseconds until the port is closed, 0 leaves it alone.
+int serial_open(struct port* port, const char* path, unsigned int baud, unsigned int latency);
+
+#ifdef __linux__
+// Opens and configures path as above without waiting for the node to appear, leaving a
+// non-blocking descriptor for callers that multiplex several ports. Returns PORT_ERR_TIMEOUT
+// while the node is missing or not yet accessible.
+int serial_open_fd(const char* path, unsigned int baud, int* fd);
+
+// Driver latency settings changed by serial_set_latency()
+struct serial_latency {
+    // sysfs latency_timer attribute and its previous value, empty if untouched
+    char timer_path[96];
+    int timer;
+    // serial_struct flags before ASYNC_LOW_LATENCY was set, -1 if untouched
+    int flags;
+};
+
+// Sets the latency timer of the USB serial adapter behind path / fd through sysfs and asks the
+// driver for low latency operation. Returns PORT_OK if either took effect.
+int serial_set_latency(
+  int fd, const char* path, unsigned int latency, struct serial_latency* saved);
+void serial_restore_latency(int fd, const struct serial_latency* saved);
+#endif
+
+#endif // SERIAL_H
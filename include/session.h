@@ -0,0 +1,127 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "gpio.h"
+#include "port.h"
+
+#ifdef _WIN32
+#include "ftd2xx.h"
+#elif __linux__
+#include "libftdi1/ftdi.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __linux__
+#define FT_OK 0
+#define FT_DEVICE_NOT_FOUND 2
+#endif
+
+#define SESSION_MAX_PHASES 8
+#define ADAPTER_SERIAL_LENGTH 64
+#define ADAPTER_PORT_LENGTH 64
+#define ADAPTER_USB_PATH_LENGTH 32
+
+// FT232R found on the bus
+struct adapter {
+    // USB serial number, identifies the adapter across reconnects
+    char serial[ADAPTER_SERIAL_LENGTH];
+    // COM port / ttyUSB path, empty until known
+    char port[ADAPTER_PORT_LENGTH];
+#ifdef __linux__
+    // Port chain on the bus, e.g. 1-1.2, stays the same for a given socket
+    char usb_path[ADAPTER_USB_PATH_LENGTH];
+    uint8_t bus;
+    uint8_t addr;
+#endif
+};
+
+// Narrows find_devices() down, NULL members match any adapter
+struct adapter_filter {
+    const char* serial;
+    // Linux only
+    const char* usb_path;
+};
+
+// One CBUS write of a reset sequence and the time to hold it before the next
+struct cbus_step {
+    unsigned char value;
+    unsigned int delay; // microseconds
+};
+
+#define BOOTLOADER_SEQUENCE_STEPS 2
+#define APPLICATION_SEQUENCE_STEPS 3
+
+// Resets into the system bootloader / into the application, as written by enter_bootloader()
+// and exit_bootloader()
+extern const struct cbus_step bootloader_sequence[BOOTLOADER_SEQUENCE_STEPS];
+extern const struct cbus_step application_sequence[APPLICATION_SEQUENCE_STEPS];
+
+struct session_phase {
+    const char* name;
+    // Set when the phase found the device still open from an earlier phase
+    int reused;
+};
+
+// FT232R held open across device lookup, reset sequencing and programming
+struct session {
+    // Device to open, NULL for the first one found
+    const struct adapter* adapter;
+    // Reset control, gpio_ftdi unless changed after session_init()
+    const struct gpio_backend* gpio;
+    // CBUS writes recorded by gpio_sim, NULL to record nothing
+    struct cbus_timeline* timeline;
+    // Open port whose DTR/RTS gpio_dtr drives, NULL to use the FTDI handle's
+    struct port* lines;
+#ifdef _WIN32
+    FT_HANDLE ftdi;
+#elif __linux__
+    struct ftdi_context* ftdi;
+#endif
+    int open;
+    // Latency timer to apply while the device is open in milliseconds, 0 to leave it alone
+    unsigned char latency;
+    // Value to restore on close, 0 if untouched
+    unsigned char saved_latency;
+    // USB opens performed and time spent opening and closing, in microseconds
+    unsigned int opens;
+    uint64_t open_time;
+    struct session_phase phases[SESSION_MAX_PHASES];
+    unsigned int phase_count;
+};
+
+// Lists every connected FT232R that passes filter, or all of them when it is NULL. Returns the
+// number found or a negative value on error.
+int find_devices(struct adapter** adapters, const struct adapter_filter* filter);
+#ifdef __linux__
+struct udev_device;
+// Fills adapter from a tty device, returns 0 if it is on an FT232R passing filter
+int udev_adapter(
+  struct udev_device* dev, const struct adapter_filter* filter, struct adapter* adapter);
+#endif
+
+int session_init(struct session* session, const struct adapter* adapter);
+void session_deinit(struct session* session);
+// Opens the device for phase unless it is still open from an earlier phase
+int session_acquire(struct session* session, const char* phase);
+// Closes the device, e.g. to hand the UART over to the COM port / ttyUSB driver
+int session_release(struct session* session);
+// Prints which phases reused the open device and the estimated open/close time saved
+void session_report(const struct session* session, FILE* stream);
+
+int find_device(struct session* session, char** loc);
+// Looks up the tty of adapter again by USB serial number and path, replacing the malloc()ed path
+// in loc. ftdi_sio hands out ttyUSB numbers in the order adapters come back after being detached,
+// so the tty found before the reset sequence may belong to another adapter by now. Returns
+// FT_DEVICE_NOT_FOUND until the adapter's tty is back. COM ports follow the serial number, so loc
+// is left alone on Windows.
+int find_tty(const struct adapter* adapter, char** loc);
+// Writes one CBUS value to the open device
+int session_write(struct session* session, unsigned char value);
+int enter_bootloader(struct session* session);
+int exit_bootloader(struct session* session);
+// Routes bootloader traffic through the open FTDI handle
+int session_port_open(struct session* session, struct port* port, unsigned int baud);
+
+#endif // SESSION_H
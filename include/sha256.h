@@ -0,0 +1,22 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-256 (FIPS 180-4)
+
+#define SHA256_LENGTH 32
+
+struct sha256 {
+    uint32_t state[8];
+    uint64_t length; // bytes
+    unsigned char block[64];
+    size_t used;
+};
+
+void sha256_init(struct sha256* sha);
+void sha256_update(struct sha256* sha, const void* data, size_t size);
+void sha256_final(struct sha256* sha, unsigned char* digest);
+
+#endif // SHA256_H
@@ -0,0 +1,125 @@
+#ifndef STM32_H
+#define STM32_H
+
+#include "port.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// STM32 system memory bootloader, USART protocol (AN3155)
+
+#define STM32_ACK 0x79
+#define STM32_NACK 0x1F
+#define STM32_SYNC 0x7F
+
+#define STM32_CMD_GET 0x00
+#define STM32_CMD_GET_VERSION 0x01
+#define STM32_CMD_GET_ID 0x02
+#define STM32_CMD_READ_MEMORY 0x11
+#define STM32_CMD_GO 0x21
+#define STM32_CMD_WRITE_MEMORY 0x31
+#define STM32_CMD_ERASE 0x43
+#define STM32_CMD_EXTENDED_ERASE 0x44
+#define STM32_CMD_GET_CHECKSUM 0xA1
+
+// Largest payload of a single Read Memory / Write Memory command
+#define STM32_MAX_TRANSFER 256
+// Address and its checksum, as sent by stm32_encode_address()
+#define STM32_ADDRESS_FRAME 5
+// Largest frame sent after a command, a full Extended Erase page list
+#define STM32_MAX_FRAME (2 + STM32_EXTENDED_ERASE_PAGES * 2 + 1)
+
+// Page numbers sent per erase command
+#define STM32_ERASE_PAGES 255
+#define STM32_EXTENDED_ERASE_PAGES 256
+
+#define STM32_TIMEOUT 1000             // milliseconds
+// Sync bytes are repeated until the bootloader is up, waiting STM32_SYNC_POLL for the first
+// reply and twice as long each time after, up to STM32_SYNC_TIMEOUT, for STM32_SYNC_DEADLINE
+#define STM32_SYNC_POLL 2              // milliseconds
+#define STM32_SYNC_TIMEOUT 100         // milliseconds
+#define STM32_SYNC_DEADLINE 1000       // milliseconds
+// Latency timer the FTDI drivers default to, assumed when the adapter's is unknown
+#define STM32_SYNC_LATENCY 16          // milliseconds
+#define STM32_WRITE_TIMEOUT 1000       // milliseconds
+#define STM32_PAGE_ERASE_TIMEOUT 5000  // milliseconds, per page
+#define STM32_MASS_ERASE_TIMEOUT 35000 // milliseconds
+#define STM32_CHECKSUM_TIMEOUT 5000    // milliseconds
+
+#define STM32_OK 0
+#define STM32_ERR_IO 1
+#define STM32_ERR_TIMEOUT 2
+#define STM32_ERR_NACK 3
+#define STM32_ERR_PROTOCOL 4
+#define STM32_ERR_UNSUPPORTED 5
+#define STM32_ERR_VERIFY 6
+
+// Time from sending a request to receiving its ACK
+struct stm32_stats {
+    unsigned long count;
+    uint64_t total; // microseconds
+    uint64_t min;
+    uint64_t max;
+};
+
+struct stm32 {
+    struct port* port;
+    // Bootloader protocol version, e.g. 0x31 for v3.1
+    unsigned char version;
+    // Commands reported by Get
+    unsigned char commands[STM32_MAX_TRANSFER];
+    size_t command_count;
+    // Product ID reported by Get ID
+    uint16_t pid;
+    struct stm32_stats stats;
+};
+
+// Synchronizes with the bootloader and queries its version, command set and product ID
+int stm32_init(struct stm32* stm, struct port* port);
+// Polls the bootloader with sync bytes until it answers or STM32_SYNC_DEADLINE passes
+int stm32_sync(struct stm32* stm);
+// Wait for the reply to sync attempt number attempt, 0 once the deadline is used up
+unsigned int stm32_sync_timeout(unsigned int attempt);
+// Silence that shows every sync byte sent after the one answered has drawn its NACK, for an adapter
+// holding replies back up to latency milliseconds (0 if unknown) and a last wait of timeout
+unsigned int stm32_sync_quiet(unsigned int latency, unsigned int timeout);
+int stm32_get(struct stm32* stm);
+int stm32_get_id(struct stm32* stm);
+int stm32_supports(const struct stm32* stm, unsigned char command);
+
+int stm32_read_memory(struct stm32* stm, uint32_t addr, unsigned char* data, size_t size);
+// size must be a multiple of 4 when writing to flash
+int stm32_write_memory(struct stm32* stm, uint32_t addr, const unsigned char* data, size_t size);
+// Write Memory with frames already encoded: an address frame from stm32_encode_address() followed
+// by a data frame from stm32_encode_data() carrying size bytes
+int stm32_write_encoded(struct stm32* stm, const unsigned char* frames, size_t size);
+int stm32_erase_all(struct stm32* stm);
+int stm32_erase_pages(struct stm32* stm, const uint16_t* pages, size_t count);
+int stm32_go(struct stm32* stm, uint32_t addr);
+// CRC of size bytes at addr computed by the target, size must be a multiple of 4
+int stm32_get_checksum(
+  struct stm32* stm,
+  uint32_t addr,
+  uint32_t size,
+  uint32_t polynomial,
+  uint32_t init,
+  uint32_t* crc);
+
+// Frame builders, shared with engines that drive the port themselves. Each returns the frame
+// size.
+size_t stm32_encode_command(unsigned char command, unsigned char* frame);
+size_t stm32_encode_address(uint32_t addr, unsigned char* frame);
+// Byte count of a Read Memory command
+size_t stm32_encode_length(size_t size, unsigned char* frame);
+// Payload of a Write Memory command
+size_t stm32_encode_data(const unsigned char* data, size_t size, unsigned char* frame);
+// Erase or Extended Erase command supported by the bootloader, 0 if neither
+unsigned char stm32_erase_command(const struct stm32* stm);
+// Page list for command, or a mass erase when pages is NULL. Returns 0 if the pages cannot be
+// expressed with command.
+size_t stm32_encode_erase(
+  unsigned char command, const uint16_t* pages, size_t count, unsigned char* frame);
+
+const char* stm32_strerror(int status);
+
+#endif // STM32_H
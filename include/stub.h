@@ -0,0 +1,47 @@
+#ifndef STUB_H
+#define STUB_H
+
+#include "stm32.h"
+#include "stub_protocol.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Host side of the SRAM programming stub built from stub/, see stub_protocol.h
+
+// Frames with a CRC mismatch are sent this many times before giving up
+#define STUB_RETRIES 3
+// Largest chunk size accepted from a stub image
+#define STUB_MAX_CHUNK 4096
+// Line rate switched to once the stub runs, the FT232R's highest
+#define STUB_BAUD 3000000
+
+struct stub {
+    unsigned char* data;
+    size_t size;
+    uint32_t load;
+    // Largest chunk the stub accepts per write
+    size_t chunk;
+    uint16_t pids[STUB_MAX_PIDS];
+};
+
+// Reads and checks a stub image, returns STM32_OK or STM32_ERR_IO / STM32_ERR_PROTOCOL
+int stub_load(struct stub* stub, const char* path);
+void stub_free(struct stub* stub);
+// Whether the stub can program the part with product ID pid
+int stub_supports(const struct stub* stub, uint16_t pid);
+
+// Loads the stub into SRAM through the bootloader, starts it at the bootloader's line rate and
+// moves the link to baud, or stays at line when the port cannot change rate. The bootloader is
+// gone afterwards, only the stub_* calls below apply until the target is reset.
+int stub_start(struct stm32* stm, const struct stub* stub, unsigned int line, unsigned int baud);
+// Programs size bytes at addr, at most the stub's chunk and a multiple of 4. Returns once the
+// stub has buffered them and programmed the previous chunk, so the next call overlaps with the
+// programming of this one.
+int stub_write(struct stm32* stm, uint32_t addr, const unsigned char* data, size_t size);
+// Waits until everything written so far is programmed
+int stub_ping(struct stm32* stm);
+// CRC_POLYNOMIAL / CRC_INIT CRC of size bytes at addr, a multiple of 4
+int stub_checksum(struct stm32* stm, uint32_t addr, uint32_t size, uint32_t* crc);
+
+#endif // STUB_H
@@ -0,0 +1,48 @@
+#ifndef STUB_PROTOCOL_H
+#define STUB_PROTOCOL_H
+
+// Wire protocol between the host and the SRAM programming stub in stub/, shared by both sides.
+//
+// The stub image starts with a header the host reads and patches before loading it:
+//   0  initial stack pointer   4  entry point (Thumb)   8  STUB_MAGIC   12  load address
+//   16 line rate at start      20 largest chunk         24 product IDs, zero terminated
+// Once started through the bootloader's Go command the stub sends STUB_READY at the patched
+// rate. Every request is then a frame: command, flags, payload length (16 bits), address and
+// size (32 bits each), the payload padded with 0xFF to whole words, and the STM32 CRC-32 of all
+// of it. Fields are little endian.
+//
+// Write replies come as soon as the frame is buffered and the previous chunk is programmed, so
+// the host sends the next chunk while the stub decompresses and programs this one.
+
+#define STUB_MAGIC 0x42555453 // "STUB"
+#define STUB_HEADER_SIZE 40
+#define STUB_MAX_PIDS 8
+
+#define STUB_OFFSET_MAGIC 8
+#define STUB_OFFSET_LOAD 12
+#define STUB_OFFSET_BAUD 16
+#define STUB_OFFSET_CHUNK 20
+#define STUB_OFFSET_PIDS 24
+
+#define STUB_READY 0x5A
+#define STUB_ACK 0x79
+// Frame CRC mismatch, the frame can be sent again
+#define STUB_NACK 0x1F
+// Programming a chunk failed
+#define STUB_ERROR 0xEE
+
+#define STUB_FRAME_HEADER 12
+#define STUB_FRAME_CRC 4
+
+// size is the new line rate, the ACK still goes out at the old one
+#define STUB_CMD_BAUD 0x01
+// Waits for pending programming, ACK when it succeeded
+#define STUB_CMD_PING 0x02
+// Programs size bytes at addr from the payload, LZ4 block compressed when flagged
+#define STUB_CMD_WRITE 0x31
+// ACK followed by the STM32 CRC-32 of size bytes at addr
+#define STUB_CMD_CRC 0xA1
+
+#define STUB_FLAG_LZ4 0x01
+
+#endif // STUB_PROTOCOL_H
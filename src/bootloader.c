@@ -1,243 +1,1741 @@
-#ifdef _WIN32
-#include "ftd2xx.h"
-#elif __linux__
-#include "libftdi1/ftdi.h"
+#include "cache.h"
+#include "device.h"
+#include "engine.h"
+#include "flash.h"
+#include "image.h"
+#include "serial.h"
+#include "session.h"
+#include "stm32.h"
+#include "stub.h"
+#include "timestamp.h"
 
+#ifdef __linux__
+#include <errno.h>
 #include <libudev.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #endif
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-// FT232R write logic:
-//
-// CBUS bits
-// 3210 3210
-// xxxx xxxx
-// |    |------ Output state:  0 -> low,   1 -> high
-// |----------- Pin direction: 0 -> input, 1 -> output
-//
-// Configuration:
-// CBUS0 -> unused
-// CBUS1 -> unused
-// CBUS2 -> BOOT0
-// CBUS3 -> RESET
+#ifdef _WIN32
+#define FLASH_PROGRAM "STM32_Programmer_CLI.exe"
+#elif __linux__
+#define FLASH_PROGRAM "STM32_Programmer_CLI"
+#endif
+#define FLASH_CONNECT_ARG " -c port="
+#define FLASH_WRITE_ARG " -w "
+#define FLASH_WRITE_ADDR " 0x08000000"
+#define FLASH_VERIFY_ARG " -v"
+#define FLASH_BASE_ADDR 0x08000000
+// Tried from the top down until the link holds
+#define FLASH_BAUD_LADDER "921600,460800,230400,115200"
+#define BAUD_LADDER_MAX 8
+// Last working rate per adapter serial number
+#define BAUD_CACHE "baud"
+// FT232R latency timer while flashing, replies shorter than the chip's buffer wait this long
+#define FLASH_LATENCY 1 // milliseconds
+// Identity word read back by -i without a size
+#define IDENTITY_SIZE 4
 
-#define TRANSITION_DELAY 2000 // microseconds
+// Wait for ftdi_sio to bring an adapter's tty back after the reset sequence
+#define TTY_FIND_TIMEOUT 3000 // milliseconds
+#define TTY_FIND_RETRY 10     // milliseconds
 
-#ifdef _WIN32
-#define BITMODE_CBUS 0x20
+// Wait for the restarted application's first byte or banner
+#define APP_START_TIMEOUT 3000 // milliseconds
+#define APP_BANNER_MAX 64
+
+#define TRANSPORT_TTY 0
+#define TRANSPORT_FTDI 1
+
+// USB sockets a station keeps track of
+#define STATION_MAX_SLOTS 64
+// Adapters a daemon keeps a session for
+#define DAEMON_MAX_ADAPTERS 64
+// Longest line of the daemon protocol
+#define DAEMON_LINE_MAX (PATH_MAX + 16)
+// Worker threads of a batch unless -j says otherwise
+#define BATCH_WORKERS 4
+#define BATCH_LINE_MAX 1024
+
+char* parse(char* dev, char* binary_path, int verify) {
+    // HEX, S-record and ELF files carry their own addresses
+    const char* addr = image_format(binary_path) == IMAGE_FORMAT_BIN ? FLASH_WRITE_ADDR : "";
+    int command_size =
+      strlen(FLASH_PROGRAM FLASH_CONNECT_ARG FLASH_WRITE_ARG FLASH_WRITE_ADDR FLASH_VERIFY_ARG) +
+      strlen(dev) + strlen(binary_path) + 1; // Plus 1 for null terminator
+    char* command = (char*)malloc(command_size * sizeof(char));
+    snprintf(
+      command,
+      command_size,
+      "%s%s%s%s%s%s%s",
+      FLASH_PROGRAM,
+      FLASH_CONNECT_ARG,
+      dev,
+      FLASH_WRITE_ARG,
+      binary_path,
+      addr,
+      verify ? FLASH_VERIFY_ARG : "");
+
+    return command;
+}
+
+// Shared by every board flashed in this run
+struct settings {
+    const char* binary_path;
+    struct image image;
+    int cubeprog;
+    int transport;
+    // BOOT0/NRST control, gpio_dtr for DTR/RTS wiring or gpio_sim to record and check the reset
+    // sequences instead
+    const struct gpio_backend* gpio;
+    // COM port / ttyUSB to use instead of the adapter's own, for example a simulated target
+    const char* port;
+    // Adapters to flash, by serial number and/or USB path
+    struct adapter_filter filter;
+    int report;
+    unsigned int bauds[BAUD_LADDER_MAX];
+    int baud_count;
+    // Adapter latency timer in milliseconds, 0 for the driver default
+    unsigned int latency;
+    int delta;
+    // FLASH_VERIFY_*, STM32CubeProgrammer only tells none from a full read-back
+    int verify;
+    // image_hash() of image, empty for STM32CubeProgrammer
+    char image_hash[IMAGE_HASH_LENGTH];
+    // Flash devices that already carry the image again
+    int force;
+    // Range of image read back to tell whether a device is up to date, size 0 for none
+    uint32_t identity_addr;
+    size_t identity_size;
+    // SRAM programming stub, no data when programming through the bootloader alone
+    struct stub stub;
+    unsigned int stub_baud;
+    // Text the application prints once it runs, empty for any byte, NULL to not wait for it
+    const char* banner;
+    // Drive every board from one event loop instead of a thread each
+    int event_loop;
+    // Keep running and flash every adapter as it is plugged in
+    int station;
+    // Progress messages, NULL when flashing several boards at once
+    FILE* log;
+};
+
+struct board {
+    // Adapter to use, NULL for the first one found
+    const struct adapter* adapter;
+    const struct settings* settings;
+    struct flash_result result;
+    struct session session;
+    // COM port / ttyUSB, NULL on the FTDI transport
+    char* dev;
+    // CBUS writes, recorded with gpio_sim only
+    struct cbus_timeline timeline;
+    // Session initialized by the caller, which keeps it for the next flash and deinitializes it
+    int warm;
+};
+
+static int program(
+  struct board* board, struct port* port, unsigned int baud, struct flash_progress* progress) {
+    struct stm32 stm;
+    struct flash_options options = {
+        .verify = board->settings->verify,
+        .log = board->settings->log,
+        .progress = progress,
+        .delta = board->settings->delta,
+        .identity_addr = board->settings->identity_addr,
+        .identity_size = board->settings->identity_size,
+        .image_hash = board->settings->image_hash[0] ? board->settings->image_hash : NULL,
+        .force = board->settings->force,
+        .packets_hash = board->settings->image_hash,
+        .stub = board->settings->stub.data ? &board->settings->stub : NULL,
+        .baud = baud,
+        .stub_baud = board->settings->stub_baud,
+    };
 
-static FT_HANDLE ftdi;
+    int status = stm32_init(&stm, port);
+    if (status == STM32_OK && options.log)
+        fprintf(
+          options.log,
+          "Bootloader v%d.%d, product ID 0x%03X\n",
+          stm.version >> 4,
+          stm.version & 0xF,
+          stm.pid);
+    if (status == STM32_OK) status = flash_image(&stm, &board->settings->image, &options);
+    struct stm32_stats* round_trip = &board->result.round_trip;
+    if (stm.stats.count) {
+        if (!round_trip->count || stm.stats.min < round_trip->min)
+            round_trip->min = stm.stats.min;
+        if (stm.stats.max > round_trip->max) round_trip->max = stm.stats.max;
+        round_trip->count += stm.stats.count;
+        round_trip->total += stm.stats.total;
+    }
+    if (options.log && stm.stats.count)
+        fprintf(
+          options.log,
+          "Round trip: %.2f ms average, %.2f ms min, %.2f ms max over %lu packets\n",
+          stm.stats.total / 1000.0 / stm.stats.count,
+          stm.stats.min / 1000.0,
+          stm.stats.max / 1000.0,
+          stm.stats.count);
+    if (status != STM32_OK)
+        snprintf(
+          board->result.error,
+          FLASH_ERROR_LENGTH,
+          "Failed to flash device: %s",
+          stm32_strerror(status));
 
-static inline int dev_open(void) {
-    return FT_Open(0, &ftdi);
+    return status;
 }
 
-static inline int dev_close(void) {
-    return FT_Close(ftdi);
+// Adds the time since start to phase
+static void phase_add(struct board* board, int phase, uint64_t start) {
+    board->result.phase_time[phase] += timestamp_us() - start;
 }
 
-static inline int dev_write(unsigned char data) {
-    return FT_SetBitMode(ftdi, data, BITMODE_CBUS);
+// Bootloader traffic on the COM port / ttyUSB
+static int open_tty(struct board* board, struct port* port, unsigned int baud) {
+    // Hand the UART over to the COM port / ttyUSB driver
+    session_release(&board->session);
+    // The tty found earlier may have gone to another adapter as they all reattached, a simulated
+    // target's port stays put
+    int status = FT_OK;
+    if (!board->settings->port && board->adapter) status = find_tty(board->adapter, &board->dev);
+    for (int waited = 0; status != FT_OK && waited < TTY_FIND_TIMEOUT; waited += TTY_FIND_RETRY) {
+        usleep(TTY_FIND_RETRY * 1000);
+        status = find_tty(board->adapter, &board->dev);
+    }
+    if (status != FT_OK) {
+        snprintf(
+          board->result.error,
+          FLASH_ERROR_LENGTH,
+          "Adapter %s did not come back",
+          board->adapter->serial[0] ? board->adapter->serial : board->adapter->usb_path);
+        return PORT_ERR_IO;
+    }
+    if (serial_open(port, board->dev, baud, board->settings->latency) == PORT_OK) return PORT_OK;
+    snprintf(board->result.error, FLASH_ERROR_LENGTH, "Failed to open %s", board->dev);
+    return PORT_ERR_IO;
 }
-#elif __linux__
-#define FT232_VID 0x0403
-#define FT232_PID 0x6001
-#define FT_OK 0
-#define FT_DEVICE_NOT_FOUND 2
 
-static struct ftdi_context* ftdi;
+// Bootloader traffic on the FTDI handle, which stays open throughout so the serial driver is
+// never detached and reattached in between
+static int open_ftdi(struct board* board, struct port* port, unsigned int baud) {
+    struct session* session = &board->session;
+    if (session_acquire(session, "flash") == FT_OK &&
+        session_port_open(session, port, baud) == PORT_OK)
+        return PORT_OK;
+    snprintf(board->result.error, FLASH_ERROR_LENGTH, "Failed to configure UART");
+    return PORT_ERR_IO;
+}
+
+// First ladder rate to try: the one that last worked with this adapter, or the top of the ladder
+static int baud_first(const struct board* board) {
+    const struct settings* settings = board->settings;
+    char value[CACHE_VALUE_LENGTH];
+    if (!board->adapter || !board->adapter->serial[0] ||
+        cache_get(BAUD_CACHE, board->adapter->serial, value, sizeof(value)) != CACHE_OK)
+        return 0;
+    unsigned int baud = (unsigned int)strtoul(value, NULL, 10);
+    for (int i = 0; i < settings->baud_count; i++) {
+        if (settings->bauds[i] <= baud) return i;
+    }
+    return 0;
+}
+
+static void baud_store(const struct board* board, unsigned int baud) {
+    char value[CACHE_VALUE_LENGTH];
+    if (!board->adapter || !board->adapter->serial[0]) return;
+    snprintf(value, sizeof(value), "%u", baud);
+    cache_put(BAUD_CACHE, board->adapter->serial, value);
+}
+
+// Waits for the restarted application's first byte, or for the banner when one is set
+static int wait_application(struct board* board, struct port* port) {
+    const char* banner = board->settings->banner;
+    size_t length = strlen(banner);
+    char window[APP_BANNER_MAX];
+    size_t filled = 0;
+    uint64_t start = timestamp_us();
+    uint64_t deadline = start + APP_START_TIMEOUT * 1000ULL;
+    int status = PORT_OK;
+
+    while (status == PORT_OK) {
+        uint64_t now = timestamp_us();
+        unsigned char byte;
+        status = now < deadline ?
+                   port_read(port, &byte, 1, (unsigned int)((deadline - now + 999) / 1000)) :
+                   PORT_ERR_TIMEOUT;
+        if (status != PORT_OK || length == 0) break;
+        // Last length bytes received
+        if (filled == length) memmove(window, window + 1, --filled);
+        window[filled++] = (char)byte;
+        if (filled == length && memcmp(window, banner, length) == 0) break;
+    }
+    if (status != PORT_OK) {
+        snprintf(
+          board->result.error,
+          FLASH_ERROR_LENGTH,
+          "Application did not start within %d ms",
+          APP_START_TIMEOUT);
+        return STM32_ERR_TIMEOUT;
+    }
+    if (board->settings->log)
+        fprintf(
+          board->settings->log,
+          "Application started after %.1f ms\n",
+          (timestamp_us() - start) / 1000.0);
+    return STM32_OK;
+}
+
+// Resets, programs and restarts the target. When the link fails at one rate of the ladder, the
+// target is reset into the bootloader again at the next lower rate and programming resumes from
+// the last acknowledged block.
+static int program_ladder(
+  struct board* board, int (*open_port)(struct board*, struct port*, unsigned int)) {
+    const struct settings* settings = board->settings;
+    struct session* session = &board->session;
+    struct flash_progress progress = { 0 };
+    struct port port;
+    int status = STM32_ERR_IO;
+    // The port stays open through the restart to hear the application start
+    int listen = 0;
+    // With DTR/RTS wiring on the COM port / ttyUSB, the port's own lines reset the target, so it
+    // is opened first and stays open from the first reset to the last. Reopening it would pulse
+    // both lines.
+    int lines = session->gpio == &gpio_dtr && open_port == open_tty;
+
+    for (int i = baud_first(board); i < settings->baud_count; i++) {
+        unsigned int baud = settings->bauds[i];
+        // The bootloader locks onto the rate of the first sync byte until it is reset
+        uint64_t start = timestamp_us();
+        if (lines && !session->lines) {
+            if (open_port(board, &port, baud) != PORT_OK) break;
+            session->lines = &port;
+        } else if (lines && port_set_baud(&port, baud) != PORT_OK) {
+            snprintf(board->result.error, FLASH_ERROR_LENGTH, "Failed to set %u baud", baud);
+            break;
+        }
+        if (enter_bootloader(session) != FT_OK) {
+            snprintf(board->result.error, FLASH_ERROR_LENGTH, "Failed to enter bootloader mode");
+            if (session->lines) port_close(&port);
+            session->lines = NULL;
+            return -1;
+        }
+        phase_add(board, FLASH_PHASE_ENTER, start);
+        if (settings->log) fprintf(settings->log, "Connecting at %u baud\n", baud);
+        start = timestamp_us();
+        if (!lines && open_port(board, &port, baud) != PORT_OK) {
+            status = STM32_ERR_IO;
+            break;
+        }
+        if (lines) port_flush(&port);
+        int rom_only = progress.rom_only;
+        status = program(board, &port, baud, &progress);
+        listen = status == STM32_OK && settings->banner;
+        if (!listen && !lines) port_close(&port);
+        phase_add(board, FLASH_PHASE_PROGRAM, start);
+        if (status == STM32_OK) {
+            board->result.baud = baud;
+            baud_store(board, baud);
+            break;
+        }
+        // The stub failing says nothing about the link, retry at the same rate without it
+        if (progress.rom_only != rom_only) i--;
+    }
+
+    uint64_t start = timestamp_us();
+    if (lines && !session->lines) return status;
+    if (listen) port_flush(&port);
+    if (exit_bootloader(session) != FT_OK) {
+        snprintf(board->result.error, FLASH_ERROR_LENGTH, "Failed to exit bootloader mode");
+        status = -1;
+    } else if (listen) {
+        status = wait_application(board, &port);
+    }
+    if (listen || lines) port_close(&port);
+    session->lines = NULL;
+    phase_add(board, FLASH_PHASE_EXIT, start);
+
+    return status;
+}
 
-static inline int dev_open(void) {
-    return ftdi_usb_open(ftdi, FT232_VID, FT232_PID);
+// STM32CubeProgrammer leaves the image cache alone, so the entry of the device it is about to
+// flash is dropped first: the unique ID is read through a bootloader session at the lowest ladder
+// rate, then the caller resets the target again for the programmer to sync with
+static void cubeprog_forget(struct board* board) {
+    const struct settings* settings = board->settings;
+    const struct device* device = NULL;
+    unsigned char uid[DEVICE_UID_LENGTH];
+    struct port port;
+    struct stm32 stm;
+    if (open_tty(board, &port, settings->bauds[settings->baud_count - 1]) != PORT_OK) return;
+    if (stm32_init(&stm, &port) == STM32_OK) device = device_find(stm.pid);
+    if (device && stm32_read_memory(&stm, device->uid_addr, uid, sizeof(uid)) == STM32_OK)
+        flash_cache_forget(stm.pid, uid);
+    port_close(&port);
 }
 
-static inline int dev_close(void) {
-    return ftdi_usb_close(ftdi);
+static int program_cubeprog(struct board* board) {
+    struct session* session = &board->session;
+    int status = 0;
+
+    uint64_t start = timestamp_us();
+    int entered = enter_bootloader(session) == FT_OK;
+    if (entered) {
+        cubeprog_forget(board);
+        entered = enter_bootloader(session) == FT_OK;
+    }
+    if (!entered) {
+        snprintf(board->result.error, FLASH_ERROR_LENGTH, "Failed to enter bootloader mode");
+        return -1;
+    }
+    phase_add(board, FLASH_PHASE_ENTER, start);
+    // Hand the UART over to the COM port / ttyUSB driver
+    start = timestamp_us();
+    session_release(session);
+
+    const struct settings* settings = board->settings;
+    char* command =
+      parse(board->dev, (char*)settings->binary_path, settings->verify != FLASH_VERIFY_NONE);
+    if (system(command) != 0) {
+        snprintf(board->result.error, FLASH_ERROR_LENGTH, "%s failed", FLASH_PROGRAM);
+        status = -1;
+    }
+    free(command);
+    phase_add(board, FLASH_PHASE_PROGRAM, start);
+
+    start = timestamp_us();
+    if (exit_bootloader(session) != FT_OK) {
+        snprintf(board->result.error, FLASH_ERROR_LENGTH, "Failed to exit bootloader mode");
+        return -1;
+    }
+    phase_add(board, FLASH_PHASE_EXIT, start);
+
+    return status;
 }
 
-static inline int dev_write(unsigned char data) {
-    return ftdi_set_bitmode(ftdi, data, BITMODE_CBUS);
+static int program_tty(struct board* board) {
+    uint64_t start = timestamp_us();
+    if (board->settings->port) {
+        board->dev = strdup(board->settings->port);
+    } else if (find_device(&board->session, &board->dev) != FT_OK) {
+        snprintf(board->result.error, FLASH_ERROR_LENGTH, "Failed to find device");
+        return -1;
+    }
+    phase_add(board, FLASH_PHASE_FIND, start);
+    int status =
+      board->settings->cubeprog ? program_cubeprog(board) : program_ladder(board, open_tty);
+    free(board->dev);
+    board->dev = NULL;
+
+    return status;
+}
+
+static int flash_board(struct board* board) {
+    struct flash_result* result = &board->result;
+    uint64_t start = timestamp_us();
+    result->error[0] = '\0';
+
+    if (!board->warm && session_init(&board->session, board->adapter) != FT_OK) {
+        snprintf(result->error, FLASH_ERROR_LENGTH, "Failed to initialize FTDI driver");
+        result->status = -1;
+    } else {
+        board->session.latency = board->settings->latency;
+        board->session.gpio = board->settings->gpio;
+        board->session.timeline = &board->timeline;
+        if (board->settings->transport == TRANSPORT_FTDI)
+            result->status = program_ladder(board, open_ftdi);
+        else
+            result->status = program_tty(board);
+        session_release(&board->session);
+    }
+    if (board->settings->gpio == &gpio_sim &&
+        cbus_timeline_check(&board->timeline, board->settings->log) != GPIO_OK &&
+        result->status == 0) {
+        snprintf(result->error, FLASH_ERROR_LENGTH, "Reset sequence timing violated");
+        result->status = -1;
+    }
+    cbus_timeline_free(&board->timeline);
+    result->elapsed = (timestamp_us() - start) / 1e6;
+
+    return result->status;
+}
+
+static void* flash_worker(void* arg) {
+    flash_board((struct board*)arg);
+    return NULL;
+}
+
+static const char* const timing_fields[] = {
+    "bytes", "baud", "latency_ms", "status", "find_ms", "enter_ms", "program_ms", "exit_ms",
+    "total_ms", "bytes_per_s", "rtt_avg_ms", "rtt_min_ms", "rtt_max_ms", "packets",
+};
+#define TIMING_FIELDS (sizeof(timing_fields) / sizeof(timing_fields[0]))
+
+// Appends a timing record for board to path, as a JSON object on its own line if path ends in
+// .jsonl and as CSV otherwise, with a header line when the file is new
+static int write_timing(const struct board* board, const char* path) {
+    const struct settings* settings = board->settings;
+    const struct flash_result* result = &board->result;
+    const struct stm32_stats* round_trip = &result->round_trip;
+    double bytes = settings->cubeprog ? 0 : image_size(&settings->image);
+    double program = result->phase_time[FLASH_PHASE_PROGRAM] / 1e6;
+    double values[TIMING_FIELDS] = {
+        bytes,
+        result->baud,
+        settings->latency,
+        result->status,
+        result->phase_time[FLASH_PHASE_FIND] / 1000.0,
+        result->phase_time[FLASH_PHASE_ENTER] / 1000.0,
+        result->phase_time[FLASH_PHASE_PROGRAM] / 1000.0,
+        result->phase_time[FLASH_PHASE_EXIT] / 1000.0,
+        result->elapsed * 1000.0,
+        result->status == 0 && program > 0 ? bytes / program : 0,
+        round_trip->count ? round_trip->total / 1000.0 / round_trip->count : 0,
+        round_trip->min / 1000.0,
+        round_trip->max / 1000.0,
+        round_trip->count,
+    };
+    size_t length = strlen(path);
+    int json = length > 6 && strcmp(path + length - 6, ".jsonl") == 0;
+
+    FILE* file = fopen(path, "a");
+    if (!file) return -1;
+    fseek(file, 0, SEEK_END);
+    if (!json && ftell(file) == 0) {
+        for (size_t i = 0; i < TIMING_FIELDS; i++)
+            fprintf(file, "%s%s", i ? "," : "", timing_fields[i]);
+        fprintf(file, "\n");
+    }
+    for (size_t i = 0; i < TIMING_FIELDS; i++) {
+        if (json)
+            fprintf(file, "%s\"%s\": %.10g", i ? ", " : "{", timing_fields[i], values[i]);
+        else
+            fprintf(file, "%s%.10g", i ? "," : "", values[i]);
+    }
+    fprintf(file, json ? "}\n" : "\n");
+
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+static void print_summary(
+  const struct adapter* adapters, const struct board* boards, int count, double elapsed) {
+    int flashed = 0;
+    printf("%-20s %-16s %7s  %s\n", "Adapter", "Port", "Time", "Result");
+    for (int i = 0; i < count; i++) {
+        const struct flash_result* result = &boards[i].result;
+        printf(
+          "%-20s %-16s %6.1fs  %s\n",
+          adapters[i].serial[0] ? adapters[i].serial : "?",
+          adapters[i].port[0] ? adapters[i].port : "-",
+          result->elapsed,
+          result->status == 0 ? "OK" : result->error);
+        if (result->status == 0) flashed++;
+    }
+    printf("%d/%d boards flashed in %.1fs\n", flashed, count, elapsed);
+}
+
+// One thread per board
+static void flash_threads(struct board* boards, int count) {
+    pthread_t* threads = (pthread_t*)calloc(count, sizeof(pthread_t));
+    int* started = (int*)calloc(count, sizeof(int));
+    for (int i = 0; i < count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, flash_worker, &boards[i]) == 0;
+        if (!started[i]) {
+            snprintf(boards[i].result.error, FLASH_ERROR_LENGTH, "Failed to start worker");
+            boards[i].result.status = -1;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+    free(started);
+    free(threads);
+}
+
+#ifdef __linux__
+// Every board from the calling thread
+static void flash_event_loop(const struct adapter* adapters, struct board* boards, int count) {
+    const struct settings* settings = boards[0].settings;
+    struct flash_options options = {
+        .verify = settings->verify,
+        .log = NULL,
+        .identity_addr = settings->identity_addr,
+        .identity_size = settings->identity_size,
+        .image_hash = settings->image_hash[0] ? settings->image_hash : NULL,
+        .force = settings->force,
+    };
+    struct flash_plan plan;
+    struct session* sessions = (struct session*)calloc(count, sizeof(struct session));
+    struct flash_result* results = (struct flash_result*)calloc(count, sizeof(struct flash_result));
+
+    int status = flash_plan_init(&plan, &settings->image);
+    if (status == STM32_OK)
+        flash_plan_defer(&plan, settings->identity_addr, settings->identity_size);
+    for (int i = 0; status == STM32_OK && i < count; i++) {
+        if (session_init(&sessions[i], &adapters[i]) != FT_OK) status = -1;
+        sessions[i].latency = settings->latency;
+    }
+    if (status == STM32_OK)
+        status = engine_flash(
+          adapters,
+          sessions,
+          results,
+          count,
+          &plan,
+          &options,
+          // No retries at lower rates here, so stay at the bottom of the ladder
+          settings->bauds[settings->baud_count - 1],
+          settings->latency);
+    for (int i = 0; i < count; i++) {
+        if (status < 0) {
+            snprintf(results[i].error, FLASH_ERROR_LENGTH, "Failed to start event loop");
+            results[i].status = -1;
+        }
+        boards[i].result = results[i];
+        // Hand the session over for reporting and cleanup
+        boards[i].session = sessions[i];
+    }
+    flash_plan_free(&plan);
+    free(results);
+    free(sessions);
 }
-#else
-#error OS not supported
 #endif
 
-static int find_device(char** loc) {
-    int status;
-#ifdef _WIN32
-#define COM_PORT_MAX_LENGTH 7 // COMXYZ + null terminator
-    status = dev_open();
-    if (status != FT_OK) return status;
-    LONG port;
-    status = FT_GetComPortNumber(ftdi, &port);
-    if (status == FT_OK && port == -1) status = FT_DEVICE_NOT_FOUND;
-    if (status == FT_OK) *loc = (char*)malloc(COM_PORT_MAX_LENGTH * sizeof(char));
-    if (status == FT_OK) snprintf(*loc, sizeof(*loc), "COM%d", (int)port);
-    if (status == FT_OK)
-        status = dev_close();
+// Flashes every connected adapter concurrently, each with its own session
+static int flash_all(const struct settings* settings) {
+    struct adapter* adapters;
+    int count = find_devices(&adapters, &settings->filter);
+    if (count <= 0) {
+        fprintf(stderr, "Failed to find device\n");
+        free(adapters);
+        return -1;
+    }
+
+    uint64_t start = timestamp_us();
+    struct board* boards = (struct board*)calloc(count, sizeof(struct board));
+    for (int i = 0; i < count; i++) {
+        boards[i].adapter = &adapters[i];
+        boards[i].settings = settings;
+    }
+#ifdef __linux__
+    if (settings->event_loop)
+        flash_event_loop(adapters, boards, count);
     else
-        dev_close();
-#elif __linux__
-    status = FT_DEVICE_NOT_FOUND;
-
-    const char* path;
-    int vid, pid;
-    struct udev* udev;
-    struct udev_enumerate* enumerate;
-    struct udev_list_entry *devices, *dev_list_entry;
-    struct udev_device* dev;
-
-    // Enumerate devices in tty subsystem
-    udev = udev_new();
-    enumerate = udev_enumerate_new(udev);
-    udev_enumerate_add_match_subsystem(enumerate, "tty");
-    udev_enumerate_scan_devices(enumerate);
-    devices = udev_enumerate_get_list_entry(enumerate);
-    // Iterate and create udev device for each entry
-    udev_list_entry_foreach(dev_list_entry, devices) {
-        path = udev_list_entry_get_name(dev_list_entry);
-        dev = udev_device_new_from_syspath(udev, path);
-        // Get device path
-        path = udev_device_get_devnode(dev);
-        // Filter for ttyUSB devices
-        if (strstr(path, "USB")) {
-            // Retrieve USB device information
-            dev = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device");
-            vid = (int)strtol(udev_device_get_sysattr_value(dev, "idVendor"), NULL, 16);
-            pid = (int)strtol(udev_device_get_sysattr_value(dev, "idProduct"), NULL, 16);
-            // Match VID/PID to ttyUSB path
-            if (vid == FT232_VID && pid == FT232_PID) {
-                *loc = (char*)malloc((strlen(path) + 1) * sizeof(char));
-                *loc = (char*)path;
-                status = FT_OK;
-                udev_device_unref(dev);
-                break;
-            }
+#endif
+        flash_threads(boards, count);
+    double elapsed = (timestamp_us() - start) / 1e6;
+
+    print_summary(adapters, boards, count, elapsed);
+    for (int i = 0; settings->report && i < count; i++) {
+        printf("%s:\n", adapters[i].serial);
+        session_report(&boards[i].session, stdout);
+    }
+
+    int flashed = 0;
+    for (int i = 0; i < count; i++) {
+        if (boards[i].result.status == 0) flashed++;
+        session_deinit(&boards[i].session);
+    }
+    free(boards);
+    free(adapters);
+
+    return flashed == count ? 0 : -1;
+}
+
+#ifdef __linux__
+// USB socket of a station, kept after its board is done to recognize the same adapter coming back
+struct station_slot {
+    struct adapter adapter;
+    struct board board;
+    pthread_t thread;
+    // Flashing, set until the thread has been joined
+    int busy;
+    // The thread has finished
+    int done;
+    struct station* station;
+};
+
+struct station {
+    const struct settings* settings;
+    pthread_mutex_t lock;
+    struct station_slot slots[STATION_MAX_SLOTS];
+    int slot_count;
+    unsigned int flashed;
+    unsigned int failed;
+};
+
+// Set by SIGINT / SIGTERM in the long-running modes
+static volatile sig_atomic_t stop_requested;
+
+static void request_stop(int signal) {
+    stop_requested = 1;
+}
+
+static void* station_worker(void* arg) {
+    struct station_slot* slot = (struct station_slot*)arg;
+    struct station* station = slot->station;
+    const struct flash_result* result = &slot->board.result;
+    flash_board(&slot->board);
+
+    pthread_mutex_lock(&station->lock);
+    printf(
+      "%-12s %-20s %-16s %6.1fs  %s\n",
+      slot->adapter.usb_path,
+      slot->adapter.serial[0] ? slot->adapter.serial : "?",
+      slot->adapter.port,
+      result->elapsed,
+      result->status == 0 ? "OK" : result->error);
+    fflush(stdout);
+    if (result->status == 0)
+        station->flashed++;
+    else
+        station->failed++;
+    slot->done = 1;
+    pthread_mutex_unlock(&station->lock);
+
+    return NULL;
+}
+
+// Joins the threads of finished boards, or of every board when wait is set
+static void station_reap(struct station* station, int wait) {
+    for (int i = 0; i < station->slot_count; i++) {
+        struct station_slot* slot = &station->slots[i];
+        pthread_mutex_lock(&station->lock);
+        int done = slot->done;
+        pthread_mutex_unlock(&station->lock);
+        if (!slot->busy || (!done && !wait)) continue;
+        pthread_join(slot->thread, NULL);
+        session_deinit(&slot->board.session);
+        slot->busy = 0;
+    }
+}
+
+// Starts flashing the adapter behind a tty that was just added
+static void station_add(struct station* station, struct udev_device* dev) {
+    const struct settings* settings = station->settings;
+    struct adapter adapter;
+    const char* action = udev_device_get_action(dev);
+    if (!action || strcmp(action, "add") != 0 ||
+        udev_adapter(dev, &settings->filter, &adapter) != 0)
+        return;
+
+    struct station_slot* slot = NULL;
+    for (int i = 0; !slot && i < station->slot_count; i++) {
+        if (strcmp(station->slots[i].adapter.usb_path, adapter.usb_path) == 0)
+            slot = &station->slots[i];
+    }
+    // Opening the adapter for the reset sequences detaches and reattaches ftdi_sio, which
+    // recreates the tty. A real replug enumerates the adapter at a new address.
+    if (slot && (slot->busy ||
+                 (slot->adapter.bus == adapter.bus && slot->adapter.addr == adapter.addr)))
+        return;
+    if (!slot) {
+        if (station->slot_count == STATION_MAX_SLOTS) {
+            fprintf(stderr, "%s: too many slots, ignored\n", adapter.usb_path);
+            return;
         }
+        slot = &station->slots[station->slot_count++];
+    }
+
+    memset(slot, 0, sizeof(struct station_slot));
+    slot->adapter = adapter;
+    slot->station = station;
+    slot->board.adapter = &slot->adapter;
+    slot->board.settings = settings;
+    slot->busy = pthread_create(&slot->thread, NULL, station_worker, slot) == 0;
+    if (!slot->busy) fprintf(stderr, "%s: failed to start worker\n", adapter.usb_path);
+}
+
+// Flashes each adapter plugged in from now on, as soon as its tty appears, until interrupted
+static int flash_station(const struct settings* settings) {
+    struct udev* udev = udev_new();
+    struct udev_monitor* monitor = udev ? udev_monitor_new_from_netlink(udev, "udev") : NULL;
+    if (!monitor || udev_monitor_filter_add_match_subsystem_devtype(monitor, "tty", NULL) < 0 ||
+        udev_monitor_enable_receiving(monitor) < 0) {
+        fprintf(stderr, "Failed to monitor udev\n");
+        udev_monitor_unref(monitor);
+        udev_unref(udev);
+        return -1;
+    }
+
+    struct station* station = (struct station*)calloc(1, sizeof(struct station));
+    station->settings = settings;
+    pthread_mutex_init(&station->lock, NULL);
+    // No SA_RESTART, so the signal also breaks the wait for the next event
+    struct sigaction action = { 0 };
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    uint64_t start = timestamp_us();
+    printf("Waiting for adapters, interrupt to stop\n");
+    printf("%-12s %-20s %-16s %7s  %s\n", "Slot", "Adapter", "Port", "Time", "Result");
+    fflush(stdout);
+    struct pollfd fd = { .fd = udev_monitor_get_fd(monitor), .events = POLLIN };
+    while (!stop_requested) {
+        if (poll(&fd, 1, -1) <= 0) continue;
+        struct udev_device* dev = udev_monitor_receive_device(monitor);
+        if (!dev) continue;
+        station_reap(station, 0);
+        station_add(station, dev);
         udev_device_unref(dev);
     }
-    udev_enumerate_unref(enumerate);
+
+    // Boards already started are finished rather than left half flashed
+    station_reap(station, 1);
+    double elapsed = (timestamp_us() - start) / 1e6;
+    unsigned int total = station->flashed + station->failed;
+    printf(
+      "%u/%u boards flashed in %.1fs, %.0f per hour\n",
+      station->flashed,
+      total,
+      elapsed,
+      elapsed > 0 ? station->flashed * 3600.0 / elapsed : 0.0);
+    int status = station->failed ? -1 : 0;
+    pthread_mutex_destroy(&station->lock);
+    free(station);
+    udev_monitor_unref(monitor);
     udev_unref(udev);
-#endif
+
     return status;
 }
+#endif
 
-static int enter_bootloader(void) {
-    int status = dev_open();
-    if (status != FT_OK) return status;
-    // BOOT0: 0
-    // RESET: 0
-    if (status == FT_OK) status = dev_write(0xC3);
-    usleep(TRANSITION_DELAY);
-    // BOOT0: 1
-    // RESET: 0
-    if (status == FT_OK) status = dev_write(0xC7);
-    usleep(TRANSITION_DELAY);
-    // BOOT0: 1
-    // RESET: 1
-    if (status == FT_OK) status = dev_write(0x4F);
-    if (status == FT_OK)
-        status = dev_close();
-    else
-        dev_close();
+// Parses a comma separated list of baud rates, highest first
+static int parse_bauds(struct settings* settings, const char* list) {
+    char* end;
+    settings->baud_count = 0;
+    while (*list) {
+        unsigned long baud = strtoul(list, &end, 10);
+        if (end == list || baud == 0 || settings->baud_count == BAUD_LADDER_MAX) return -1;
+        settings->bauds[settings->baud_count++] = (unsigned int)baud;
+        list = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') return -1;
+    }
+    return settings->baud_count > 0 ? 0 : -1;
+}
 
-    return status;
+static int parse_verify(const char* name) {
+    if (strcmp(name, "none") == 0) return FLASH_VERIFY_NONE;
+    if (strcmp(name, "read") == 0) return FLASH_VERIFY_READ;
+    if (strcmp(name, "sample") == 0) return FLASH_VERIFY_SAMPLE;
+    if (strcmp(name, "crc") == 0) return FLASH_VERIFY_CRC;
+    return -1;
 }
 
-static int exit_bootloader(void) {
-    int status = dev_open();
-    if (status != FT_OK) return status;
-    // BOOT0: 0
-    // RESET: 1
-    if (status == FT_OK) status = dev_write(0x4B);
-    usleep(TRANSITION_DELAY);
-    // BOOT0: 0
-    // RESET: 0
-    if (status == FT_OK) status = dev_write(0xC3);
-    usleep(TRANSITION_DELAY);
-    // BOOT0: 0
-    // RESET: 1
-    if (status == FT_OK) status = dev_write(0x4B);
-    // BOOT0 -> INPUT
-    // RESET -> INPUT
-    if (status == FT_OK) status = dev_write(0x0F);
-    if (status == FT_OK)
-        status = dev_close();
-    else
-        dev_close();
+// Loads the image and works out how to recognize a device that already carries it. Failures are
+// reported to errors.
+static int prepare_image(struct settings* settings, FILE* errors) {
+    if (settings->cubeprog) {
+        settings->identity_size = 0;
+        return 0;
+    }
+    if (image_load(&settings->image, settings->binary_path, FLASH_BASE_ADDR) != IMAGE_OK) {
+        fprintf(errors, "Failed to load %s\n", settings->binary_path);
+        return -1;
+    }
+    image_hash(&settings->image, settings->image_hash);
+    if (settings->force) {
+        settings->identity_size = 0;
+        return 0;
+    }
+    if (!settings->identity_size &&
+        image_find_build_id(
+          &settings->image, &settings->identity_addr, &settings->identity_size) != IMAGE_OK)
+        settings->identity_size = 0;
+    if (settings->identity_size &&
+        !image_at(&settings->image, settings->identity_addr, settings->identity_size)) {
+        fprintf(errors, "Identity range is outside the image\n");
+        image_free(&settings->image);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+// Flashing daemon. A client connects to the Unix socket and sends one job as "key value" lines,
+// ended by an empty line:
+//
+//   image <absolute path>
+//   serial <adapter serial number>   optional, the first adapter found otherwise
+//   verify none|read|sample|crc      optional, the daemon's -v otherwise
+//
+// The daemon streams the progress messages back and ends with "result <status> <message>".
+
+// Adapter seen by the daemon, with a session that stays initialized from job to job
+struct daemon_adapter {
+    struct adapter adapter;
+    struct board board;
+    // Held for the whole of a job, so jobs for one adapter run one after the other
+    pthread_mutex_t lock;
+};
+
+struct daemon {
+    const struct settings* settings;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    unsigned int jobs;
+    struct daemon_adapter adapters[DAEMON_MAX_ADAPTERS];
+    int adapter_count;
+};
+
+struct daemon_job {
+    struct daemon* daemon;
+    int fd;
+};
+
+// Finds the adapter for a job, by serial number when one is given. Returns it locked with its
+// port and USB address refreshed, or NULL if it is not connected.
+static struct daemon_adapter* daemon_adapter(struct daemon* daemon, const char* serial) {
+    struct adapter_filter filter = { .serial = serial };
+    struct adapter* found;
+    struct daemon_adapter* entry = NULL;
+    // Selecting by serial number goes through the tty cache, so this rarely scans
+    int count = find_devices(&found, serial ? &filter : &daemon->settings->filter);
+
+    pthread_mutex_lock(&daemon->lock);
+    for (int i = 0; count > 0 && !entry && i < daemon->adapter_count; i++) {
+        if (strcmp(daemon->adapters[i].adapter.serial, found[0].serial) == 0)
+            entry = &daemon->adapters[i];
+    }
+    if (count > 0 && !entry && daemon->adapter_count < DAEMON_MAX_ADAPTERS) {
+        entry = &daemon->adapters[daemon->adapter_count];
+        memset(entry, 0, sizeof(struct daemon_adapter));
+        entry->adapter = found[0];
+        entry->board.adapter = &entry->adapter;
+        entry->board.warm = 1;
+        pthread_mutex_init(&entry->lock, NULL);
+        if (session_init(&entry->board.session, &entry->adapter) == FT_OK)
+            daemon->adapter_count++;
+        else
+            entry = NULL;
+    }
+    pthread_mutex_unlock(&daemon->lock);
+
+    if (entry) {
+        pthread_mutex_lock(&entry->lock);
+        entry->adapter = found[0];
+    }
+    free(found);
+    return entry;
+}
+
+static void* daemon_worker(void* arg) {
+    struct daemon_job* job = (struct daemon_job*)arg;
+    struct daemon* daemon = job->daemon;
+    FILE* in = fdopen(job->fd, "r");
+    FILE* out = fdopen(dup(job->fd), "w");
+    char line[DAEMON_LINE_MAX];
+    char image[DAEMON_LINE_MAX] = "";
+    char serial[ADAPTER_SERIAL_LENGTH] = "";
+    struct settings settings = *daemon->settings;
+    const char* error = NULL;
+    int status = -1;
+
+    while (fgets(line, sizeof(line), in) && line[0] != '\n') {
+        line[strcspn(line, "\n")] = '\0';
+        char* value = strchr(line, ' ');
+        if (!value) continue;
+        *value++ = '\0';
+        if (strcmp(line, "image") == 0)
+            snprintf(image, sizeof(image), "%s", value);
+        else if (strcmp(line, "serial") == 0)
+            snprintf(serial, sizeof(serial), "%s", value);
+        else if (strcmp(line, "verify") == 0 && (settings.verify = parse_verify(value)) < 0)
+            error = "Unknown verify mode";
+    }
+    // Progress goes to the client as it happens
+    setvbuf(out, NULL, _IOLBF, 0);
+    settings.log = out;
+    settings.binary_path = image;
+    if (!error && !image[0]) error = "No image given";
+
+    struct daemon_adapter* entry = NULL;
+    if (!error && prepare_image(&settings, out) == 0) {
+        entry = daemon_adapter(daemon, serial[0] ? serial : NULL);
+        if (entry) {
+            struct board* board = &entry->board;
+            board->settings = &settings;
+            memset(&board->result, 0, sizeof(struct flash_result));
+            board->session.phase_count = 0;
+            status = flash_board(board);
+            error = board->result.error;
+            pthread_mutex_unlock(&entry->lock);
+        } else {
+            error = "Failed to find device";
+        }
+        if (!settings.cubeprog) image_free(&settings.image);
+    } else if (!error) {
+        error = "Failed to load image";
+    }
+    fprintf(out, "result %d %s\n", status, status == 0 ? "OK" : error);
+    fclose(out);
+    fclose(in);
+    free(job);
+
+    pthread_mutex_lock(&daemon->lock);
+    if (--daemon->jobs == 0) pthread_cond_signal(&daemon->idle);
+    pthread_mutex_unlock(&daemon->lock);
+    return NULL;
+}
+
+// Serves flash jobs on a Unix socket until interrupted. Sessions and adapter lookups outlive the
+// jobs, so a job starts without initializing libftdi or scanning for the adapter again.
+// Whether address is a socket left behind by a daemon that is gone. Any other file, and the socket
+// of a daemon still running, must not be removed.
+static int daemon_stale(const struct sockaddr_un* address) {
+    struct stat info;
+    if (lstat(address->sun_path, &info) != 0 || !S_ISSOCK(info.st_mode)) return 0;
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe < 0) return 0;
+    int stale = connect(probe, (const struct sockaddr*)address, sizeof(*address)) != 0 &&
+                errno == ECONNREFUSED;
+    close(probe);
+    return stale;
+}
+
+static int flash_daemon(const char* path, const struct settings* settings) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (daemon_stale(&address)) unlink(path);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "Failed to listen on %s\n", path);
+        if (listener >= 0) close(listener);
+        return -1;
+    }
+
+    struct daemon* daemon = (struct daemon*)calloc(1, sizeof(struct daemon));
+    daemon->settings = settings;
+    pthread_mutex_init(&daemon->lock, NULL);
+    pthread_cond_init(&daemon->idle, NULL);
+    struct sigaction action = { 0 };
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    // A client that goes away mid-job must not take the daemon with it
+    signal(SIGPIPE, SIG_IGN);
+    printf("Listening on %s\n", path);
+    fflush(stdout);
+
+    while (!stop_requested) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        struct daemon_job* job = (struct daemon_job*)malloc(sizeof(struct daemon_job));
+        job->daemon = daemon;
+        job->fd = fd;
+        pthread_t thread;
+        pthread_mutex_lock(&daemon->lock);
+        daemon->jobs++;
+        pthread_mutex_unlock(&daemon->lock);
+        if (pthread_create(&thread, NULL, daemon_worker, job) == 0) {
+            pthread_detach(thread);
+            continue;
+        }
+        close(fd);
+        free(job);
+        pthread_mutex_lock(&daemon->lock);
+        daemon->jobs--;
+        pthread_mutex_unlock(&daemon->lock);
+    }
+    close(listener);
+    unlink(path);
+
+    // Jobs in progress are finished rather than left half flashed
+    pthread_mutex_lock(&daemon->lock);
+    while (daemon->jobs) pthread_cond_wait(&daemon->idle, &daemon->lock);
+    pthread_mutex_unlock(&daemon->lock);
+    for (int i = 0; i < daemon->adapter_count; i++) {
+        session_deinit(&daemon->adapters[i].board.session);
+        pthread_mutex_destroy(&daemon->adapters[i].lock);
+    }
+    pthread_cond_destroy(&daemon->idle);
+    pthread_mutex_destroy(&daemon->lock);
+    free(daemon);
+
+    return 0;
+}
+
+// Submits the image to a daemon and relays its progress, returns the job's status
+static int flash_client(const char* path, const struct settings* settings, const char* verify) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    char image[PATH_MAX];
+    char line[DAEMON_LINE_MAX];
+    int status = -1;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    // The daemon runs from another directory
+    if (!realpath(settings->binary_path, image)) {
+        fprintf(stderr, "Failed to find %s\n", settings->binary_path);
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Failed to connect to %s\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    dprintf(fd, "image %s\n", image);
+    if (settings->filter.serial) dprintf(fd, "serial %s\n", settings->filter.serial);
+    if (verify) dprintf(fd, "verify %s\n", verify);
+    dprintf(fd, "\n");
+    FILE* in = fdopen(fd, "r");
+    while (fgets(line, sizeof(line), in)) {
+        if (strncmp(line, "result ", 7) != 0) {
+            fputs(line, stdout);
+            continue;
+        }
+        char* message;
+        status = (int)strtol(line + 7, &message, 10);
+        if (status != 0) fprintf(stderr, "%s", message + 1);
+        break;
+    }
+    fclose(in);
 
     return status;
 }
+#endif
+
+// Batch mode: a manifest of "<adapter serial> <image>" lines, one job each, flashed by a pool of
+// workers. Every worker owns a deque of jobs that it works through from the bottom. Once it runs
+// dry it steals from the top of another's, so a slow board never leaves the rest of the pool idle
+// while jobs are still waiting.
+
+struct batch_image {
+    char* path;
+    // Copy of the run's settings with this image loaded, shared by its jobs
+    struct settings settings;
+    int status;
+};
+
+struct batch_job {
+    struct board board;
+    char* serial;
+    // Index into the batch's images
+    int image;
+    // Index into the batch's adapters, -1 if the adapter is not connected
+    int adapter;
+};
+
+struct batch_deque {
+    pthread_mutex_t lock;
+    struct batch_job** jobs;
+    // Next job to steal, and one past the next job the owner takes
+    int top;
+    int bottom;
+};
+
+struct batch {
+    struct batch_job* jobs;
+    int job_count;
+    struct batch_image* images;
+    int image_count;
+    struct adapter* adapters;
+    // One job at a time per adapter, should the manifest list it twice
+    pthread_mutex_t* adapter_locks;
+    int adapter_count;
+    struct batch_deque* deques;
+    int workers;
+};
+
+struct batch_worker {
+    struct batch* batch;
+    int index;
+    pthread_t thread;
+    unsigned int stolen;
+};
+
+static struct batch_job* batch_pop(struct batch_deque* deque) {
+    struct batch_job* job = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top < deque->bottom) job = deque->jobs[--deque->bottom];
+    pthread_mutex_unlock(&deque->lock);
+    return job;
+}
 
+static struct batch_job* batch_steal(struct batch_deque* deque) {
+    struct batch_job* job = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->top < deque->bottom) job = deque->jobs[deque->top++];
+    pthread_mutex_unlock(&deque->lock);
+    return job;
+}
+
+static void batch_run(struct batch* batch, struct batch_job* job) {
+    struct flash_result* result = &job->board.result;
+    if (batch->images[job->image].status != 0) {
+        snprintf(result->error, FLASH_ERROR_LENGTH, "Failed to load image");
+        result->status = -1;
+        return;
+    }
+    if (job->adapter < 0) {
+        snprintf(result->error, FLASH_ERROR_LENGTH, "Adapter not connected");
+        result->status = -1;
+        return;
+    }
+    pthread_mutex_lock(&batch->adapter_locks[job->adapter]);
+    flash_board(&job->board);
+    session_deinit(&job->board.session);
+    pthread_mutex_unlock(&batch->adapter_locks[job->adapter]);
+}
+
+static void* batch_worker(void* arg) {
+    struct batch_worker* worker = (struct batch_worker*)arg;
+    struct batch* batch = worker->batch;
+    // No jobs are added once the workers run, so every deque being empty means the batch is done
+    for (;;) {
+        struct batch_job* job = batch_pop(&batch->deques[worker->index]);
+        for (int i = 1; !job && i < batch->workers; i++) {
+            job = batch_steal(&batch->deques[(worker->index + i) % batch->workers]);
+            if (job) worker->stolen++;
+        }
+        if (!job) break;
+        batch_run(batch, job);
+    }
+    return NULL;
+}
+
+// Reads the manifest into batch, with image paths relative to the manifest's directory
+static int batch_load(struct batch* batch, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) return -1;
+    const char* slash = strrchr(path, '/');
 #ifdef _WIN32
-#define FLASH_PROGRAM "STM32_Programmer_CLI.exe"
-#elif __linux__
-#define FLASH_PROGRAM "STM32_Programmer_CLI"
+    if (strrchr(path, '\\') > slash) slash = strrchr(path, '\\');
 #endif
-#define FLASH_CONNECT_ARG " -c port="
-#define FLASH_WRITE_ARG " -w "
-#define FLASH_WRITE_ADDR " 0x08000000"
-#define FLASH_VERIFY_ARG " -v"
+    size_t dir_length = slash ? (size_t)(slash - path + 1) : 0;
+    char line[BATCH_LINE_MAX];
+    int capacity = 0;
+    int status = 0;
 
-char* parse(char* dev, char* binary_path) {
-    int command_size =
-      strlen(FLASH_PROGRAM FLASH_CONNECT_ARG FLASH_WRITE_ARG FLASH_WRITE_ADDR FLASH_VERIFY_ARG) +
-      strlen(dev) + strlen(binary_path) + 1; // Plus 1 for null terminator
-    char* command = (char*)malloc(command_size * sizeof(char));
-    snprintf(
-      command,
-      command_size,
-      "%s%s%s%s%s%s%s",
-      FLASH_PROGRAM,
-      FLASH_CONNECT_ARG,
-      dev,
-      FLASH_WRITE_ARG,
-      binary_path,
-      FLASH_WRITE_ADDR,
-      FLASH_VERIFY_ARG);
+    while (status == 0 && fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char* serial = line + strspn(line, " \t");
+        if (!*serial || *serial == '#') continue;
+        char* image = serial + strcspn(serial, " \t");
+        if (*image) *image++ = '\0';
+        image += strspn(image, " \t");
+        if (!*image) {
+            fprintf(stderr, "%s: no image for %s\n", path, serial);
+            status = -1;
+            break;
+        }
 
-    return command;
+        char* image_path;
+        int absolute = image[0] == '/';
+#ifdef _WIN32
+        absolute = absolute || image[0] == '\\' || (image[0] && image[1] == ':');
+#endif
+        if (absolute) {
+            image_path = strdup(image);
+        } else {
+            image_path = (char*)malloc(dir_length + strlen(image) + 1);
+            memcpy(image_path, path, dir_length);
+            strcpy(image_path + dir_length, image);
+        }
+        int index = 0;
+        while (index < batch->image_count && strcmp(batch->images[index].path, image_path) != 0)
+            index++;
+        if (index == batch->image_count) {
+            batch->images = (struct batch_image*)realloc(
+              batch->images, (batch->image_count + 1) * sizeof(struct batch_image));
+            memset(&batch->images[index], 0, sizeof(struct batch_image));
+            batch->images[batch->image_count++].path = image_path;
+        } else {
+            free(image_path);
+        }
+
+        if (batch->job_count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            batch->jobs =
+              (struct batch_job*)realloc(batch->jobs, capacity * sizeof(struct batch_job));
+        }
+        struct batch_job* job = &batch->jobs[batch->job_count++];
+        memset(job, 0, sizeof(struct batch_job));
+        job->serial = strdup(serial);
+        job->image = index;
+        job->board.result.status = -1;
+        snprintf(job->board.result.error, FLASH_ERROR_LENGTH, "Not run");
+    }
+    fclose(file);
+    return status;
 }
 
-int main(int argc, char** argv) {
-    char* dev;
-    char* command;
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of count sorted values
+static double percentile(const double* sorted, int count, int percent) {
+    int rank = (percent * count + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void batch_report(const struct batch* batch, double elapsed, unsigned int stolen) {
+    int flashed = 0;
+    int timed = 0;
+    double bytes = 0;
+    double* times = (double*)malloc(batch->job_count * sizeof(double));
+
+    printf("%-20s %-32s %7s  %s\n", "Adapter", "Image", "Time", "Result");
+    for (int i = 0; i < batch->job_count; i++) {
+        const struct batch_job* job = &batch->jobs[i];
+        const struct batch_image* image = &batch->images[job->image];
+        const struct flash_result* result = &job->board.result;
+        const char* name = strrchr(image->path, '/');
+        printf(
+          "%-20s %-32s %6.1fs  %s\n",
+          job->serial,
+          name ? name + 1 : image->path,
+          result->elapsed,
+          result->status == 0 ? "OK" : result->error);
+        // Jobs that never reached an adapter would drag the percentiles down
+        if (result->elapsed > 0) times[timed++] = result->elapsed;
+        if (result->status != 0) continue;
+        flashed++;
+        if (!image->settings.cubeprog) bytes += image_size(&image->settings.image);
+    }
+    printf(
+      "%d/%d boards flashed in %.1fs, %.0f per hour, %.1f KB/s, %u job(s) stolen\n",
+      flashed,
+      batch->job_count,
+      elapsed,
+      elapsed > 0 ? flashed * 3600.0 / elapsed : 0.0,
+      elapsed > 0 ? bytes / 1024.0 / elapsed : 0.0,
+      stolen);
+    if (timed) {
+        qsort(times, timed, sizeof(double), compare_double);
+        printf(
+          "Job time p50 %.2fs, p95 %.2fs, p99 %.2fs, max %.2fs\n",
+          percentile(times, timed, 50),
+          percentile(times, timed, 95),
+          percentile(times, timed, 99),
+          times[timed - 1]);
+    }
+    free(times);
+}
+
+// Flashes every job of the manifest at path with workers threads
+static int flash_batch(const char* path, const struct settings* settings, int workers) {
+    struct batch batch = { 0 };
+    int status = 0;
+    if (batch_load(&batch, path) != 0) {
+        fprintf(stderr, "Failed to read %s\n", path);
+        status = -1;
+    } else if (batch.job_count == 0) {
+        // Nothing asked for, nothing failed
+        fprintf(stderr, "No jobs in %s\n", path);
+    }
+    if (status != 0 || batch.job_count == 0) workers = 0;
+    for (int i = 0; workers && i < batch.image_count; i++) {
+        struct batch_image* image = &batch.images[i];
+        image->settings = *settings;
+        image->settings.binary_path = image->path;
+        image->status = prepare_image(&image->settings, stderr);
+    }
+
+    // One scan for the whole batch, jobs are matched to adapters by serial number
+    if (workers) batch.adapter_count = find_devices(&batch.adapters, NULL);
+    if (batch.adapter_count < 0) batch.adapter_count = 0;
+    batch.adapter_locks =
+      (pthread_mutex_t*)calloc(batch.adapter_count + 1, sizeof(pthread_mutex_t));
+    for (int i = 0; i < batch.adapter_count; i++) pthread_mutex_init(&batch.adapter_locks[i], NULL);
+    for (int i = 0; i < batch.job_count; i++) {
+        struct batch_job* job = &batch.jobs[i];
+        job->adapter = -1;
+        for (int j = 0; job->adapter < 0 && j < batch.adapter_count; j++) {
+            if (strcmp(batch.adapters[j].serial, job->serial) == 0) job->adapter = j;
+        }
+        job->board.settings = &batch.images[job->image].settings;
+        if (job->adapter >= 0) job->board.adapter = &batch.adapters[job->adapter];
+    }
+
+    // Dealt out round robin and stacked so that each worker starts with its earliest job
+    if (workers > batch.job_count) workers = batch.job_count;
+    batch.workers = workers;
+    batch.deques = (struct batch_deque*)calloc(workers + 1, sizeof(struct batch_deque));
+    for (int i = 0; i < workers; i++) {
+        struct batch_deque* deque = &batch.deques[i];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->jobs = (struct batch_job**)malloc(
+          ((batch.job_count + workers - 1) / workers) * sizeof(struct batch_job*));
+        for (int j = i + (batch.job_count - 1 - i) / workers * workers; j >= i; j -= workers)
+            deque->jobs[deque->bottom++] = &batch.jobs[j];
+    }
+
+    uint64_t start = timestamp_us();
+    struct batch_worker* pool =
+      (struct batch_worker*)calloc(workers + 1, sizeof(struct batch_worker));
+    unsigned int stolen = 0;
+    for (int i = 0; i < workers; i++) {
+        pool[i].batch = &batch;
+        pool[i].index = i;
+        if (pthread_create(&pool[i].thread, NULL, batch_worker, &pool[i]) != 0)
+            pool[i].batch = NULL;
+    }
+    // A worker that failed to start leaves its deque to be stolen from
+    for (int i = 0; i < workers; i++) {
+        if (pool[i].batch) pthread_join(pool[i].thread, NULL);
+        stolen += pool[i].stolen;
+    }
+    double elapsed = (timestamp_us() - start) / 1e6;
+
+    int flashed = 0;
+    if (workers) batch_report(&batch, elapsed, stolen);
+    for (int i = 0; i < batch.job_count; i++) {
+        if (batch.jobs[i].board.result.status == 0) flashed++;
+        free(batch.jobs[i].serial);
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_destroy(&batch.deques[i].lock);
+        free(batch.deques[i].jobs);
+    }
+    for (int i = 0; i < batch.adapter_count; i++) pthread_mutex_destroy(&batch.adapter_locks[i]);
+    for (int i = 0; i < batch.image_count; i++) {
+        struct batch_image* image = &batch.images[i];
+        if (image->status == 0 && image->settings.binary_path && !image->settings.cubeprog)
+            image_free(&image->settings.image);
+        free(image->path);
+    }
+    free(pool);
+    free(batch.deques);
+    free(batch.adapter_locks);
+    free(batch.adapters);
+    free(batch.images);
+    free(batch.jobs);
 
+    if (workers && flashed != batch.job_count) status = -1;
+    return status;
+}
+
+static void usage(void) {
+    fprintf(
+      stderr,
+      "usage: [-a] [-b baud,...] [-B manifest] [-c] [-C socket] [-d] [-D socket] [-e] [-f] "
+      "[-g ftdi|dtr|sim] [-i addr[:size]] [-j workers] [-l ms] [-m] [-p port] [-r stub.bin] "
+      "[-R baud] [-s] [-S serial] [-t tty|ftdi] [-T file] [-U usb path] "
+      "[-v none|read|sample|crc] [-w banner] <path/to/image>\n");
+    fprintf(stderr, "  -a  flash every connected adapter concurrently\n");
+    fprintf(
+      stderr,
+      "  -b  baud rates to try, highest first, stepping down on link errors (default "
+      "%s)\n",
+      FLASH_BAUD_LADDER);
+    fprintf(
+      stderr,
+      "  -B  flash the jobs of a manifest, one \"<adapter serial> <image>\" line each, "
+      "instead of a single image\n");
+    fprintf(stderr, "  -c  program through STM32CubeProgrammer instead of the built-in engine\n");
+#ifdef __linux__
+    fprintf(
+      stderr,
+      "  -C  hand the image to the daemon listening on this socket, with -S and -v, and relay "
+      "its progress\n");
+#endif
+    fprintf(stderr, "  -d  only erase and program the pages that differ from the image\n");
+#ifdef __linux__
+    fprintf(
+      stderr,
+      "  -D  run as a daemon taking flash jobs on this Unix socket, the image then comes with "
+      "each job\n");
+#endif
+#ifdef __linux__
+    fprintf(stderr, "  -e  with -a, drive every adapter from a single event loop thread\n");
+#endif
+    fprintf(stderr, "  -f  flash devices even when they already carry the image\n");
+    fprintf(
+      stderr,
+      "  -g  BOOT0/NRST control: the adapter's CBUS pins (default), its DTR/RTS lines, or a "
+      "simulated adapter that records and checks the reset timing, needs -p\n");
+    fprintf(
+      stderr,
+      "  -i  image bytes identifying the build, read back to skip up to date devices (default "
+      "GNU build-id note, %d bytes when size is omitted)\n",
+      IDENTITY_SIZE);
+    fprintf(stderr, "  -j  worker threads for -B (default %d)\n", BATCH_WORKERS);
+    fprintf(
+      stderr,
+      "  -l  adapter latency timer in milliseconds, 0 for the driver default (default %d)\n",
+      FLASH_LATENCY);
+#ifdef __linux__
+    fprintf(
+      stderr,
+      "  -m  station mode: keep running and flash each adapter as soon as it is plugged in\n");
+#endif
+    fprintf(
+      stderr,
+      "  -p  bootloader traffic on this COM port / tty instead of the adapter's, for example "
+      "a pty from stm32sim\n");
+    fprintf(
+      stderr,
+      "  -r  program supported parts through this SRAM stub, built from stub/, instead of the "
+      "bootloader's Write Memory command\n");
+    fprintf(stderr, "  -R  line rate for the stub (default %d)\n", STUB_BAUD);
+    fprintf(stderr, "  -s  report device open/close overhead saved per phase\n");
+    fprintf(stderr, "  -S  only the adapter with this USB serial number\n");
+    fprintf(stderr, "  -t  bootloader transport: COM port / ttyUSB (default) or FTDI driver\n");
+    fprintf(
+      stderr,
+      "  -T  append per-phase times, throughput and round trips to a CSV file, or to a JSON "
+      "lines file if it ends in .jsonl\n");
 #ifdef __linux__
-    ftdi = ftdi_new();
-    ftdi->module_detach_mode = AUTO_DETACH_REATACH_SIO_MODULE;
+    fprintf(stderr, "  -U  only the adapter on this USB port chain, for example 1-1.2\n");
 #endif
+    fprintf(
+      stderr,
+      "  -v  verify by full read-back, sampled read-back or on-target CRC32 (default crc)\n");
+    fprintf(
+      stderr,
+      "  -w  after the restart, wait up to %d ms for the application to print banner, or any "
+      "byte if it is empty, needs -t ftdi, -p or -g dtr\n",
+      APP_START_TIMEOUT);
+}
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: <path/to/binary>\n");
+// Parses addr[:size]
+static int parse_identity(struct settings* settings, const char* range) {
+    char* end;
+    settings->identity_addr = (uint32_t)strtoul(range, &end, 0);
+    settings->identity_size = IDENTITY_SIZE;
+    if (end == range) return -1;
+    if (*end == ':') {
+        range = end + 1;
+        settings->identity_size = strtoul(range, &end, 0);
+        if (end == range) return -1;
+    }
+    if (*end || settings->identity_size == 0 || settings->identity_size > STM32_MAX_TRANSFER)
         return -1;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    struct settings settings = {
+        .transport = TRANSPORT_TTY,
+        .gpio = &gpio_ftdi,
+        .latency = FLASH_LATENCY,
+        .verify = FLASH_VERIFY_CRC,
+        .stub_baud = STUB_BAUD,
+        .log = stdout,
+    };
+    struct board board = { .settings = &settings };
+    struct adapter* adapters = NULL;
+    int all = 0;
+    const char* stub_path = NULL;
+    const char* timing_path = NULL;
+    const char* daemon_path = NULL;
+    const char* client_path = NULL;
+    const char* verify_name = NULL;
+    const char* batch_path = NULL;
+    int workers = BATCH_WORKERS;
+    int status;
+    int opt;
+
+    parse_bauds(&settings, FLASH_BAUD_LADDER);
+    while ((opt = getopt(argc, argv, "ab:B:cC:dD:efg:i:j:l:mp:r:R:sS:t:T:U:v:w:")) != -1) {
+        switch (opt) {
+            case 'a':
+                all = 1;
+                break;
+            case 'b':
+                if (parse_bauds(&settings, optarg) != 0) {
+                    usage();
+                    return -1;
+                }
+                break;
+            case 'B':
+                batch_path = optarg;
+                break;
+            case 'c':
+                settings.cubeprog = 1;
+                break;
+#ifdef __linux__
+            case 'C':
+                client_path = optarg;
+                break;
+#endif
+            case 'd':
+                settings.delta = 1;
+                break;
+#ifdef __linux__
+            case 'D':
+                daemon_path = optarg;
+                break;
+#endif
+#ifdef __linux__
+            case 'e':
+                settings.event_loop = 1;
+                break;
+#endif
+            case 'f':
+                settings.force = 1;
+                break;
+            case 'g':
+                if (strcmp(optarg, "ftdi") == 0)
+                    settings.gpio = &gpio_ftdi;
+                else if (strcmp(optarg, "dtr") == 0)
+                    settings.gpio = &gpio_dtr;
+                else if (strcmp(optarg, "sim") == 0)
+                    settings.gpio = &gpio_sim;
+                else
+                    settings.gpio = NULL;
+                if (settings.gpio) break;
+                usage();
+                return -1;
+            case 'i':
+                if (parse_identity(&settings, optarg) == 0) break;
+                usage();
+                return -1;
+#ifdef __linux__
+            case 'm':
+                settings.station = 1;
+                break;
+#endif
+            case 'j':
+                workers = atoi(optarg);
+                if (workers > 0) break;
+                usage();
+                return -1;
+            case 'l':
+                settings.latency = (unsigned int)strtoul(optarg, NULL, 10);
+                if (settings.latency <= 255) break;
+                usage();
+                return -1;
+            case 'p':
+                settings.port = optarg;
+                break;
+            case 'r':
+                stub_path = optarg;
+                break;
+            case 'R':
+                settings.stub_baud = (unsigned int)strtoul(optarg, NULL, 10);
+                if (settings.stub_baud > 0) break;
+                usage();
+                return -1;
+            case 's':
+                settings.report = 1;
+                break;
+            case 'S':
+                settings.filter.serial = optarg;
+                break;
+            case 't':
+                if (strcmp(optarg, "tty") == 0)
+                    settings.transport = TRANSPORT_TTY;
+                else if (strcmp(optarg, "ftdi") == 0)
+                    settings.transport = TRANSPORT_FTDI;
+                else
+                    settings.transport = -1;
+                if (settings.transport >= 0) break;
+                usage();
+                return -1;
+            case 'T':
+                timing_path = optarg;
+                break;
+#ifdef __linux__
+            case 'U':
+                settings.filter.usb_path = optarg;
+                break;
+#endif
+            case 'w':
+                settings.banner = optarg;
+                if (strlen(settings.banner) <= APP_BANNER_MAX) break;
+                usage();
+                return -1;
+            case 'v':
+                verify_name = optarg;
+                settings.verify = parse_verify(optarg);
+                if (settings.verify >= 0) break;
+                // fall through
+            default:
+                usage();
+                return -1;
+        }
     }
-    if (find_device(&dev) != FT_OK) {
-        fprintf(stderr, "Failed to find device\n");
+    if (optind != argc - (daemon_path || batch_path ? 0 : 1) ||
+        (!!daemon_path + !!client_path + !!batch_path > 1) ||
+        ((daemon_path || client_path || batch_path) &&
+         (all || settings.station || settings.port || timing_path)) ||
+        (settings.cubeprog && (settings.transport == TRANSPORT_FTDI || settings.delta)) ||
+        (settings.event_loop &&
+         (!all || settings.cubeprog || settings.delta || settings.transport == TRANSPORT_FTDI)) ||
+        (stub_path && (settings.cubeprog || settings.event_loop)) ||
+        (settings.port && (all || settings.transport == TRANSPORT_FTDI)) ||
+        (settings.gpio == &gpio_sim && !settings.port) || (timing_path && all) ||
+        (settings.station && (all || settings.port || timing_path)) ||
+        (settings.gpio == &gpio_dtr && (settings.cubeprog || settings.event_loop)) ||
+        (settings.banner &&
+         (settings.cubeprog ||
+          (settings.transport != TRANSPORT_FTDI && !settings.port &&
+           settings.gpio != &gpio_dtr)))) {
+        usage();
         return -1;
     }
-    if (enter_bootloader() != FT_OK) {
-        fprintf(stderr, "Failed to enter bootloader mode\n");
+    settings.binary_path = daemon_path || batch_path ? NULL : argv[optind];
+    if (stub_path && stub_load(&settings.stub, stub_path) != STM32_OK) {
+        fprintf(stderr, "Failed to load stub %s\n", stub_path);
         return -1;
     }
-
-    command = parse(dev, argv[1]);
-    system(command);
-    free(dev);
-    free(command);
-
-    if (exit_bootloader() != FT_OK) {
-        fprintf(stderr, "Failed to exit bootloader mode\n");
+    if (settings.binary_path && !client_path && prepare_image(&settings, stderr) != 0) {
+        stub_free(&settings.stub);
         return -1;
     }
 
+    if (all) {
+        settings.log = NULL;
+        status = flash_all(&settings);
+    } else if (batch_path) {
+        settings.log = NULL;
+        status = flash_batch(batch_path, &settings, workers);
 #ifdef __linux__
-    ftdi_deinit(ftdi);
+    } else if (daemon_path) {
+        status = flash_daemon(daemon_path, &settings);
+    } else if (client_path) {
+        status = flash_client(client_path, &settings, verify_name);
+    } else if (settings.station) {
+        settings.log = NULL;
+        status = flash_station(&settings);
 #endif
+    } else {
+        // Open the first adapter by serial number so its baud rate can be remembered
+        if (find_devices(&adapters, &settings.filter) > 0) board.adapter = &adapters[0];
+        if (!board.adapter && (settings.filter.serial || settings.filter.usb_path)) {
+            snprintf(board.result.error, FLASH_ERROR_LENGTH, "No adapter matches -S / -U");
+            status = -1;
+        } else {
+            status = flash_board(&board);
+        }
+        if (status != 0) fprintf(stderr, "%s\n", board.result.error);
+        if (timing_path && write_timing(&board, timing_path) != 0)
+            fprintf(stderr, "Failed to write %s\n", timing_path);
+        if (settings.report) session_report(&board.session, stdout);
+        session_deinit(&board.session);
+        free(adapters);
+    }
+    if (settings.binary_path && !client_path && !settings.cubeprog) image_free(&settings.image);
+    stub_free(&settings.stub);
 
-    return 0;
-}
\ No newline at end of file
+    return status == 0 ? 0 : -1;
+}
@@ -0,0 +1,162 @@
+#include "cache.h"
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_DIR "stm32handsfree"
+#define CACHE_LINE_LENGTH (CACHE_KEY_LENGTH + CACHE_VALUE_LENGTH + 2)
+
+// Serializes the read-modify-write of cache_put() between threads of this process, and together
+// with a lock on "<name>.lock" between processes. Readers only ever see whole files thanks to the
+// rename.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int cache_serial;
+
+static int cache_dir(char* path, size_t size) {
+#ifdef _WIN32
+    const char* base = getenv("LOCALAPPDATA");
+    if (!base) return CACHE_ERR_IO;
+    snprintf(path, size, "%s\\" CACHE_DIR, base);
+    _mkdir(path);
+#else
+    const char* base = getenv("XDG_CACHE_HOME");
+    if (base && base[0]) {
+        mkdir(base, 0755);
+        snprintf(path, size, "%s/" CACHE_DIR, base);
+    } else {
+        base = getenv("HOME");
+        if (!base) return CACHE_ERR_IO;
+        snprintf(path, size, "%s/.cache", base);
+        mkdir(path, 0755);
+        snprintf(path, size, "%s/.cache/" CACHE_DIR, base);
+    }
+    mkdir(path, 0755);
+#endif
+    return CACHE_OK;
+}
+
+int cache_path(const char* name, char* path, size_t size) {
+    char dir[CACHE_PATH_LENGTH];
+    if (cache_dir(dir, sizeof(dir)) != CACHE_OK) return CACHE_ERR_IO;
+    snprintf(path, size, "%s/%s", dir, name);
+    return CACHE_OK;
+}
+
+// Splits line into key and value, returns the value or NULL for a malformed line
+static char* cache_split(char* line) {
+    line[strcspn(line, "\r\n")] = '\0';
+    char* value = strchr(line, ' ');
+    if (!value) return NULL;
+    *value++ = '\0';
+    return value;
+}
+
+int cache_get(const char* name, const char* key, char* value, size_t size) {
+    char path[CACHE_PATH_LENGTH];
+    char line[CACHE_LINE_LENGTH];
+    if (cache_path(name, path, sizeof(path)) != CACHE_OK) return CACHE_ERR_IO;
+
+    FILE* file = fopen(path, "r");
+    if (!file) return CACHE_ERR_MISSING;
+    int status = CACHE_ERR_MISSING;
+    while (status == CACHE_ERR_MISSING && fgets(line, sizeof(line), file)) {
+        char* entry = cache_split(line);
+        if (!entry || strcmp(line, key) != 0) continue;
+        snprintf(value, size, "%s", entry);
+        status = CACHE_OK;
+    }
+    fclose(file);
+
+    return status;
+}
+
+#ifdef _WIN32
+static HANDLE cache_lock_file(const char* path) {
+    OVERLAPPED overlapped = { 0 };
+    HANDLE file = CreateFileA(
+      path,
+      GENERIC_READ | GENERIC_WRITE,
+      FILE_SHARE_READ | FILE_SHARE_WRITE,
+      NULL,
+      OPEN_ALWAYS,
+      FILE_ATTRIBUTE_NORMAL,
+      NULL);
+    if (file != INVALID_HANDLE_VALUE)
+        LockFileEx(file, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped);
+    return file;
+}
+
+static void cache_unlock_file(HANDLE file) {
+    // Closing the handle releases the lock
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+}
+#else
+static int cache_lock_file(const char* path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd >= 0) flock(fd, LOCK_EX);
+    return fd;
+}
+
+static void cache_unlock_file(int fd) {
+    // Closing the descriptor releases the lock
+    if (fd >= 0) close(fd);
+}
+#endif
+
+int cache_put(const char* name, const char* key, const char* value) {
+    char path[CACHE_PATH_LENGTH];
+    char temp[CACHE_PATH_LENGTH + 32];
+    char line[CACHE_LINE_LENGTH];
+    if (cache_path(name, path, sizeof(path)) != CACHE_OK) return CACHE_ERR_IO;
+
+    pthread_mutex_lock(&cache_lock);
+    // Best effort, without it concurrent processes can only lose each other's updates
+    snprintf(temp, sizeof(temp), "%s.lock", path);
+#ifdef _WIN32
+    HANDLE lock = cache_lock_file(temp);
+    snprintf(temp, sizeof(temp), "%s.%d.%u", path, _getpid(), cache_serial++);
+#else
+    int lock = cache_lock_file(temp);
+    snprintf(temp, sizeof(temp), "%s.%d.%u", path, (int)getpid(), cache_serial++);
+#endif
+    FILE* out = fopen(temp, "w");
+    if (!out) {
+        cache_unlock_file(lock);
+        pthread_mutex_unlock(&cache_lock);
+        return CACHE_ERR_IO;
+    }
+    // Carry over every other entry
+    FILE* in = fopen(path, "r");
+    while (in && fgets(line, sizeof(line), in)) {
+        char* entry = cache_split(line);
+        if (entry && strcmp(line, key) != 0) fprintf(out, "%s %s\n", line, entry);
+    }
+    if (in) fclose(in);
+    if (value) fprintf(out, "%s %s\n", key, value);
+
+    int status = fclose(out) == 0 ? CACHE_OK : CACHE_ERR_IO;
+#ifdef _WIN32
+    if (status == CACHE_OK && !MoveFileExA(temp, path, MOVEFILE_REPLACE_EXISTING))
+        status = CACHE_ERR_IO;
+#else
+    if (status == CACHE_OK && rename(temp, path) != 0) status = CACHE_ERR_IO;
+#endif
+    if (status != CACHE_OK) remove(temp);
+    cache_unlock_file(lock);
+    pthread_mutex_unlock(&cache_lock);
+
+    return status;
+}
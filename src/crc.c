@@ -0,0 +1,48 @@
+#include "crc.h"
+
+#include <pthread.h>
+
+// Slice-by-8: crc_tables[k][i] advances byte i through k more zero bytes, so eight bytes are
+// folded in with eight independent lookups
+static uint32_t crc_tables[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init_tables(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i << 24;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 0x80000000 ? (crc << 1) ^ CRC_POLYNOMIAL : crc << 1;
+        crc_tables[0][i] = crc;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t crc = crc_tables[k - 1][i];
+            crc_tables[k][i] = (crc << 8) ^ crc_tables[0][crc >> 24];
+        }
+    }
+}
+
+// Words are stored little endian but shifted in most significant byte first
+static uint32_t crc_word(const unsigned char* data) {
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 |
+           (uint32_t)data[3] << 24;
+}
+
+uint32_t crc_update(uint32_t crc, const unsigned char* data, size_t size) {
+    pthread_once(&crc_once, crc_init_tables);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint32_t high = crc ^ crc_word(data + i);
+        uint32_t low = crc_word(data + i + 4);
+        crc = crc_tables[7][high >> 24] ^ crc_tables[6][(high >> 16) & 0xFF] ^
+              crc_tables[5][(high >> 8) & 0xFF] ^ crc_tables[4][high & 0xFF] ^
+              crc_tables[3][low >> 24] ^ crc_tables[2][(low >> 16) & 0xFF] ^
+              crc_tables[1][(low >> 8) & 0xFF] ^ crc_tables[0][low & 0xFF];
+    }
+    for (; i + 4 <= size; i += 4) {
+        uint32_t word = crc_word(data + i);
+        for (int shift = 24; shift >= 0; shift -= 8)
+            crc = (crc << 8) ^ crc_tables[0][(crc >> 24) ^ ((word >> shift) & 0xFF)];
+    }
+    return crc;
+}
@@ -0,0 +1,148 @@
+#include "device.h"
+
+#define KB 1024
+
+// Layouts and product IDs from AN2606 and the reference manuals, erase times from the datasheets
+static const struct device devices[] = {
+    { 0x410, "STM32F10xxx medium-density", 0x08000000, { { 128, 1 * KB, 20 } }, 20, 0x1FFFF7E8 },
+    { 0x412, "STM32F10xxx low-density", 0x08000000, { { 32, 1 * KB, 20 } }, 20, 0x1FFFF7E8 },
+    { 0x414, "STM32F10xxx high-density", 0x08000000, { { 256, 2 * KB, 20 } }, 20, 0x1FFFF7E8 },
+    { 0x418, "STM32F105xx/107xx", 0x08000000, { { 128, 2 * KB, 20 } }, 20, 0x1FFFF7E8 },
+    { 0x420, "STM32F100xx medium-density", 0x08000000, { { 128, 1 * KB, 20 } }, 20, 0x1FFFF7E8 },
+    { 0x428, "STM32F100xx high-density", 0x08000000, { { 256, 2 * KB, 20 } }, 20, 0x1FFFF7E8 },
+    { 0x430, "STM32F10xxx XL-density", 0x08000000, { { 512, 2 * KB, 20 } }, 20, 0x1FFFF7E8 },
+    { 0x440, "STM32F05xxx/F030x8", 0x08000000, { { 64, 1 * KB, 20 } }, 20, 0x1FFFF7AC },
+    { 0x442, "STM32F09xxx/F030xC", 0x08000000, { { 128, 2 * KB, 20 } }, 20, 0x1FFFF7AC },
+    { 0x444, "STM32F03xx4/6", 0x08000000, { { 32, 1 * KB, 20 } }, 20, 0x1FFFF7AC },
+    { 0x445, "STM32F04xxx/F070x6", 0x08000000, { { 32, 1 * KB, 20 } }, 20, 0x1FFFF7AC },
+    { 0x448, "STM32F07xxx", 0x08000000, { { 64, 2 * KB, 20 } }, 20, 0x1FFFF7AC },
+    { 0x422, "STM32F302xB(C)/F303xB(C)", 0x08000000, { { 128, 2 * KB, 20 } }, 20, 0x1FFFF7AC },
+    { 0x438, "STM32F303x4(6/8)/F334xx", 0x08000000, { { 32, 2 * KB, 20 } }, 20, 0x1FFFF7AC },
+    { 0x466, "STM32G03xxx/G04xxx", 0x08000000, { { 32, 2 * KB, 22 } }, 22, 0x1FFF7590 },
+    { 0x460, "STM32G07xxx/G08xxx", 0x08000000, { { 64, 2 * KB, 22 } }, 22, 0x1FFF7590 },
+    { 0x468, "STM32G431xx/G441xx", 0x08000000, { { 64, 2 * KB, 22 } }, 22, 0x1FFF7590 },
+    { 0x435, "STM32L43xxx/L44xxx", 0x08000000, { { 128, 2 * KB, 22 } }, 22, 0x1FFF7590 },
+    { 0x462, "STM32L45xxx/L46xxx", 0x08000000, { { 256, 2 * KB, 22 } }, 22, 0x1FFF7590 },
+    { 0x415, "STM32L47xxx/L48xxx", 0x08000000, { { 512, 2 * KB, 22 } }, 22, 0x1FFF7590 },
+    { 0x411,
+      "STM32F2xxxx",
+      0x08000000,
+      { { 4, 16 * KB, 250 }, { 1, 64 * KB, 500 }, { 7, 128 * KB, 1000 } },
+      8000,
+      0x1FFF7A10 },
+    { 0x413,
+      "STM32F40xxx/41xxx",
+      0x08000000,
+      { { 4, 16 * KB, 250 }, { 1, 64 * KB, 500 }, { 7, 128 * KB, 1000 } },
+      8000,
+      0x1FFF7A10 },
+    { 0x419,
+      "STM32F42xxx/43xxx",
+      0x08000000,
+      { { 4, 16 * KB, 250 },
+        { 1, 64 * KB, 500 },
+        { 7, 128 * KB, 1000 },
+        { 4, 16 * KB, 250 },
+        { 1, 64 * KB, 500 },
+        { 7, 128 * KB, 1000 } },
+      16000,
+      0x1FFF7A10 },
+    { 0x423,
+      "STM32F401xB(C)",
+      0x08000000,
+      { { 4, 16 * KB, 250 }, { 1, 64 * KB, 500 }, { 1, 128 * KB, 1000 } },
+      2000,
+      0x1FFF7A10 },
+    { 0x433,
+      "STM32F401xD(E)",
+      0x08000000,
+      { { 4, 16 * KB, 250 }, { 1, 64 * KB, 500 }, { 3, 128 * KB, 1000 } },
+      4000,
+      0x1FFF7A10 },
+    { 0x431,
+      "STM32F411xx",
+      0x08000000,
+      { { 4, 16 * KB, 250 }, { 1, 64 * KB, 500 }, { 3, 128 * KB, 1000 } },
+      4000,
+      0x1FFF7A10 },
+    { 0x421,
+      "STM32F446xx",
+      0x08000000,
+      { { 4, 16 * KB, 250 }, { 1, 64 * KB, 500 }, { 3, 128 * KB, 1000 } },
+      4000,
+      0x1FFF7A10 },
+    { 0x449,
+      "STM32F74xxx/75xxx",
+      0x08000000,
+      { { 4, 32 * KB, 250 }, { 1, 128 * KB, 1000 }, { 3, 256 * KB, 2000 } },
+      8000,
+      0x1FF0F420 },
+    { 0x451,
+      "STM32F76xxx/77xxx",
+      0x08000000,
+      { { 4, 32 * KB, 250 }, { 1, 128 * KB, 1000 }, { 7, 256 * KB, 2000 } },
+      16000,
+      0x1FF0F420 },
+};
+
+const struct device* device_find(uint16_t pid) {
+    for (size_t i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+        if (devices[i].pid == pid) return &devices[i];
+    }
+    return NULL;
+}
+
+uint32_t device_flash_size(const struct device* device) {
+    uint32_t size = 0;
+    for (int i = 0; i < DEVICE_MAX_REGIONS; i++)
+        size += device->regions[i].count * device->regions[i].size;
+    return size;
+}
+
+size_t device_page_count(const struct device* device) {
+    size_t count = 0;
+    for (int i = 0; i < DEVICE_MAX_REGIONS; i++) count += device->regions[i].count;
+    return count;
+}
+
+// Region holding page, with page made relative to it
+static const struct device_region* device_region(const struct device* device, size_t* page) {
+    for (int i = 0; i < DEVICE_MAX_REGIONS; i++) {
+        if (*page < device->regions[i].count) return &device->regions[i];
+        *page -= device->regions[i].count;
+    }
+    return NULL;
+}
+
+uint32_t device_page_addr(const struct device* device, size_t page) {
+    uint32_t addr = device->flash_base;
+    for (int i = 0; i < DEVICE_MAX_REGIONS && page > 0; i++) {
+        size_t count = page < device->regions[i].count ? page : device->regions[i].count;
+        addr += count * device->regions[i].size;
+        page -= count;
+    }
+    return addr;
+}
+
+uint32_t device_page_size(const struct device* device, size_t page) {
+    const struct device_region* region = device_region(device, &page);
+    return region ? region->size : 0;
+}
+
+unsigned int device_page_erase_time(const struct device* device, size_t page) {
+    const struct device_region* region = device_region(device, &page);
+    return region ? region->erase_time : 0;
+}
+
+long device_page(const struct device* device, uint32_t addr) {
+    if (addr < device->flash_base) return -1;
+    uint32_t offset = addr - device->flash_base;
+    long page = 0;
+    for (int i = 0; i < DEVICE_MAX_REGIONS; i++) {
+        const struct device_region* region = &device->regions[i];
+        if (offset < region->count * region->size) return page + offset / region->size;
+        offset -= region->count * region->size;
+        page += region->count;
+    }
+    return -1;
+}
@@ -0,0 +1,846 @@
+#include "engine.h"
+
+#ifdef __linux__
+#include "crc.h"
+#include "device.h"
+#include "serial.h"
+#include "timestamp.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define ENGINE_OPEN_TIMEOUT 3000 // milliseconds
+#define ENGINE_OPEN_RETRY 10     // milliseconds
+#define ENGINE_EVENTS 64
+
+// epoll user data: board index << 1 | source
+#define SOURCE_TTY 0
+#define SOURCE_TIMER 1
+
+#define STATE_ENTER 0
+#define STATE_OPEN 1
+#define STATE_SYNC 2
+#define STATE_GET 3
+#define STATE_GET_ID 4
+#define STATE_IDENTITY 5
+#define STATE_UID 6
+#define STATE_ERASE 7
+#define STATE_WRITE 8
+#define STATE_VERIFY 9
+#define STATE_CHECKSUM 10
+#define STATE_EXIT 11
+#define STATE_DONE 12
+
+struct engine_board {
+    const struct adapter* adapter;
+    struct session* session;
+    struct flash_result* result;
+    char* dev;
+    int tty;
+    struct serial_latency latency;
+    int timer;
+    int state;
+    // Reset step, open retry or sync attempt within the state
+    unsigned int step;
+    // Exchange within the current command
+    unsigned int stage;
+    // Block being written or verified, or next page to erase
+    size_t block;
+    // Blocks of the current write and verify pass. The plan's deferred identity blocks get a pass
+    // of their own once the others have verified.
+    size_t first;
+    size_t end;
+    // Pages to erase, none for a mass erase
+    uint16_t* pages;
+    size_t page_count;
+    // Segment being checked with Get Checksum and the block after it
+    struct flash_checksum checksum;
+    size_t checksum_end;
+    // Unique device ID, valid when cached is set
+    unsigned char uid[DEVICE_UID_LENGTH];
+    int cached;
+    // Request being sent and reply being collected
+    unsigned char tx[STM32_MAX_FRAME];
+    size_t tx_size;
+    size_t tx_sent;
+    int tx_blocked;
+    unsigned char rx[STM32_MAX_TRANSFER + 2];
+    size_t rx_size;
+    size_t rx_received;
+    // Set while a reply is outstanding, the timer then runs its timeout
+    int waiting;
+    // The reply has to start with ACK, a NACK fails it straight away
+    int expect_ack;
+    // Bootloader version, command set and product ID
+    struct stm32 stm;
+    uint64_t start;
+};
+
+struct engine {
+    int epoll;
+    struct engine_board* boards;
+    int active;
+    const struct flash_plan* plan;
+    const struct flash_options* options;
+    unsigned int baud;
+    unsigned int latency;
+};
+
+static void board_advance(struct engine* engine, struct engine_board* board, int status);
+static void board_identity(struct engine* engine, struct engine_board* board, int status);
+static void board_begin_uid(struct engine* engine, struct engine_board* board);
+static void board_uid(struct engine* engine, struct engine_board* board, int status);
+static void board_begin_erase(struct engine* engine, struct engine_board* board);
+
+static uint64_t board_data(
+  const struct engine* engine, const struct engine_board* board, int source) {
+    return (uint64_t)(board - engine->boards) << 1 | source;
+}
+
+// Fires the timer after delay microseconds, 0 disarms it
+static void board_arm(struct engine_board* board, uint64_t delay) {
+    struct itimerspec spec = { 0 };
+    spec.it_value.tv_sec = delay / 1000000;
+    spec.it_value.tv_nsec = (delay % 1000000) * 1000;
+    timerfd_settime(board->timer, 0, &spec, NULL);
+}
+
+// Runs the next step from the loop rather than recursing into it
+static void board_defer(struct engine_board* board, uint64_t delay) {
+    board_arm(board, delay ? delay : 1);
+}
+
+static void board_watch(struct engine* engine, struct engine_board* board, int writable) {
+    if (board->tx_blocked == writable) return;
+    struct epoll_event event = { .events = EPOLLIN | (writable ? EPOLLOUT : 0) };
+    event.data.u64 = board_data(engine, board, SOURCE_TTY);
+    epoll_ctl(engine->epoll, EPOLL_CTL_MOD, board->tty, &event);
+    board->tx_blocked = writable;
+}
+
+static void board_complete(struct engine* engine, struct engine_board* board, int status) {
+    board->waiting = 0;
+    board_arm(board, 0);
+    board_advance(engine, board, status);
+}
+
+static void board_transmit(struct engine* engine, struct engine_board* board) {
+    while (board->tx_sent < board->tx_size) {
+        ssize_t written =
+          write(board->tty, board->tx + board->tx_sent, board->tx_size - board->tx_sent);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0 && errno == EAGAIN) {
+            // Resume once the driver has room again
+            board_watch(engine, board, 1);
+            return;
+        }
+        if (written < 0) {
+            board_complete(engine, board, STM32_ERR_IO);
+            return;
+        }
+        board->tx_sent += written;
+    }
+    board_watch(engine, board, 0);
+}
+
+// Expects size reply bytes within timeout milliseconds
+static void board_receive(
+  struct engine_board* board, size_t size, unsigned int timeout, int expect_ack) {
+    board->rx_size = size;
+    board->rx_received = 0;
+    board->expect_ack = expect_ack;
+    board->waiting = 1;
+    board_arm(board, timeout * 1000ULL);
+}
+
+// Starts sending frame, the reply has to be set up with board_receive() first
+static void board_request(
+  struct engine* engine, struct engine_board* board, const unsigned char* frame, size_t size) {
+    memcpy(board->tx, frame, size);
+    board->tx_size = size;
+    board->tx_sent = 0;
+    board_transmit(engine, board);
+}
+
+static void board_send(
+  struct engine* engine,
+  struct engine_board* board,
+  const unsigned char* frame,
+  size_t size,
+  size_t reply_size,
+  unsigned int timeout) {
+    board_receive(board, reply_size, timeout, 1);
+    board_request(engine, board, frame, size);
+}
+
+static void board_command(
+  struct engine* engine, struct engine_board* board, unsigned char command, size_t reply_size) {
+    unsigned char frame[2];
+    size_t size = stm32_encode_command(command, frame);
+    board_send(engine, board, frame, size, reply_size, STM32_TIMEOUT);
+}
+
+static void board_sync_send(struct engine* engine, struct engine_board* board) {
+    unsigned char sync = STM32_SYNC;
+    board_receive(board, 1, stm32_sync_timeout(board->step), 0);
+    board_request(engine, board, &sync, 1);
+}
+
+// Silence that ends the drain after the sync bytes, the latency timer is only known once set
+static unsigned int board_sync_quiet(
+  const struct engine* engine, const struct engine_board* board) {
+    int known = board->latency.timer_path[0] || board->latency.flags >= 0;
+    return stm32_sync_quiet(known ? engine->latency : 0, stm32_sync_timeout(board->step));
+}
+
+static void board_address(struct engine* engine, struct engine_board* board, uint32_t addr) {
+    unsigned char frame[5];
+    size_t size = stm32_encode_address(addr, frame);
+    board_send(engine, board, frame, size, 1, STM32_TIMEOUT);
+}
+
+static void board_readable(struct engine* engine, struct engine_board* board) {
+    unsigned char discard[64];
+    for (;;) {
+        unsigned char* data = discard;
+        size_t size = sizeof(discard);
+        if (board->waiting) {
+            data = board->rx + board->rx_received;
+            size = board->rx_size - board->rx_received;
+        }
+        ssize_t received = read(board->tty, data, size);
+        if (received < 0 && errno == EINTR) continue;
+        // With VMIN and VTIME at 0 an empty tty reads as 0 rather than EAGAIN, hangups are
+        // reported through EPOLLHUP
+        if (received == 0 || (received < 0 && errno == EAGAIN)) return;
+        if (received < 0) {
+            if (board->waiting) board_complete(engine, board, STM32_ERR_IO);
+            return;
+        }
+        // Anything outside an exchange is stale and dropped, and keeps the sync drain going
+        if (!board->waiting) {
+            if (board->state == STATE_SYNC && board->stage == 1)
+                board_defer(board, board_sync_quiet(engine, board) * 1000ULL);
+            continue;
+        }
+        board->rx_received += received;
+        if (board->expect_ack && board->rx[0] != STM32_ACK) {
+            board_complete(
+              engine, board, board->rx[0] == STM32_NACK ? STM32_ERR_NACK : STM32_ERR_PROTOCOL);
+            return;
+        }
+        if (board->rx_received == board->rx_size) {
+            board_complete(engine, board, STM32_OK);
+            return;
+        }
+    }
+}
+
+static void board_close_tty(struct engine* engine, struct engine_board* board) {
+    if (board->tty < 0) return;
+    serial_restore_latency(board->tty, &board->latency);
+    epoll_ctl(engine->epoll, EPOLL_CTL_DEL, board->tty, NULL);
+    close(board->tty);
+    board->tty = -1;
+    board->tx_blocked = 0;
+    board->waiting = 0;
+}
+
+static void board_finish(struct engine* engine, struct engine_board* board) {
+    board_arm(board, 0);
+    session_release(board->session);
+    free(board->dev);
+    board->dev = NULL;
+    free(board->pages);
+    board->pages = NULL;
+    board->state = STATE_DONE;
+    board->result->elapsed = (timestamp_us() - board->start) / 1e6;
+    engine->active--;
+}
+
+static void board_exit(struct engine* engine, struct engine_board* board) {
+    board_close_tty(engine, board);
+    board->state = STATE_EXIT;
+    board->step = 0;
+    if (session_acquire(board->session, "exit") != FT_OK) {
+        snprintf(board->result->error, FLASH_ERROR_LENGTH, "Failed to exit bootloader mode");
+        board->result->status = -1;
+        board_finish(engine, board);
+        return;
+    }
+    board_defer(board, 0);
+}
+
+// Remembers the image for the device before leaving the bootloader
+static void board_flashed(struct engine* engine, struct engine_board* board) {
+    if (board->cached)
+        flash_cache_store(board->stm.pid, board->uid, engine->options->image_hash);
+    board_exit(engine, board);
+}
+
+static void board_fail(struct engine* engine, struct engine_board* board, int status) {
+    snprintf(
+      board->result->error,
+      FLASH_ERROR_LENGTH,
+      "Failed to flash device: %s",
+      stm32_strerror(status));
+    board->result->status = status;
+    board_exit(engine, board);
+}
+
+static void board_reset(struct engine* engine, struct engine_board* board) {
+    const struct cbus_step* steps = bootloader_sequence;
+    unsigned int count = BOOTLOADER_SEQUENCE_STEPS;
+    if (board->state == STATE_EXIT) {
+        steps = application_sequence;
+        count = APPLICATION_SEQUENCE_STEPS;
+    }
+
+    if (board->step < count) {
+        const struct cbus_step* step = &steps[board->step++];
+        if (session_write(board->session, step->value) == FT_OK) {
+            board_defer(board, step->delay);
+            return;
+        }
+        snprintf(
+          board->result->error,
+          FLASH_ERROR_LENGTH,
+          board->state == STATE_EXIT ? "Failed to exit bootloader mode" :
+                                       "Failed to enter bootloader mode");
+        board->result->status = -1;
+        board_finish(engine, board);
+        return;
+    }
+    if (board->state == STATE_EXIT) {
+        board_finish(engine, board);
+        return;
+    }
+
+    // Hand the UART over to the ttyUSB driver
+    session_release(board->session);
+    board->state = STATE_OPEN;
+    board->step = 0;
+    board_defer(board, 0);
+}
+
+static void board_open(struct engine* engine, struct engine_board* board) {
+    // ttyUSB numbers may have moved between adapters as they all reattached, so the adapter's tty
+    // is looked up again rather than taken from before the reset sequence
+    int status = PORT_ERR_TIMEOUT;
+    if (find_tty(board->adapter, &board->dev) == FT_OK)
+        status = serial_open_fd(board->dev, engine->baud, &board->tty);
+    if (status == PORT_ERR_TIMEOUT && board->step * ENGINE_OPEN_RETRY < ENGINE_OPEN_TIMEOUT) {
+        // ftdi_sio is still recreating the node
+        board->step++;
+        board_defer(board, ENGINE_OPEN_RETRY * 1000ULL);
+        return;
+    }
+    if (status != PORT_OK) {
+        board->tty = -1;
+        snprintf(board->result->error, FLASH_ERROR_LENGTH, "Failed to open %s", board->dev);
+        board->result->status = STM32_ERR_IO;
+        board_exit(engine, board);
+        return;
+    }
+
+    board->latency.timer_path[0] = '\0';
+    board->latency.flags = -1;
+    if (engine->latency)
+        serial_set_latency(board->tty, board->dev, engine->latency, &board->latency);
+    struct epoll_event event = { .events = EPOLLIN };
+    event.data.u64 = board_data(engine, board, SOURCE_TTY);
+    epoll_ctl(engine->epoll, EPOLL_CTL_ADD, board->tty, &event);
+    board->state = STATE_SYNC;
+    board->step = 0;
+    board->stage = 0;
+    board_sync_send(engine, board);
+}
+
+static void board_sync(struct engine* engine, struct engine_board* board, int status) {
+    if (board->stage == 0) {
+        // The bootloader NACKs further sync bytes once it has locked onto the baud rate
+        if (status == STM32_OK && board->rx[0] != STM32_ACK && board->rx[0] != STM32_NACK)
+            status = STM32_ERR_PROTOCOL;
+        // A late ACK to an earlier sync byte answers a later one, so the input is only flushed
+        // after noise
+        if ((status == STM32_ERR_TIMEOUT || status == STM32_ERR_PROTOCOL) &&
+            stm32_sync_timeout(++board->step)) {
+            if (status == STM32_ERR_PROTOCOL) tcflush(board->tty, TCIOFLUSH);
+            board_sync_send(engine, board);
+            return;
+        }
+        if (status != STM32_OK) {
+            board_fail(engine, board, status);
+            return;
+        }
+        // Replies to the sync bytes sent after the one answered arrive outside any exchange
+        // and are dropped until the line has been quiet for longer than the latency timer
+        if (board->step > 0) {
+            board->stage = 1;
+            board_defer(board, board_sync_quiet(engine, board) * 1000ULL);
+            return;
+        }
+    }
+
+    board->state = STATE_GET;
+    board->stage = 0;
+    board_command(engine, board, STM32_CMD_GET, 2);
+}
+
+// Get and Get ID reply with ACK, a byte count N, N + 1 bytes and a closing ACK
+static void board_query(struct engine* engine, struct engine_board* board, int status) {
+    unsigned char count = board->rx[1];
+    if (status == STM32_OK && board->stage == 0) {
+        board->stage = 1;
+        board_receive(board, count + 2, STM32_TIMEOUT, 0);
+        return;
+    }
+    if (status == STM32_OK && board->rx[board->rx_size - 1] != STM32_ACK)
+        status = STM32_ERR_PROTOCOL;
+    if (status == STM32_OK && board->state == STATE_GET_ID && board->rx_size != 3)
+        status = STM32_ERR_PROTOCOL;
+    if (status != STM32_OK) {
+        board_fail(engine, board, status);
+        return;
+    }
+
+    board->stage = 0;
+    if (board->state == STATE_GET) {
+        board->stm.version = board->rx[0];
+        board->stm.command_count = board->rx_size - 2;
+        memcpy(board->stm.commands, board->rx + 1, board->stm.command_count);
+        board->state = STATE_GET_ID;
+        board_command(engine, board, STM32_CMD_GET_ID, 2);
+        return;
+    }
+    board->stm.pid = (board->rx[0] << 8) | board->rx[1];
+    board->cached = 0;
+    const struct flash_options* options = engine->options;
+    if (options->identity_size &&
+        flash_plan_at(engine->plan, options->identity_addr, options->identity_size)) {
+        board->state = STATE_IDENTITY;
+        board_identity(engine, board, STM32_OK);
+        return;
+    }
+    board_begin_uid(engine, board);
+}
+
+// Read Memory of size bytes at addr, spread over the stages of the current state. Returns
+// whether the data has arrived, after the ACK in rx.
+static int board_read(
+  struct engine* engine, struct engine_board* board, uint32_t addr, size_t size) {
+    switch (board->stage++) {
+        case 0:
+            board_command(engine, board, STM32_CMD_READ_MEMORY, 1);
+            return 0;
+        case 1:
+            board_address(engine, board, addr);
+            return 0;
+        case 2: {
+            unsigned char frame[2];
+            stm32_encode_length(size, frame);
+            board_send(engine, board, frame, sizeof(frame), size + 1, STM32_TIMEOUT);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Reads the identity range back and ends the session if it already matches the image
+static void board_identity(struct engine* engine, struct engine_board* board, int status) {
+    const struct flash_options* options = engine->options;
+    // Read protected, so it cannot match
+    if (status == STM32_ERR_NACK) {
+        board_begin_uid(engine, board);
+        return;
+    }
+    if (status != STM32_OK) {
+        board_fail(engine, board, status);
+        return;
+    }
+    if (!board_read(engine, board, options->identity_addr, options->identity_size)) return;
+
+    const unsigned char* expected =
+      flash_plan_at(engine->plan, options->identity_addr, options->identity_size);
+    if (memcmp(board->rx + 1, expected, options->identity_size) == 0)
+        board_exit(engine, board);
+    else
+        board_begin_uid(engine, board);
+}
+
+static void board_begin_uid(struct engine* engine, struct engine_board* board) {
+    if (engine->options->image_hash && device_find(board->stm.pid)) {
+        board->state = STATE_UID;
+        board->stage = 0;
+        board_uid(engine, board, STM32_OK);
+        return;
+    }
+    board_begin_erase(engine, board);
+}
+
+static void board_begin_erase(struct engine* engine, struct engine_board* board) {
+    unsigned char command = stm32_erase_command(&board->stm);
+    if (!command) {
+        board_fail(engine, board, STM32_ERR_UNSUPPORTED);
+        return;
+    }
+    free(board->pages);
+    board->pages = NULL;
+    board->page_count = flash_plan_pages(engine->plan, &board->stm, &board->pages);
+    board->block = 0;
+    board->state = STATE_ERASE;
+    board->stage = 0;
+    board_command(engine, board, command, 1);
+}
+
+// Reads the unique device ID and skips devices already carrying the image
+static void board_uid(struct engine* engine, struct engine_board* board, int status) {
+    // Read protected, flash without the cache
+    if (status == STM32_ERR_NACK) {
+        board_begin_erase(engine, board);
+        return;
+    }
+    if (status != STM32_OK) {
+        board_fail(engine, board, status);
+        return;
+    }
+    uint32_t addr = device_find(board->stm.pid)->uid_addr;
+    if (!board_read(engine, board, addr, DEVICE_UID_LENGTH)) return;
+
+    memcpy(board->uid, board->rx + 1, DEVICE_UID_LENGTH);
+    board->cached = 1;
+    if (engine->options->force) {
+        flash_cache_forget(board->stm.pid, board->uid);
+        board_begin_erase(engine, board);
+    } else if (flash_cache_lookup(board->stm.pid, board->uid, engine->options->image_hash)) {
+        board_exit(engine, board);
+    } else {
+        board_begin_erase(engine, board);
+    }
+}
+
+static void board_erase(struct engine* engine, struct engine_board* board, int status) {
+    if (status != STM32_OK) {
+        board_fail(engine, board, status);
+        return;
+    }
+    unsigned char command = stm32_erase_command(&board->stm);
+    if (board->stage++ == 0) {
+        unsigned char frame[STM32_MAX_FRAME];
+        size_t size = stm32_encode_erase(command, NULL, 0, frame);
+        unsigned int timeout = STM32_MASS_ERASE_TIMEOUT;
+        if (board->page_count) {
+            size_t count = board->page_count - board->block;
+            size_t max = command == STM32_CMD_EXTENDED_ERASE ?
+                           STM32_EXTENDED_ERASE_PAGES :
+                           STM32_ERASE_PAGES;
+            if (count > max) count = max;
+            size = stm32_encode_erase(command, board->pages + board->block, count, frame);
+            timeout = STM32_PAGE_ERASE_TIMEOUT * count;
+            board->block += count;
+        }
+        board_send(engine, board, frame, size, 1, timeout);
+        return;
+    }
+    // One command per page list chunk
+    if (board->block < board->page_count) {
+        board->stage = 0;
+        board_command(engine, board, command, 1);
+        return;
+    }
+
+    board->state = STATE_WRITE;
+    board->stage = 0;
+    board->block = 0;
+    board->first = 0;
+    board->end = engine->plan->count - engine->plan->deferred;
+    board_defer(board, 0);
+}
+
+// Moves on to the identity blocks once the rest has been written and verified
+static void board_pass_done(struct engine* engine, struct engine_board* board) {
+    const struct flash_plan* plan = engine->plan;
+    if (board->end == plan->count) {
+        board_flashed(engine, board);
+        return;
+    }
+    board->state = STATE_WRITE;
+    board->stage = 0;
+    board->first = board->end;
+    board->block = board->end;
+    board->end = plan->count;
+    board_defer(board, 0);
+}
+
+static void board_write(struct engine* engine, struct engine_board* board, int status) {
+    const struct flash_plan* plan = engine->plan;
+    if (status != STM32_OK) {
+        board_fail(engine, board, status);
+        return;
+    }
+    // Erased flash already reads 0xFF
+    while (board->stage == 0 && board->block < board->end && plan->blocks[board->block].blank)
+        board->block++;
+    if (board->block == board->end) {
+        int verify = engine->options->verify;
+        if (verify == FLASH_VERIFY_CRC && !stm32_supports(&board->stm, STM32_CMD_GET_CHECKSUM))
+            verify = FLASH_VERIFY_READ;
+        board->state = verify == FLASH_VERIFY_NONE ? STATE_EXIT :
+                       verify == FLASH_VERIFY_CRC  ? STATE_CHECKSUM :
+                                                     STATE_VERIFY;
+        board->stage = 0;
+        board->block = board->first;
+        if (board->state == STATE_EXIT)
+            board_pass_done(engine, board);
+        else
+            board_defer(board, 0);
+        return;
+    }
+
+    const struct flash_block* block = &plan->blocks[board->block];
+    switch (board->stage++) {
+        case 0:
+            board_command(engine, board, STM32_CMD_WRITE_MEMORY, 1);
+            break;
+        case 1:
+            board_address(engine, board, block->addr);
+            break;
+        default: {
+            unsigned char data[STM32_MAX_TRANSFER];
+            unsigned char frame[STM32_MAX_TRANSFER + 2];
+            size_t size = stm32_encode_data(data, flash_block_payload(block, data), frame);
+            board_send(engine, board, frame, size, 1, STM32_WRITE_TIMEOUT);
+            board->stage = 0;
+            board->block++;
+        }
+    }
+}
+
+static void board_verify(struct engine* engine, struct engine_board* board, int status) {
+    const struct flash_plan* plan = engine->plan;
+    if (status == STM32_OK && board->stage == 3) {
+        const struct flash_block* block = &plan->blocks[board->block++];
+        if (memcmp(board->rx + 1, block->data, block->size) != 0) status = STM32_ERR_VERIFY;
+        board->stage = 0;
+    }
+    if (status != STM32_OK) {
+        board_fail(engine, board, status);
+        return;
+    }
+    while (engine->options->verify == FLASH_VERIFY_SAMPLE && board->block < board->end &&
+           !flash_block_sampled(plan, board->block))
+        board->block++;
+    if (board->block == board->end) {
+        board_pass_done(engine, board);
+        return;
+    }
+
+    const struct flash_block* block = &plan->blocks[board->block];
+    switch (board->stage++) {
+        case 0:
+            board_command(engine, board, STM32_CMD_READ_MEMORY, 1);
+            break;
+        case 1:
+            board_address(engine, board, block->addr);
+            break;
+        default: {
+            // ACK followed by the data
+            unsigned char frame[2];
+            stm32_encode_length(block->size, frame);
+            board_send(engine, board, frame, sizeof(frame), block->size + 1, STM32_TIMEOUT);
+        }
+    }
+}
+
+// Get Checksum over one segment at a time. The target computes the CRC before acknowledging the
+// initial value, which is followed by the CRC, most significant byte first, and its XOR checksum.
+static void board_checksum(struct engine* engine, struct engine_board* board, int status) {
+    const struct flash_plan* plan = engine->plan;
+    if (status == STM32_OK && board->stage == 5) {
+        const unsigned char* reply = board->rx + 1;
+        uint32_t crc = (uint32_t)reply[0] << 24 | reply[1] << 16 | reply[2] << 8 | reply[3];
+        if ((reply[0] ^ reply[1] ^ reply[2] ^ reply[3]) != reply[4])
+            status = STM32_ERR_PROTOCOL;
+        else if (crc != board->checksum.crc)
+            status = STM32_ERR_VERIFY;
+        board->block = board->checksum_end;
+        board->stage = 0;
+    }
+    if (status != STM32_OK) {
+        board_fail(engine, board, status);
+        return;
+    }
+    if (board->block == board->end) {
+        board_pass_done(engine, board);
+        return;
+    }
+
+    // Words share the layout of an address
+    switch (board->stage++) {
+        case 0:
+            board->checksum_end = flash_plan_checksum(plan, board->block, &board->checksum);
+            board_command(engine, board, STM32_CMD_GET_CHECKSUM, 1);
+            break;
+        case 1:
+            board_address(engine, board, board->checksum.addr);
+            break;
+        case 2:
+            board_address(engine, board, board->checksum.size);
+            break;
+        case 3:
+            board_address(engine, board, CRC_POLYNOMIAL);
+            break;
+        default: {
+            unsigned char frame[5];
+            size_t size = stm32_encode_address(CRC_INIT, frame);
+            board_send(engine, board, frame, size, 6, STM32_CHECKSUM_TIMEOUT);
+        }
+    }
+}
+
+static void board_advance(struct engine* engine, struct engine_board* board, int status) {
+    switch (board->state) {
+        case STATE_ENTER:
+        case STATE_EXIT:
+            board_reset(engine, board);
+            break;
+        case STATE_OPEN:
+            board_open(engine, board);
+            break;
+        case STATE_SYNC:
+            board_sync(engine, board, status);
+            break;
+        case STATE_GET:
+        case STATE_GET_ID:
+            board_query(engine, board, status);
+            break;
+        case STATE_IDENTITY:
+            board_identity(engine, board, status);
+            break;
+        case STATE_UID:
+            board_uid(engine, board, status);
+            break;
+        case STATE_ERASE:
+            board_erase(engine, board, status);
+            break;
+        case STATE_WRITE:
+            board_write(engine, board, status);
+            break;
+        case STATE_VERIFY:
+            board_verify(engine, board, status);
+            break;
+        case STATE_CHECKSUM:
+            board_checksum(engine, board, status);
+            break;
+    }
+}
+
+static void board_start(struct engine* engine, struct engine_board* board) {
+    board->start = timestamp_us();
+    board->result->error[0] = '\0';
+    if (find_device(board->session, &board->dev) != FT_OK) {
+        snprintf(board->result->error, FLASH_ERROR_LENGTH, "Failed to find device");
+        board->result->status = -1;
+        board_finish(engine, board);
+        return;
+    }
+    if (session_acquire(board->session, "enter") != FT_OK) {
+        snprintf(board->result->error, FLASH_ERROR_LENGTH, "Failed to enter bootloader mode");
+        board->result->status = -1;
+        board_finish(engine, board);
+        return;
+    }
+    board->state = STATE_ENTER;
+    board_reset(engine, board);
+}
+
+static void board_timer(struct engine* engine, struct engine_board* board) {
+    uint64_t expirations;
+    // Nothing to read when the timer was re-armed after this event was queued
+    if (read(board->timer, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+    if (board->waiting)
+        board_complete(engine, board, STM32_ERR_TIMEOUT);
+    else
+        board_advance(engine, board, STM32_OK);
+}
+
+int engine_flash(
+  const struct adapter* adapters,
+  struct session* sessions,
+  struct flash_result* results,
+  int count,
+  const struct flash_plan* plan,
+  const struct flash_options* options,
+  unsigned int baud,
+  unsigned int latency) {
+    struct engine engine = {
+        .plan = plan, .options = options, .baud = baud, .latency = latency
+    };
+    struct epoll_event events[ENGINE_EVENTS];
+    int flashed = 0;
+
+    engine.epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (engine.epoll < 0) return -1;
+    engine.boards = (struct engine_board*)calloc(count, sizeof(struct engine_board));
+    for (int i = 0; i < count; i++) {
+        struct engine_board* board = &engine.boards[i];
+        board->adapter = &adapters[i];
+        board->session = &sessions[i];
+        board->result = &results[i];
+        board->tty = -1;
+        board->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        struct epoll_event event = { .events = EPOLLIN };
+        event.data.u64 = board_data(&engine, board, SOURCE_TIMER);
+        if (board->timer < 0 || epoll_ctl(engine.epoll, EPOLL_CTL_ADD, board->timer, &event)) {
+            snprintf(results[i].error, FLASH_ERROR_LENGTH, "Failed to create timer");
+            results[i].status = -1;
+            board->state = STATE_DONE;
+            continue;
+        }
+        engine.active++;
+        board_start(&engine, board);
+    }
+
+    while (engine.active > 0) {
+        int ready = epoll_wait(engine.epoll, events, ENGINE_EVENTS, -1);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) break;
+        for (int i = 0; i < ready; i++) {
+            struct engine_board* board = &engine.boards[events[i].data.u64 >> 1];
+            if (board->state == STATE_DONE) continue;
+            if ((events[i].data.u64 & 1) == SOURCE_TIMER) {
+                board_timer(&engine, board);
+                continue;
+            }
+            // Skip events queued for a tty closed earlier in this batch
+            if (board->tty < 0) continue;
+            if (events[i].events & EPOLLOUT) board_transmit(&engine, board);
+            if (board->tty >= 0 && (events[i].events & EPOLLIN)) board_readable(&engine, board);
+            if (board->tty < 0 || !(events[i].events & (EPOLLERR | EPOLLHUP))) continue;
+            // The adapter went away
+            if (board->waiting)
+                board_complete(&engine, board, STM32_ERR_IO);
+            else
+                board_fail(&engine, board, STM32_ERR_IO);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct engine_board* board = &engine.boards[i];
+        board_close_tty(&engine, board);
+        if (board->timer >= 0) close(board->timer);
+        free(board->dev);
+        free(board->pages);
+        if (results[i].status == 0) flashed++;
+    }
+    free(engine.boards);
+    close(engine.epoll);
+
+    return flashed;
+}
+#endif
@@ -0,0 +1,687 @@
+#include "flash.h"
+
+#include "cache.h"
+#include "crc.h"
+#include "device.h"
+#include "packets.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Image hash last written per device
+#define FLASH_IMAGE_CACHE "image"
+// Widest programming unit of the parts in the device table, a double word
+#define FLASH_WORD 8
+
+int flash_plan_init(struct flash_plan* plan, const struct image* image) {
+    size_t count = 0;
+    for (size_t i = 0; i < image->count; i++)
+        count += (image->segments[i].size + STM32_MAX_TRANSFER - 1) / STM32_MAX_TRANSFER;
+
+    plan->count = 0;
+    plan->deferred = 0;
+    plan->blocks = (struct flash_block*)malloc((count ? count : 1) * sizeof(struct flash_block));
+    if (!plan->blocks) return STM32_ERR_IO;
+    for (size_t i = 0; i < image->count; i++) {
+        const struct segment* segment = &image->segments[i];
+        for (size_t offset = 0; offset < segment->size; offset += STM32_MAX_TRANSFER) {
+            struct flash_block* block = &plan->blocks[plan->count++];
+            block->addr = segment->addr + offset;
+            block->data = segment->data + offset;
+            block->size = segment->size - offset;
+            if (block->size > STM32_MAX_TRANSFER) block->size = STM32_MAX_TRANSFER;
+            block->segment = i;
+            block->blank = flash_blank(block->data, block->size);
+        }
+    }
+
+    return STM32_OK;
+}
+
+void flash_plan_free(struct flash_plan* plan) {
+    free(plan->blocks);
+    plan->blocks = NULL;
+    plan->count = 0;
+}
+
+const unsigned char* flash_plan_at(const struct flash_plan* plan, uint32_t addr, size_t size) {
+    const struct flash_block* first = NULL;
+    for (size_t i = 0; !first && i < plan->count; i++) {
+        const struct flash_block* block = &plan->blocks[i];
+        if (addr >= block->addr && addr - block->addr < block->size) first = block;
+    }
+    if (!first) return NULL;
+    // Blocks of a segment share its contiguous data
+    uint32_t end = first->addr;
+    for (size_t i = 0; i < plan->count; i++) {
+        const struct flash_block* block = &plan->blocks[i];
+        if (block->segment == first->segment && block->addr + block->size > end)
+            end = block->addr + block->size;
+    }
+    return addr + size <= end ? first->data + (addr - first->addr) : NULL;
+}
+
+void flash_plan_defer(struct flash_plan* plan, uint32_t addr, size_t size) {
+    size_t kept = 0;
+    size_t deferred = 0;
+    struct flash_block* moved = (struct flash_block*)malloc(plan->count * sizeof(*moved));
+    if (!moved || size == 0) {
+        free(moved);
+        return;
+    }
+    // Stable, so blocks of a segment stay in address order
+    for (size_t i = 0; i < plan->count; i++) {
+        const struct flash_block* block = &plan->blocks[i];
+        if (block->addr < addr + size && addr < block->addr + block->size)
+            moved[deferred++] = *block;
+        else
+            plan->blocks[kept++] = *block;
+    }
+    memcpy(plan->blocks + kept, moved, deferred * sizeof(*moved));
+    plan->deferred = deferred;
+    free(moved);
+}
+
+int flash_blank(const unsigned char* data, size_t size) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i erased = _mm_set1_epi8((char)0xFF);
+    for (; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(data + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, erased)) != 0xFFFF) return 0;
+    }
+#endif
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if (word != UINT64_MAX) return 0;
+    }
+    for (; i < size; i++) {
+        if (data[i] != 0xFF) return 0;
+    }
+    return 1;
+}
+
+size_t flash_block_payload(const struct flash_block* block, unsigned char* data) {
+    size_t size = block->size;
+    memcpy(data, block->data, size);
+    // Flash is programmed in words, pad the tail with the erased value
+    while (size % 4) data[size++] = 0xFF;
+    return size;
+}
+
+size_t flash_plan_pages(const struct flash_plan* plan, const struct stm32* stm, uint16_t** pages) {
+    const struct device* device = device_find(stm->pid);
+    if (!device) return 0;
+    size_t total = device_page_count(device);
+    unsigned char* used = (unsigned char*)calloc(total, 1);
+    if (!used) return 0;
+
+    int whole = 0;
+    for (size_t i = 0; !whole && i < plan->count; i++) {
+        const struct flash_block* block = &plan->blocks[i];
+        long first = device_page(device, block->addr);
+        long last = device_page(device, block->addr + ((block->size + 3) & ~(size_t)3) - 1);
+        if (first < 0 || last < 0) whole = 1;
+        for (long page = first; !whole && page <= last; page++) used[page] = 1;
+    }
+
+    size_t count = 0;
+    unsigned long time = 0;
+    for (size_t page = 0; !whole && page < total; page++) {
+        if (!used[page]) continue;
+        // The legacy Erase command numbers pages with a single byte
+        if (page > 0xFF && stm32_erase_command(stm) != STM32_CMD_EXTENDED_ERASE) whole = 1;
+        time += device_page_erase_time(device, page);
+        count++;
+    }
+    if (whole || !count || time > device->mass_erase_time) {
+        free(used);
+        return 0;
+    }
+
+    *pages = (uint16_t*)malloc(count * sizeof(uint16_t));
+    count = 0;
+    for (size_t page = 0; *pages && page < total; page++) {
+        if (used[page]) (*pages)[count++] = page;
+    }
+    free(used);
+
+    return count;
+}
+
+int flash_block_sampled(const struct flash_plan* plan, size_t index) {
+    const struct flash_block* block = &plan->blocks[index];
+    return index % FLASH_SAMPLE_STRIDE == 0 || index + 1 == plan->count ||
+           block[-1].segment != block->segment || block[1].segment != block->segment;
+}
+
+size_t flash_plan_checksum(
+  const struct flash_plan* plan, size_t first, struct flash_checksum* checksum) {
+    const struct flash_block* start = &plan->blocks[first];
+    // Deferred blocks are checked in a pass of their own
+    size_t body = plan->count - plan->deferred;
+    size_t limit = first < body ? body : plan->count;
+    size_t last = first;
+    while (last + 1 < limit && plan->blocks[last + 1].segment == start->segment &&
+           plan->blocks[last + 1].addr == plan->blocks[last].addr + plan->blocks[last].size)
+        last++;
+
+    // Blocks of a segment are contiguous, only the tail needs padding
+    const struct flash_block* end = &plan->blocks[last];
+    unsigned char tail[4];
+    size_t size = end->addr + end->size - start->addr;
+    size_t whole = size & ~(size_t)3;
+    checksum->addr = start->addr;
+    checksum->size = (size + 3) & ~(size_t)3;
+    checksum->crc = crc_update(CRC_INIT, start->data, whole);
+    if (whole < size) {
+        memset(tail, 0xFF, sizeof(tail));
+        memcpy(tail, start->data + whole, size - whole);
+        checksum->crc = crc_update(checksum->crc, tail, sizeof(tail));
+    }
+
+    return last + 1;
+}
+
+static void flash_log_segment(
+  const struct flash_options* options, const char* action, const struct segment* segment) {
+    if (!options->log) return;
+    fprintf(
+      options->log,
+      "%s %lu bytes at 0x%08X\n",
+      action,
+      (unsigned long)segment->size,
+      (unsigned int)segment->addr);
+}
+
+// Checks the block a previous attempt failed on. Flash words cannot be programmed twice, so a
+// block that was partly written forces the image to be erased again.
+static int flash_resume(
+  struct stm32* stm, const struct flash_block* block, struct flash_progress* progress) {
+    unsigned char data[STM32_MAX_TRANSFER];
+    int status = stm32_read_memory(stm, block->addr, data, block->size);
+    if (status != STM32_OK) return status;
+    if (memcmp(data, block->data, block->size) == 0) {
+        progress->written++;
+        return STM32_OK;
+    }
+    for (size_t i = 0; i < block->size; i++) {
+        if (data[i] != 0xFF) {
+            progress->erased = 0;
+            break;
+        }
+    }
+
+    return STM32_OK;
+}
+
+// Word aligned range of a page covered by the image
+struct flash_range {
+    uint32_t addr;
+    size_t size;
+};
+
+// Fills data with what page should hold, 0xFF where the image leaves gaps, and returns the part
+// of the page the image covers
+static struct flash_range flash_page_content(
+  const struct image* image, const struct device* device, size_t page, unsigned char* data) {
+    uint32_t start = device_page_addr(device, page);
+    uint32_t end = start + device_page_size(device, page);
+    struct flash_range range = { end, 0 };
+    uint32_t last = start;
+
+    memset(data, 0xFF, end - start);
+    for (size_t i = 0; i < image->count; i++) {
+        const struct segment* segment = &image->segments[i];
+        uint32_t from = segment->addr > start ? segment->addr : start;
+        uint32_t to = segment->addr + segment->size < end ? segment->addr + segment->size : end;
+        if (from >= to) continue;
+        memcpy(data + (from - start), segment->data + (from - segment->addr), to - from);
+        if (from < range.addr) range.addr = from;
+        if (to > last) last = to;
+    }
+    if (range.addr < last) {
+        range.addr &= ~3u;
+        range.size = ((last + 3) & ~3u) - range.addr;
+    }
+
+    return range;
+}
+
+static int flash_range_matches(
+  struct stm32* stm, const struct flash_range* range, const unsigned char* data, int* match) {
+    unsigned char block[STM32_MAX_TRANSFER];
+    int status = STM32_OK;
+    *match = 1;
+
+    if (stm32_supports(stm, STM32_CMD_GET_CHECKSUM)) {
+        // Only the CRC travels back
+        uint32_t crc;
+        status =
+          stm32_get_checksum(stm, range->addr, range->size, CRC_POLYNOMIAL, CRC_INIT, &crc);
+        if (status == STM32_OK) *match = crc == crc_update(CRC_INIT, data, range->size);
+        return status;
+    }
+    for (size_t offset = 0; status == STM32_OK && *match && offset < range->size;
+         offset += STM32_MAX_TRANSFER) {
+        size_t size = range->size - offset;
+        if (size > STM32_MAX_TRANSFER) size = STM32_MAX_TRANSFER;
+        status = stm32_read_memory(stm, range->addr + offset, block, size);
+        if (status == STM32_OK) *match = memcmp(block, data + offset, size) == 0;
+    }
+
+    return status;
+}
+
+// The page has just been erased, so blank transfers are left out
+static int flash_range_write(
+  struct stm32* stm, const struct flash_range* range, const unsigned char* data) {
+    int status = STM32_OK;
+    for (size_t offset = 0; status == STM32_OK && offset < range->size;
+         offset += STM32_MAX_TRANSFER) {
+        size_t size = range->size - offset;
+        if (size > STM32_MAX_TRANSFER) size = STM32_MAX_TRANSFER;
+        if (flash_blank(data + offset, size)) continue;
+        status = stm32_write_memory(stm, range->addr + offset, data + offset, size);
+    }
+
+    return status;
+}
+
+static int flash_range_verify(
+  struct stm32* stm, const struct flash_range* range, const unsigned char* data, int verify) {
+    unsigned char block[STM32_MAX_TRANSFER];
+    int status = STM32_OK;
+    if (verify == FLASH_VERIFY_CRC) {
+        int match;
+        status = flash_range_matches(stm, range, data, &match);
+        return status == STM32_OK && !match ? STM32_ERR_VERIFY : status;
+    }
+    for (size_t offset = 0; status == STM32_OK && offset < range->size;
+         offset += STM32_MAX_TRANSFER) {
+        size_t size = range->size - offset;
+        if (size > STM32_MAX_TRANSFER) size = STM32_MAX_TRANSFER;
+        // Only the first and last transfer of the page
+        if (verify == FLASH_VERIFY_SAMPLE && offset && offset + size < range->size) continue;
+        status = stm32_read_memory(stm, range->addr + offset, block, size);
+        if (status == STM32_OK && memcmp(block, data + offset, size) != 0)
+            status = STM32_ERR_VERIFY;
+    }
+
+    return status;
+}
+
+// Splits range so that the flash words holding the identity come last, returns the part count
+static size_t flash_range_split(
+  const struct flash_range* range,
+  const struct flash_options* options,
+  struct flash_range* parts) {
+    uint32_t end = range->addr + range->size;
+    uint32_t from = options->identity_addr & ~(uint32_t)(FLASH_WORD - 1);
+    uint32_t to = (options->identity_addr + options->identity_size + FLASH_WORD - 1) &
+                  ~(uint32_t)(FLASH_WORD - 1);
+    if (from < range->addr) from = range->addr;
+    if (to > end) to = end;
+    if (!options->identity_size || from >= to) {
+        parts[0] = *range;
+        return 1;
+    }
+    size_t count = 0;
+    if (from > range->addr)
+        parts[count++] = (struct flash_range){ range->addr, from - range->addr };
+    if (to < end) parts[count++] = (struct flash_range){ to, end - to };
+    parts[count++] = (struct flash_range){ from, to - from };
+    return count;
+}
+
+static int flash_fits(const struct image* image, const struct device* device) {
+    for (size_t i = 0; i < image->count; i++) {
+        const struct segment* segment = &image->segments[i];
+        if (segment->addr < device->flash_base ||
+            segment->addr + segment->size > device->flash_base + device_flash_size(device))
+            return 0;
+    }
+    return 1;
+}
+
+// Erases and programs only the pages whose contents differ from the image. Each attempt starts
+// with a fresh comparison, so a retry naturally resumes where the last one stopped.
+static int flash_delta(
+  struct stm32* stm,
+  const struct image* image,
+  const struct device* device,
+  const struct flash_options* options) {
+    size_t count = device_page_count(device);
+    size_t page_size = 0;
+    for (size_t page = 0; page < count; page++) {
+        if (device_page_size(device, page) > page_size) page_size = device_page_size(device, page);
+    }
+    unsigned char* data = (unsigned char*)malloc(page_size);
+    uint16_t* pages = (uint16_t*)malloc(count * sizeof(uint16_t));
+    size_t covered = 0;
+    size_t changed = 0;
+    int status = data && pages ? STM32_OK : STM32_ERR_IO;
+
+    for (size_t page = 0; status == STM32_OK && page < count; page++) {
+        struct flash_range range = flash_page_content(image, device, page, data);
+        if (!range.size) continue;
+        int match;
+        uint32_t offset = range.addr - device_page_addr(device, page);
+        status = flash_range_matches(stm, &range, data + offset, &match);
+        covered++;
+        if (status == STM32_OK && !match) pages[changed++] = page;
+    }
+    if (status == STM32_OK && options->log)
+        fprintf(
+          options->log,
+          "%lu of %lu pages changed\n",
+          (unsigned long)changed,
+          (unsigned long)covered);
+    if (status == STM32_OK && changed) status = stm32_erase_pages(stm, pages, changed);
+    // Program the page holding the identity last
+    long identity = options->identity_size ? device_page(device, options->identity_addr) : -1;
+    for (size_t i = 0; i + 1 < changed; i++) {
+        if (pages[i] != identity) continue;
+        memmove(pages + i, pages + i + 1, (changed - i - 1) * sizeof(uint16_t));
+        pages[changed - 1] = identity;
+        break;
+    }
+
+    for (size_t i = 0; status == STM32_OK && i < changed; i++) {
+        struct flash_range range = flash_page_content(image, device, pages[i], data);
+        uint32_t offset = range.addr - device_page_addr(device, pages[i]);
+        if (options->log)
+            fprintf(
+              options->log,
+              "Writing %lu bytes at 0x%08X\n",
+              (unsigned long)range.size,
+              (unsigned int)range.addr);
+        // The identity only goes in once the rest of the image has been written and verified
+        struct flash_range parts[3];
+        size_t count = flash_range_split(&range, options, parts);
+        for (size_t j = 0; status == STM32_OK && j < count; j++) {
+            const unsigned char* part = data + offset + (parts[j].addr - range.addr);
+            status = flash_range_write(stm, &parts[j], part);
+            if (status == STM32_OK && options->verify)
+                status = flash_range_verify(stm, &parts[j], part, options->verify);
+        }
+    }
+    free(pages);
+    free(data);
+
+    return status;
+}
+
+static void flash_cache_key(uint16_t pid, const unsigned char* uid, char* key) {
+    int length = sprintf(key, "%03X-", pid);
+    for (int i = 0; i < DEVICE_UID_LENGTH; i++) length += sprintf(key + length, "%02X", uid[i]);
+}
+
+int flash_cache_lookup(uint16_t pid, const unsigned char* uid, const char* hash) {
+    char key[CACHE_KEY_LENGTH];
+    char value[CACHE_VALUE_LENGTH];
+    flash_cache_key(pid, uid, key);
+    if (cache_get(FLASH_IMAGE_CACHE, key, value, sizeof(value)) != CACHE_OK) return 0;
+    if (strcmp(value, hash) == 0) return 1;
+    cache_put(FLASH_IMAGE_CACHE, key, NULL);
+    return 0;
+}
+
+void flash_cache_store(uint16_t pid, const unsigned char* uid, const char* hash) {
+    char key[CACHE_KEY_LENGTH];
+    flash_cache_key(pid, uid, key);
+    cache_put(FLASH_IMAGE_CACHE, key, hash);
+}
+
+void flash_cache_forget(uint16_t pid, const unsigned char* uid) {
+    flash_cache_store(pid, uid, NULL);
+}
+
+// The pages plan touches, or everything when a mass erase is quicker
+static int flash_erase(
+  struct stm32* stm, const struct flash_plan* plan, const struct flash_options* options) {
+    uint16_t* pages;
+    size_t count = flash_plan_pages(plan, stm, &pages);
+    if (!count) {
+        if (options->log) fprintf(options->log, "Erasing flash\n");
+        return stm32_erase_all(stm);
+    }
+    if (options->log) fprintf(options->log, "Erasing %lu pages\n", (unsigned long)count);
+    int status = stm32_erase_pages(stm, pages, count);
+    free(pages);
+
+    return status;
+}
+
+static int flash_full(
+  struct stm32* stm, const struct image* image, const struct flash_options* options) {
+    struct flash_progress scratch = { 0 };
+    struct flash_progress* progress = options->progress ? options->progress : &scratch;
+    struct flash_plan plan;
+    struct packets packets = { 0 };
+    unsigned char data[STM32_MAX_TRANSFER];
+    int status = flash_plan_init(&plan, image);
+    if (status != STM32_OK) return status;
+    flash_plan_defer(&plan, options->identity_addr, options->identity_size);
+    // Blocks missing from the cache, or all of them when it is unusable, are encoded as they go
+    if (options->packets_hash)
+        packets_open(&packets, &plan, options->packets_hash, stm->pid, options->log);
+
+    if (progress->erased && progress->written < plan.count)
+        status = flash_resume(stm, &plan.blocks[progress->written], progress);
+    if (status == STM32_OK && !progress->erased) {
+        progress->written = 0;
+        progress->verified = 0;
+        status = flash_erase(stm, &plan, options);
+        progress->erased = status == STM32_OK;
+    } else if (status == STM32_OK && options->log && progress->written < plan.count) {
+        fprintf(
+          options->log,
+          "Resuming at 0x%08X\n",
+          (unsigned int)plan.blocks[progress->written].addr);
+    }
+
+    int verify = options->verify;
+    if (status == STM32_OK && verify == FLASH_VERIFY_CRC &&
+        !stm32_supports(stm, STM32_CMD_GET_CHECKSUM)) {
+        if (options->log) fprintf(options->log, "No Get Checksum command, reading back\n");
+        verify = FLASH_VERIFY_READ;
+    }
+
+    // The deferred identity blocks are written in a pass of their own once everything else has
+    // verified, so a device left with a bad image never looks up to date
+    size_t ends[2] = { plan.count - plan.deferred, plan.count };
+    size_t skipped = 0;
+    for (int pass = 0; status == STM32_OK && pass < 2; pass++) {
+        size_t end = ends[pass];
+        size_t first = progress->written;
+        for (size_t i = first; status == STM32_OK && i < end; i++) {
+            const struct flash_block* block = &plan.blocks[i];
+            if (i == first || block->segment != plan.blocks[i - 1].segment)
+                flash_log_segment(options, "Writing", &image->segments[block->segment]);
+            // Flash is erased by now, verification still covers the block
+            if (block->blank) {
+                progress->written = i + 1;
+                skipped++;
+                continue;
+            }
+            size_t size;
+            const unsigned char* frames = packets_find(&packets, block->addr, &size);
+            if (frames) {
+                status = stm32_write_encoded(stm, frames, size);
+            } else {
+                size = flash_block_payload(block, data);
+                status = stm32_write_memory(stm, block->addr, data, size);
+            }
+            if (status == STM32_OK) progress->written = i + 1;
+        }
+
+        // A segment at a time, so progress->verified stays on segment boundaries
+        while (verify == FLASH_VERIFY_CRC && status == STM32_OK && progress->verified < end) {
+            struct flash_checksum checksum;
+            uint32_t crc;
+            size_t next = flash_plan_checksum(&plan, progress->verified, &checksum);
+            flash_log_segment(
+              options, "Verifying", &image->segments[plan.blocks[progress->verified].segment]);
+            status = stm32_get_checksum(
+              stm, checksum.addr, checksum.size, CRC_POLYNOMIAL, CRC_INIT, &crc);
+            if (status == STM32_OK && crc != checksum.crc) status = STM32_ERR_VERIFY;
+            if (status == STM32_OK) progress->verified = next;
+        }
+
+        first = progress->verified;
+        int read = verify == FLASH_VERIFY_READ || verify == FLASH_VERIFY_SAMPLE;
+        for (size_t i = first; read && status == STM32_OK && i < end; i++) {
+            const struct flash_block* block = &plan.blocks[i];
+            if (i == first || block->segment != plan.blocks[i - 1].segment)
+                flash_log_segment(options, "Verifying", &image->segments[block->segment]);
+            if (verify == FLASH_VERIFY_SAMPLE && !flash_block_sampled(&plan, i)) {
+                progress->verified = i + 1;
+                continue;
+            }
+            status = stm32_read_memory(stm, block->addr, data, block->size);
+            if (status == STM32_OK && memcmp(data, block->data, block->size) != 0)
+                status = STM32_ERR_VERIFY;
+            if (status == STM32_OK) progress->verified = i + 1;
+        }
+    }
+    packets_close(&packets);
+    if (skipped && options->log)
+        fprintf(options->log, "Skipped %lu blank blocks\n", (unsigned long)skipped);
+    // Flash contents are in doubt, start over on the next attempt
+    if (status == STM32_ERR_VERIFY) progress->erased = 0;
+    flash_plan_free(&plan);
+
+    return status;
+}
+
+// Erases through the bootloader, then loads the stub and streams contiguous blocks to it in chunks
+// as large as it takes. Any verification uses the stub's CRC command, which also confirms the last
+// chunk was programmed. The stub cannot pick up where a failed attempt left off, so every attempt
+// starts over.
+static int flash_stub(
+  struct stm32* stm, const struct image* image, const struct flash_options* options) {
+    struct flash_progress scratch = { 0 };
+    struct flash_progress* progress = options->progress ? options->progress : &scratch;
+    const struct stub* stub = options->stub;
+    struct flash_plan plan;
+    int status = flash_plan_init(&plan, image);
+    if (status != STM32_OK) return status;
+    flash_plan_defer(&plan, options->identity_addr, options->identity_size);
+    unsigned char* data = (unsigned char*)malloc(stub->chunk);
+    if (!data) status = STM32_ERR_IO;
+
+    progress->written = 0;
+    progress->verified = 0;
+    if (status == STM32_OK) status = flash_erase(stm, &plan, options);
+    if (status == STM32_OK && options->log)
+        fprintf(options->log, "Starting stub at %u baud\n", options->stub_baud);
+    if (status == STM32_OK) status = stub_start(stm, stub, options->baud, options->stub_baud);
+
+    // Identity blocks last, once the rest has been programmed and verified
+    size_t ends[2] = { plan.count - plan.deferred, plan.count };
+    size_t skipped = 0;
+    for (int pass = 0; status == STM32_OK && pass < 2; pass++) {
+        size_t end = ends[pass];
+        size_t first = progress->written;
+        for (size_t i = first; status == STM32_OK && i < end;) {
+            const struct flash_block* block = &plan.blocks[i];
+            if (i == first || block->segment != plan.blocks[i - 1].segment)
+                flash_log_segment(options, "Writing", &image->segments[block->segment]);
+            if (block->blank) {
+                skipped++;
+                i++;
+                continue;
+            }
+            // Blocks only pad the tail of a segment, so a padded block always ends the chunk
+            uint32_t addr = block->addr;
+            size_t size = flash_block_payload(block, data);
+            for (i++; i < end; i++) {
+                const struct flash_block* next = &plan.blocks[i];
+                if (next->blank || next->addr != addr + size || size + next->size > stub->chunk)
+                    break;
+                size += flash_block_payload(next, data + size);
+            }
+            status = stub_write(stm, addr, data, size);
+            if (status == STM32_OK) progress->written = i;
+        }
+        // Trailing blank blocks included
+        if (status == STM32_OK) progress->written = end;
+
+        if (status == STM32_OK && options->verify == FLASH_VERIFY_NONE) status = stub_ping(stm);
+        while (options->verify && status == STM32_OK && progress->verified < end) {
+            struct flash_checksum checksum;
+            uint32_t crc;
+            size_t next = flash_plan_checksum(&plan, progress->verified, &checksum);
+            flash_log_segment(
+              options, "Verifying", &image->segments[plan.blocks[progress->verified].segment]);
+            status = stub_checksum(stm, checksum.addr, checksum.size, &crc);
+            if (status == STM32_OK && crc != checksum.crc) status = STM32_ERR_VERIFY;
+            if (status == STM32_OK) progress->verified = next;
+        }
+    }
+    if (skipped && options->log)
+        fprintf(options->log, "Skipped %lu blank blocks\n", (unsigned long)skipped);
+
+    if (status != STM32_OK) {
+        if (options->log)
+            fprintf(options->log, "Stub failed, falling back to the bootloader\n");
+        progress->erased = 0;
+        progress->rom_only = 1;
+    }
+    free(data);
+    flash_plan_free(&plan);
+
+    return status;
+}
+
+static int flash_identity_matches(
+  struct stm32* stm, const struct image* image, const struct flash_options* options) {
+    unsigned char data[STM32_MAX_TRANSFER];
+    const unsigned char* expected =
+      image_at(image, options->identity_addr, options->identity_size);
+    if (!expected || options->identity_size > STM32_MAX_TRANSFER) return 0;
+    int status = stm32_read_memory(stm, options->identity_addr, data, options->identity_size);
+    return status == STM32_OK && memcmp(data, expected, options->identity_size) == 0;
+}
+
+int flash_image(struct stm32* stm, const struct image* image, const struct flash_options* options) {
+    if (options->identity_size && flash_identity_matches(stm, image, options)) {
+        if (options->log) fprintf(options->log, "Device is up to date\n");
+        return STM32_OK;
+    }
+
+    const struct device* device = device_find(stm->pid);
+    unsigned char uid[DEVICE_UID_LENGTH];
+    // Parts missing from the table, or with the ID area read protected, are always flashed
+    int cached = options->image_hash && device &&
+                 stm32_read_memory(stm, device->uid_addr, uid, sizeof(uid)) == STM32_OK;
+    if (cached && options->force) {
+        flash_cache_forget(stm->pid, uid);
+    } else if (cached && flash_cache_lookup(stm->pid, uid, options->image_hash)) {
+        if (options->log) fprintf(options->log, "Device already carries this image\n");
+        return STM32_OK;
+    }
+
+    int status;
+    const struct flash_progress* progress = options->progress;
+    int stub = options->stub && stub_supports(options->stub, stm->pid) &&
+               stm32_supports(stm, STM32_CMD_GO) && !(progress && progress->rom_only);
+    if (options->delta && device && flash_fits(image, device)) {
+        status = flash_delta(stm, image, device, options);
+    } else if (stub && !options->delta) {
+        status = flash_stub(stm, image, options);
+    } else {
+        if (options->delta && options->log)
+            fprintf(options->log, "Unknown flash layout, flashing everything\n");
+        status = flash_full(stm, image, options);
+    }
+    if (cached && status == STM32_OK) flash_cache_store(stm->pid, uid, options->image_hash);
+
+    return status;
+}
@@ -0,0 +1,147 @@
+#include "gpio.h"
+
+#include "session.h"
+#include "timestamp.h"
+
+#include <stdlib.h>
+
+// FT232R latency timer default, reported by the simulated device
+#define SIM_LATENCY 16 // milliseconds
+
+// Simulated FT232R
+
+static int sim_open(struct session* session) {
+    return FT_OK;
+}
+
+static int sim_close(struct session* session) {
+    return FT_OK;
+}
+
+static int sim_get_latency(struct session* session, unsigned char* latency) {
+    *latency = SIM_LATENCY;
+    return FT_OK;
+}
+
+static int sim_set_latency(struct session* session, unsigned char latency) {
+    return FT_OK;
+}
+
+static int sim_write(struct session* session, unsigned char value) {
+    struct cbus_timeline* timeline = session->timeline;
+    if (!timeline) return FT_OK;
+    if (timeline->count == timeline->capacity) {
+        timeline->capacity = timeline->capacity ? timeline->capacity * 2 : 16;
+        timeline->events = (struct cbus_event*)realloc(
+          timeline->events, timeline->capacity * sizeof(struct cbus_event));
+    }
+    struct cbus_event* event = &timeline->events[timeline->count++];
+    event->value = value;
+    event->time = timestamp_us();
+    return FT_OK;
+}
+
+const struct gpio_backend gpio_sim = {
+    .name = "sim",
+    .open = sim_open,
+    .close = sim_close,
+    .get_latency = sim_get_latency,
+    .set_latency = sim_set_latency,
+    .write = sim_write,
+};
+
+void cbus_timeline_free(struct cbus_timeline* timeline) {
+    free(timeline->events);
+    timeline->events = NULL;
+    timeline->count = timeline->capacity = 0;
+}
+
+// Level seen by the target: the output bit of a driven pin, otherwise the board's pull-down on
+// BOOT0 and pull-up on NRST
+int cbus_level(unsigned char value, unsigned char pin) {
+    if (value & pin << 4) return (value & pin) != 0;
+    return pin == CBUS_NRST;
+}
+
+int cbus_timeline_check(const struct cbus_timeline* timeline, FILE* stream) {
+    int status = GPIO_OK;
+    if (timeline->count == 0) return status;
+    uint64_t start = timeline->events[0].time;
+    // Pins are inputs until the first write
+    int boot0 = 0;
+    int nrst = 1;
+    uint64_t nrst_low = start;
+    // BOOT0 has not moved yet, so it is stable for as long as it needs to be
+    int boot0_moved = 0;
+    uint64_t boot0_changed = start;
+    unsigned int resets = 0;
+    uint64_t pulse_total = 0;
+    uint64_t pulse_max = 0;
+
+    if (stream) fprintf(stream, "CBUS timeline:\n");
+    for (size_t i = 0; i < timeline->count; i++) {
+        const struct cbus_event* event = &timeline->events[i];
+        int level_boot0 = cbus_level(event->value, CBUS_BOOT0);
+        int level_nrst = cbus_level(event->value, CBUS_NRST);
+        if (stream)
+            fprintf(
+              stream,
+              "  +%9.3f ms  0x%02X  BOOT0 %-4s  NRST %s\n",
+              (event->time - start) / 1000.0,
+              event->value,
+              level_boot0 ? "high" : "low",
+              level_nrst ? "high" : "low");
+        if (level_boot0 != boot0) {
+            boot0_moved = 1;
+            boot0_changed = event->time;
+        }
+        if (nrst && !level_nrst) nrst_low = event->time;
+        if (!nrst && level_nrst) {
+            // The target samples BOOT0 as it leaves reset
+            uint64_t pulse = event->time - nrst_low;
+            uint64_t setup = event->time - boot0_changed;
+            resets++;
+            pulse_total += pulse;
+            if (pulse > pulse_max) pulse_max = pulse;
+            if (stream)
+                fprintf(
+                  stream,
+                  "  reset into the %s: NRST low %.3f ms, BOOT0 setup %s%.3f ms\n",
+                  level_boot0 ? "bootloader" : "application",
+                  pulse / 1000.0,
+                  boot0_moved ? "" : "> ",
+                  setup / 1000.0);
+            if (pulse < CBUS_MIN_RESET_PULSE) {
+                status = GPIO_ERR_TIMING;
+                if (stream)
+                    fprintf(
+                      stream, "  violation: NRST low for less than %d us\n", CBUS_MIN_RESET_PULSE);
+            }
+            if (boot0_moved && setup < CBUS_MIN_BOOT_SETUP) {
+                status = GPIO_ERR_TIMING;
+                if (stream)
+                    fprintf(
+                      stream,
+                      "  violation: BOOT0 changed less than %d us before NRST was released\n",
+                      CBUS_MIN_BOOT_SETUP);
+            }
+        }
+        boot0 = level_boot0;
+        nrst = level_nrst;
+    }
+
+    // The target must be left free-running, with the board's pulls in charge of both pins
+    if (timeline->events[timeline->count - 1].value & (CBUS_BOOT0 | CBUS_NRST) << 4) {
+        status = GPIO_ERR_TIMING;
+        if (stream) fprintf(stream, "  violation: pins still driven at the end\n");
+    }
+    if (stream && resets)
+        fprintf(
+          stream,
+          "%u reset(s), NRST low %.3f ms average, %.3f ms max\n",
+          resets,
+          pulse_total / 1000.0 / resets,
+          pulse_max / 1000.0);
+
+    return status;
+}
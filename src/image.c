@@ -0,0 +1,501 @@
+#include "image.h"
+
+#include "sha256.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// ELF note header: name size, descriptor size and type, followed by the name
+#define NOTE_HEADER_SIZE 12
+#define NT_GNU_BUILD_ID 3
+#define BUILD_ID_MAX 64
+
+// ELF32 header and program header fields used here
+#define ELF_HEADER_SIZE 52
+#define ELF_PROGRAM_HEADER_SIZE 32
+#define ELF_CLASS_32 1
+#define ELF_DATA_LSB 1
+#define PT_LOAD 1
+
+// Longest Intel HEX / S-record line payload, a byte count of 255
+#define RECORD_MAX 255
+// Widest programming unit of the parts in the device table, a double word. Write Memory also
+// needs word aligned addresses.
+#define IMAGE_WORD 8
+
+// Read-only view of a whole input file
+struct mapping {
+    const unsigned char* data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE view;
+#endif
+};
+
+// Segments under construction. Records extending the last segment grow it in place, anything
+// else starts a new one; image_finish() sorts and merges them at the end.
+struct builder {
+    struct image* image;
+    size_t capacity;
+    // Bytes allocated for the last segment
+    size_t last_capacity;
+};
+
+static int image_map(struct mapping* mapping, const char* path) {
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    mapping->file = CreateFileA(
+      path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mapping->file == INVALID_HANDLE_VALUE) return IMAGE_ERR_IO;
+    if (!GetFileSizeEx(mapping->file, &size)) {
+        CloseHandle(mapping->file);
+        return IMAGE_ERR_IO;
+    }
+    if (size.QuadPart == 0) {
+        CloseHandle(mapping->file);
+        return IMAGE_ERR_FORMAT;
+    }
+    mapping->view = CreateFileMappingA(mapping->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    mapping->data =
+      mapping->view ? (const unsigned char*)MapViewOfFile(mapping->view, FILE_MAP_READ, 0, 0, 0) :
+                      NULL;
+    if (!mapping->data) {
+        if (mapping->view) CloseHandle(mapping->view);
+        CloseHandle(mapping->file);
+        return IMAGE_ERR_IO;
+    }
+    mapping->size = (size_t)size.QuadPart;
+#else
+    struct stat info;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return IMAGE_ERR_IO;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return IMAGE_ERR_IO;
+    }
+    if (info.st_size == 0) {
+        close(fd);
+        return IMAGE_ERR_FORMAT;
+    }
+    void* data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file referenced
+    close(fd);
+    if (data == MAP_FAILED) return IMAGE_ERR_IO;
+    mapping->data = (const unsigned char*)data;
+    mapping->size = info.st_size;
+#endif
+    return IMAGE_OK;
+}
+
+static void image_unmap(struct mapping* mapping) {
+#ifdef _WIN32
+    UnmapViewOfFile(mapping->data);
+    CloseHandle(mapping->view);
+    CloseHandle(mapping->file);
+#else
+    munmap((void*)mapping->data, mapping->size);
+#endif
+}
+
+static int image_append(
+  struct builder* builder, uint32_t addr, const unsigned char* data, size_t size) {
+    struct image* image = builder->image;
+    struct segment* last = image->count ? &image->segments[image->count - 1] : NULL;
+    if (size == 0) return IMAGE_OK;
+
+    if (!last || addr != last->addr + last->size) {
+        if (image->count == builder->capacity) {
+            size_t capacity = builder->capacity ? builder->capacity * 2 : 8;
+            struct segment* segments =
+              (struct segment*)realloc(image->segments, capacity * sizeof(struct segment));
+            if (!segments) return IMAGE_ERR_IO;
+            image->segments = segments;
+            builder->capacity = capacity;
+        }
+        last = &image->segments[image->count++];
+        last->addr = addr;
+        last->size = 0;
+        last->data = NULL;
+        builder->last_capacity = 0;
+    }
+    if (last->size + size > builder->last_capacity) {
+        size_t capacity = builder->last_capacity ? builder->last_capacity * 2 : 256;
+        while (capacity < last->size + size) capacity *= 2;
+        unsigned char* grown = (unsigned char*)realloc(last->data, capacity);
+        if (!grown) return IMAGE_ERR_IO;
+        last->data = grown;
+        builder->last_capacity = capacity;
+    }
+    memcpy(last->data + last->size, data, size);
+    last->size += size;
+
+    return IMAGE_OK;
+}
+
+static int image_compare(const void* a, const void* b) {
+    uint32_t left = ((const struct segment*)a)->addr;
+    uint32_t right = ((const struct segment*)b)->addr;
+    return left < right ? -1 : left > right;
+}
+
+// Pads every segment out to whole flash words with the erased value and joins segments that then
+// share or touch a word, so that each word is programmed once, from its start
+static int image_align(struct image* image) {
+    size_t count = 0;
+    for (size_t i = 0; i < image->count; i++) {
+        struct segment* segment = &image->segments[i];
+        struct segment* last = count ? &image->segments[count - 1] : NULL;
+        uint32_t start = segment->addr & ~(uint32_t)(IMAGE_WORD - 1);
+        uint32_t end =
+          (segment->addr + segment->size + IMAGE_WORD - 1) & ~(uint32_t)(IMAGE_WORD - 1);
+        int join = last && start <= last->addr + last->size;
+        if (join) start = last->addr;
+
+        if (start == segment->addr && end - start == segment->size) {
+            image->segments[count++] = *segment;
+        } else {
+            unsigned char* data = (unsigned char*)malloc(end - start);
+            if (!data) return IMAGE_ERR_IO;
+            memset(data, 0xFF, end - start);
+            if (join) memcpy(data, last->data, last->size);
+            memcpy(data + (segment->addr - start), segment->data, segment->size);
+            free(segment->data);
+            if (join)
+                free(last->data);
+            else
+                last = &image->segments[count++];
+            last->addr = start;
+            last->size = end - start;
+            last->data = data;
+        }
+        if (&image->segments[count - 1] != segment) segment->data = NULL;
+    }
+    image->count = count;
+
+    return IMAGE_OK;
+}
+
+// Sorts the segments by address and joins touching ones. Overlapping records are rejected,
+// there is no telling which of them the author meant.
+static int image_finish(struct image* image, int status) {
+    size_t count = 0;
+    if (status == IMAGE_OK && image->count == 0) status = IMAGE_ERR_FORMAT;
+    if (status != IMAGE_OK) {
+        image_free(image);
+        return status;
+    }
+
+    qsort(image->segments, image->count, sizeof(struct segment), image_compare);
+    for (size_t i = 1; status == IMAGE_OK && i < image->count; i++) {
+        struct segment* last = &image->segments[count];
+        struct segment* next = &image->segments[i];
+        if (next->addr < last->addr + last->size) {
+            status = IMAGE_ERR_FORMAT;
+        } else if (next->addr == last->addr + last->size) {
+            unsigned char* data = (unsigned char*)realloc(last->data, last->size + next->size);
+            if (!data) {
+                status = IMAGE_ERR_IO;
+                continue;
+            }
+            memcpy(data + last->size, next->data, next->size);
+            last->data = data;
+            last->size += next->size;
+            free(next->data);
+            next->data = NULL;
+        } else {
+            image->segments[++count] = *next;
+            if (count != i) next->data = NULL;
+        }
+    }
+    // Everything after count has been merged away
+    for (size_t i = count + 1; i < image->count; i++) free(image->segments[i].data);
+    image->count = count + 1;
+    if (status == IMAGE_OK) status = image_align(image);
+    if (status != IMAGE_OK) image_free(image);
+
+    return status;
+}
+
+static int image_parse_bin(struct builder* builder, const struct mapping* file, uint32_t addr) {
+    return image_append(builder, addr, file->data, file->size);
+}
+
+static uint32_t image_word(const unsigned char* data) {
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 |
+           (uint32_t)data[3] << 24;
+}
+
+static int image_parse_elf(struct builder* builder, const struct mapping* file) {
+    const unsigned char* header = file->data;
+    if (file->size < ELF_HEADER_SIZE || header[4] != ELF_CLASS_32 || header[5] != ELF_DATA_LSB)
+        return IMAGE_ERR_FORMAT;
+    uint32_t offset = image_word(header + 28);
+    unsigned int entry_size = header[42] | header[43] << 8;
+    unsigned int count = header[44] | header[45] << 8;
+    if (entry_size < ELF_PROGRAM_HEADER_SIZE || offset > file->size ||
+        (size_t)count * entry_size > file->size - offset)
+        return IMAGE_ERR_FORMAT;
+
+    int status = IMAGE_OK;
+    for (unsigned int i = 0; status == IMAGE_OK && i < count; i++) {
+        const unsigned char* program = file->data + offset + i * entry_size;
+        uint32_t data = image_word(program + 4);
+        // Load (physical) address, where initialized data lives in flash
+        uint32_t addr = image_word(program + 12);
+        uint32_t size = image_word(program + 16);
+        if (image_word(program) != PT_LOAD || size == 0) continue;
+        if (data > file->size || size > file->size - data) return IMAGE_ERR_FORMAT;
+        status = image_append(builder, addr, file->data + data, size);
+    }
+
+    return status;
+}
+
+static int image_hex_digit(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Decodes the hex digit pairs of a line up to the line ending, returns the byte count or -1
+static int image_decode_line(
+  const unsigned char* line, const unsigned char* end, unsigned char* bytes, size_t max) {
+    size_t count = 0;
+    while (line < end && *line != '\r' && *line != '\n') {
+        int high = image_hex_digit(line[0]);
+        int low = line + 1 < end ? image_hex_digit(line[1]) : -1;
+        if (high < 0 || low < 0 || count == max) return -1;
+        bytes[count++] = (unsigned char)(high << 4 | low);
+        line += 2;
+    }
+    return (int)count;
+}
+
+static const unsigned char* image_next_line(const unsigned char* line, const unsigned char* end) {
+    while (line < end && *line != '\n') line++;
+    return line < end ? line + 1 : end;
+}
+
+// Intel HEX: ":" count, address, type, data, checksum
+static int image_parse_hex(struct builder* builder, const struct mapping* file) {
+    unsigned char bytes[RECORD_MAX + 5];
+    const unsigned char* end = file->data + file->size;
+    uint32_t base = 0;
+
+    for (const unsigned char* line = file->data; line < end; line = image_next_line(line, end)) {
+        if (*line == '\r' || *line == '\n') continue;
+        if (*line != ':') return IMAGE_ERR_FORMAT;
+        int size = image_decode_line(line + 1, end, bytes, sizeof(bytes));
+        if (size < 5 || size != bytes[0] + 5) return IMAGE_ERR_FORMAT;
+        unsigned char sum = 0;
+        for (int i = 0; i < size; i++) sum += bytes[i];
+        if (sum != 0) return IMAGE_ERR_FORMAT;
+
+        uint32_t offset = bytes[1] << 8 | bytes[2];
+        const unsigned char* data = bytes + 4;
+        switch (bytes[3]) {
+            case 0x00: {
+                int status = image_append(builder, base + offset, data, bytes[0]);
+                if (status != IMAGE_OK) return status;
+                break;
+            }
+            case 0x01:
+                return IMAGE_OK;
+            case 0x02:
+                if (bytes[0] != 2) return IMAGE_ERR_FORMAT;
+                base = (uint32_t)(data[0] << 8 | data[1]) << 4;
+                break;
+            case 0x04:
+                if (bytes[0] != 2) return IMAGE_ERR_FORMAT;
+                base = (uint32_t)(data[0] << 8 | data[1]) << 16;
+                break;
+            // Start addresses
+            case 0x03:
+            case 0x05:
+                break;
+            default:
+                return IMAGE_ERR_FORMAT;
+        }
+    }
+
+    // No end of file record
+    return IMAGE_ERR_FORMAT;
+}
+
+// Motorola S-record: "S" type, count, address, data, checksum
+static int image_parse_srec(struct builder* builder, const struct mapping* file) {
+    unsigned char bytes[RECORD_MAX + 1];
+    const unsigned char* end = file->data + file->size;
+
+    for (const unsigned char* line = file->data; line < end; line = image_next_line(line, end)) {
+        if (*line == '\r' || *line == '\n') continue;
+        if (*line != 'S' || line + 1 == end) return IMAGE_ERR_FORMAT;
+        char type = (char)line[1];
+        int size = image_decode_line(line + 2, end, bytes, sizeof(bytes));
+        if (size < 1 || size != bytes[0] + 1) return IMAGE_ERR_FORMAT;
+        unsigned char sum = 0;
+        for (int i = 0; i < size - 1; i++) sum += bytes[i];
+        if ((unsigned char)~sum != bytes[size - 1]) return IMAGE_ERR_FORMAT;
+
+        int address_size;
+        switch (type) {
+            case '1':
+                address_size = 2;
+                break;
+            case '2':
+                address_size = 3;
+                break;
+            case '3':
+                address_size = 4;
+                break;
+            // Header, record counts and start addresses
+            case '0':
+            case '5':
+            case '6':
+            case '7':
+            case '8':
+            case '9':
+                continue;
+            default:
+                return IMAGE_ERR_FORMAT;
+        }
+        if (bytes[0] < address_size + 1) return IMAGE_ERR_FORMAT;
+        uint32_t addr = 0;
+        for (int i = 0; i < address_size; i++) addr = addr << 8 | bytes[1 + i];
+        int status = image_append(
+          builder, addr, bytes + 1 + address_size, bytes[0] - address_size - 1);
+        if (status != IMAGE_OK) return status;
+    }
+
+    return IMAGE_OK;
+}
+
+// A raw image starts with the initial stack pointer, which is word aligned and so never reads as
+// ':' or 'S'
+static int image_detect(const struct mapping* file) {
+    if (file->size >= 4 && memcmp(file->data, "\x7f" "ELF", 4) == 0) return IMAGE_FORMAT_ELF;
+    if (file->data[0] == ':') return IMAGE_FORMAT_HEX;
+    if (file->size >= 2 && file->data[0] == 'S' && file->data[1] >= '0' && file->data[1] <= '9')
+        return IMAGE_FORMAT_SREC;
+    return IMAGE_FORMAT_BIN;
+}
+
+int image_format(const char* path) {
+    struct mapping file;
+    if (image_map(&file, path) != IMAGE_OK) return IMAGE_FORMAT_BIN;
+    int format = image_detect(&file);
+    image_unmap(&file);
+    return format;
+}
+
+int image_load(struct image* image, const char* path, uint32_t addr) {
+    struct builder builder = { image, 0, 0 };
+    struct mapping file;
+    image->segments = NULL;
+    image->count = 0;
+
+    int status = image_map(&file, path);
+    if (status != IMAGE_OK) return status;
+    switch (image_detect(&file)) {
+        case IMAGE_FORMAT_ELF:
+            status = image_parse_elf(&builder, &file);
+            break;
+        case IMAGE_FORMAT_HEX:
+            status = image_parse_hex(&builder, &file);
+            break;
+        case IMAGE_FORMAT_SREC:
+            status = image_parse_srec(&builder, &file);
+            break;
+        default:
+            status = image_parse_bin(&builder, &file, addr);
+    }
+    image_unmap(&file);
+
+    return image_finish(image, status);
+}
+
+int image_load_bin(struct image* image, const char* path, uint32_t addr) {
+    struct builder builder = { image, 0, 0 };
+    struct mapping file;
+    image->segments = NULL;
+    image->count = 0;
+
+    int status = image_map(&file, path);
+    if (status != IMAGE_OK) return status;
+    status = image_parse_bin(&builder, &file, addr);
+    image_unmap(&file);
+
+    return image_finish(image, status);
+}
+
+size_t image_size(const struct image* image) {
+    size_t size = 0;
+    for (size_t i = 0; i < image->count; i++) size += image->segments[i].size;
+    return size;
+}
+
+void image_hash(const struct image* image, char* hash) {
+    struct sha256 sha;
+    unsigned char digest[SHA256_LENGTH];
+    sha256_init(&sha);
+    for (size_t i = 0; i < image->count; i++) {
+        const struct segment* segment = &image->segments[i];
+        // Same data at another address is another image
+        uint32_t header[2] = { segment->addr, (uint32_t)segment->size };
+        sha256_update(&sha, header, sizeof(header));
+        sha256_update(&sha, segment->data, segment->size);
+    }
+    sha256_final(&sha, digest);
+    for (int i = 0; i < SHA256_LENGTH; i++) sprintf(hash + i * 2, "%02x", digest[i]);
+}
+
+const unsigned char* image_at(const struct image* image, uint32_t addr, size_t size) {
+    for (size_t i = 0; i < image->count; i++) {
+        const struct segment* segment = &image->segments[i];
+        if (addr >= segment->addr && addr - segment->addr + size <= segment->size)
+            return segment->data + (addr - segment->addr);
+    }
+    return NULL;
+}
+
+int image_find_build_id(const struct image* image, uint32_t* addr, size_t* size) {
+    static const unsigned char name[4] = { 'G', 'N', 'U', '\0' };
+    for (size_t i = 0; i < image->count; i++) {
+        const struct segment* segment = &image->segments[i];
+        // Notes are word aligned
+        size_t skew = (4 - segment->addr % 4) % 4;
+        for (size_t offset = skew; offset + NOTE_HEADER_SIZE + sizeof(name) <= segment->size;
+             offset += 4) {
+            const unsigned char* note = segment->data + offset;
+            uint32_t length = image_word(note + 4);
+            if (image_word(note) != sizeof(name) || image_word(note + 8) != NT_GNU_BUILD_ID ||
+                memcmp(note + NOTE_HEADER_SIZE, name, sizeof(name)) != 0 || length == 0 ||
+                length > BUILD_ID_MAX)
+                continue;
+            *size = NOTE_HEADER_SIZE + sizeof(name) + length;
+            if (offset + *size > segment->size) continue;
+            *addr = segment->addr + offset;
+            return IMAGE_OK;
+        }
+    }
+    return IMAGE_ERR_FORMAT;
+}
+
+void image_free(struct image* image) {
+    for (size_t i = 0; i < image->count; i++) free(image->segments[i].data);
+    free(image->segments);
+    image->segments = NULL;
+    image->count = 0;
+}
@@ -0,0 +1,76 @@
+#include "lz4.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+// The format requires the last 5 bytes to be literals and the last match to start at least 12
+// bytes before the end
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+
+static uint32_t lz4_read(const unsigned char* data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static size_t lz4_hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// Length beyond the 15 held in the token, in 255 steps
+static unsigned char* lz4_length(unsigned char* out, size_t length) {
+    for (length -= 15; length >= 255; length -= 255) *out++ = 255;
+    *out++ = (unsigned char)length;
+    return out;
+}
+
+// Literals followed by a match of match bytes at offset back, or by nothing when match is 0
+static unsigned char* lz4_sequence(
+  unsigned char* out, const unsigned char* literals, size_t count, size_t match, size_t offset) {
+    unsigned char* token = out++;
+    *token = (count < 15 ? count : 15) << 4;
+    if (count >= 15) out = lz4_length(out, count);
+    memcpy(out, literals, count);
+    out += count;
+    if (match) {
+        *out++ = offset & 0xFF;
+        *out++ = offset >> 8;
+        match -= LZ4_MIN_MATCH;
+        *token |= match < 15 ? match : 15;
+        if (match >= 15) out = lz4_length(out, match);
+    }
+    return out;
+}
+
+size_t lz4_compress(const unsigned char* src, size_t size, unsigned char* dst) {
+    // Positions plus one of the last 4-byte strings seen per hash, 0 for none
+    uint32_t table[1 << LZ4_HASH_BITS] = { 0 };
+    unsigned char* out = dst;
+    size_t anchor = 0;
+    size_t pos = 0;
+    while (pos + LZ4_MATCH_LIMIT <= size) {
+        uint32_t value = lz4_read(src + pos);
+        size_t hash = lz4_hash(value);
+        size_t candidate = table[hash];
+        table[hash] = (uint32_t)(pos + 1);
+        if (!candidate || pos + 1 - candidate > LZ4_MAX_OFFSET ||
+            lz4_read(src + candidate - 1) != value) {
+            pos++;
+            continue;
+        }
+
+        size_t match = candidate - 1;
+        size_t length = LZ4_MIN_MATCH;
+        while (pos + length < size - LZ4_LAST_LITERALS && src[match + length] == src[pos + length])
+            length++;
+        out = lz4_sequence(out, src + anchor, pos - anchor, length, pos - match);
+        pos += length;
+        anchor = pos;
+    }
+    out = lz4_sequence(out, src + anchor, size - anchor, 0, 0);
+    return out - dst;
+}
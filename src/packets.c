@@ -0,0 +1,277 @@
+#include "packets.h"
+
+#include "cache.h"
+#include "stm32.h"
+
+#ifdef _WIN32
+#include <process.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Cache entry remembering the image whose packets were last built, per product and chunk size
+#define PACKETS_CACHE "packets"
+#define PACKETS_MAGIC "SHFP"
+#define PACKETS_VERSION 1
+
+struct packets_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t pid;
+    uint32_t chunk;
+    uint32_t count;
+};
+
+// Held while a file is looked up and built, so that boards flashing the same image at once build
+// it only once: the others wait, then map the first one's file
+static pthread_mutex_t packets_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int packets_serial;
+
+// Checks the mapped file is complete and made for pid
+static int packets_check(struct packets* packets, uint16_t pid) {
+    struct packets_header header;
+    if (packets->map_size < sizeof(header)) return PACKETS_ERR_FORMAT;
+    memcpy(&header, packets->map, sizeof(header));
+    if (memcmp(header.magic, PACKETS_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != PACKETS_VERSION || header.pid != pid ||
+        header.chunk != STM32_MAX_TRANSFER ||
+        header.count > (packets->map_size - sizeof(header)) / sizeof(struct packets_entry))
+        return PACKETS_ERR_FORMAT;
+
+    packets->entries = (const struct packets_entry*)(packets->map + sizeof(header));
+    packets->count = header.count;
+    for (size_t i = 0; i < packets->count; i++) {
+        const struct packets_entry* entry = &packets->entries[i];
+        if (entry->size == 0 || entry->size > STM32_MAX_TRANSFER ||
+            entry->offset > packets->map_size ||
+            packets->map_size - entry->offset < STM32_ADDRESS_FRAME + entry->size + 2 ||
+            (i && entry->addr <= packets->entries[i - 1].addr))
+            return PACKETS_ERR_FORMAT;
+    }
+    return PACKETS_OK;
+}
+
+#ifdef _WIN32
+static int packets_map(struct packets* packets, const char* path, uint16_t pid) {
+    LARGE_INTEGER size;
+    memset(packets, 0, sizeof(struct packets));
+    HANDLE file = CreateFileA(
+      path,
+      GENERIC_READ,
+      FILE_SHARE_READ | FILE_SHARE_DELETE,
+      NULL,
+      OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL,
+      NULL);
+    if (file == INVALID_HANDLE_VALUE) return PACKETS_ERR_IO;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    const void* map = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!map) {
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+        return PACKETS_ERR_IO;
+    }
+    packets->map = (const unsigned char*)map;
+    packets->map_size = (size_t)size.QuadPart;
+    packets->file = file;
+    packets->mapping = mapping;
+
+    int status = packets_check(packets, pid);
+    if (status != PACKETS_OK) packets_close(packets);
+    return status;
+}
+
+void packets_close(struct packets* packets) {
+    if (packets->map) {
+        UnmapViewOfFile(packets->map);
+        CloseHandle(packets->mapping);
+        CloseHandle(packets->file);
+    }
+    memset(packets, 0, sizeof(struct packets));
+}
+#else
+static int packets_map(struct packets* packets, const char* path, uint16_t pid) {
+    struct stat info;
+    memset(packets, 0, sizeof(struct packets));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return PACKETS_ERR_IO;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+        map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps the file alive
+    close(fd);
+    if (map == MAP_FAILED) return PACKETS_ERR_IO;
+    packets->map = (const unsigned char*)map;
+    packets->map_size = info.st_size;
+
+    int status = packets_check(packets, pid);
+    if (status != PACKETS_OK) packets_close(packets);
+    return status;
+}
+
+void packets_close(struct packets* packets) {
+    if (packets->map) munmap((void*)packets->map, packets->map_size);
+    memset(packets, 0, sizeof(struct packets));
+}
+#endif
+
+const unsigned char* packets_find(const struct packets* packets, uint32_t addr, size_t* size) {
+    size_t low = 0;
+    size_t high = packets->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        const struct packets_entry* entry = &packets->entries[middle];
+        if (entry->addr == addr) {
+            *size = entry->size;
+            return packets->map + entry->offset;
+        }
+        if (entry->addr < addr)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return NULL;
+}
+
+static int packets_compare(const void* a, const void* b) {
+    uint32_t addr_a = (*(const struct flash_block* const*)a)->addr;
+    uint32_t addr_b = (*(const struct flash_block* const*)b)->addr;
+    return addr_a < addr_b ? -1 : addr_a > addr_b;
+}
+
+// Writes the frames of plan's non-blank blocks to path, copying those base already holds with the
+// same payload. Counts the blocks in count and the copied ones in reused. Called with
+// packets_lock held.
+static int packets_build(
+  const char* path,
+  const struct flash_plan* plan,
+  uint16_t pid,
+  const struct packets* base,
+  size_t* count,
+  size_t* reused) {
+    struct packets_header header = { .version = PACKETS_VERSION, .pid = pid };
+    unsigned char data[STM32_MAX_TRANSFER];
+    char temp[CACHE_PATH_LENGTH + 32];
+    const struct flash_block** blocks =
+      (const struct flash_block**)malloc((plan->count ? plan->count : 1) * sizeof(*blocks));
+    if (!blocks) return PACKETS_ERR_IO;
+
+    size_t size = sizeof(header);
+    *count = 0;
+    *reused = 0;
+    for (size_t i = 0; i < plan->count; i++) {
+        if (plan->blocks[i].blank) continue;
+        blocks[(*count)++] = &plan->blocks[i];
+        size += sizeof(struct packets_entry) + STM32_ADDRESS_FRAME + STM32_MAX_TRANSFER + 2;
+    }
+    qsort(blocks, *count, sizeof(*blocks), packets_compare);
+    unsigned char* file = (unsigned char*)malloc(size);
+    if (!file) {
+        free(blocks);
+        return PACKETS_ERR_IO;
+    }
+
+    memcpy(header.magic, PACKETS_MAGIC, sizeof(header.magic));
+    header.chunk = STM32_MAX_TRANSFER;
+    header.count = *count;
+    memcpy(file, &header, sizeof(header));
+    struct packets_entry* entries = (struct packets_entry*)(file + sizeof(header));
+    size_t offset = sizeof(header) + *count * sizeof(struct packets_entry);
+    for (size_t i = 0; i < *count; i++) {
+        size_t payload = flash_block_payload(blocks[i], data);
+        size_t base_size;
+        const unsigned char* frames = base ? packets_find(base, blocks[i]->addr, &base_size) : NULL;
+        entries[i].addr = blocks[i]->addr;
+        entries[i].offset = offset;
+        entries[i].size = payload;
+        // Same address and payload, so the frames are byte for byte the same
+        if (frames && base_size == payload &&
+            memcmp(frames + STM32_ADDRESS_FRAME + 1, data, payload) == 0) {
+            memcpy(file + offset, frames, STM32_ADDRESS_FRAME + payload + 2);
+            (*reused)++;
+        } else {
+            stm32_encode_address(blocks[i]->addr, file + offset);
+            stm32_encode_data(data, payload, file + offset + STM32_ADDRESS_FRAME);
+        }
+        offset += STM32_ADDRESS_FRAME + payload + 2;
+    }
+    free(blocks);
+
+    // Written next to the final name and renamed, so other processes never map a partial file
+#ifdef _WIN32
+    snprintf(temp, sizeof(temp), "%s.%d.%u", path, _getpid(), packets_serial++);
+#else
+    snprintf(temp, sizeof(temp), "%s.%d.%u", path, (int)getpid(), packets_serial++);
+#endif
+    FILE* out = fopen(temp, "wb");
+    int status = out && fwrite(file, 1, offset, out) == offset ? PACKETS_OK : PACKETS_ERR_IO;
+    if (out && fclose(out) != 0) status = PACKETS_ERR_IO;
+    free(file);
+#ifdef _WIN32
+    if (status == PACKETS_OK && !MoveFileExA(temp, path, MOVEFILE_REPLACE_EXISTING))
+        status = PACKETS_ERR_IO;
+#else
+    if (status == PACKETS_OK && rename(temp, path) != 0) status = PACKETS_ERR_IO;
+#endif
+    if (status != PACKETS_OK) remove(temp);
+
+    return status;
+}
+
+int packets_open(
+  struct packets* packets,
+  const struct flash_plan* plan,
+  const char* hash,
+  uint16_t pid,
+  FILE* log) {
+    char family[32];
+    char name[CACHE_KEY_LENGTH];
+    char path[CACHE_PATH_LENGTH];
+    snprintf(family, sizeof(family), "%03X-%d", pid, STM32_MAX_TRANSFER);
+    snprintf(name, sizeof(name), PACKETS_CACHE "-%s-%s", hash, family);
+    memset(packets, 0, sizeof(struct packets));
+    if (cache_path(name, path, sizeof(path)) != CACHE_OK) return PACKETS_ERR_IO;
+
+    pthread_mutex_lock(&packets_lock);
+    int status = packets_map(packets, path, pid);
+    if (status != PACKETS_OK) {
+        struct packets base = { 0 };
+        char base_hash[IMAGE_HASH_LENGTH];
+        char base_path[CACHE_PATH_LENGTH];
+        size_t count;
+        size_t reused;
+        // The family's previous image, which usually differs in a few blocks only
+        int stale = cache_get(PACKETS_CACHE, family, base_hash, sizeof(base_hash)) == CACHE_OK &&
+                    strcmp(base_hash, hash) != 0;
+        if (stale) {
+            snprintf(name, sizeof(name), PACKETS_CACHE "-%s-%s", base_hash, family);
+            stale = cache_path(name, base_path, sizeof(base_path)) == CACHE_OK;
+        }
+        int based = stale && packets_map(&base, base_path, pid) == PACKETS_OK;
+        status = packets_build(path, plan, pid, based ? &base : NULL, &count, &reused);
+        if (based) packets_close(&base);
+        if (status == PACKETS_OK) status = packets_map(packets, path, pid);
+        if (status == PACKETS_OK && cache_put(PACKETS_CACHE, family, hash) == CACHE_OK && stale)
+            // Superseded, boards still sending from it keep their mapping
+            remove(base_path);
+        if (status == PACKETS_OK && log)
+            fprintf(
+              log,
+              "Encoded %lu packets, %lu reused from the previous image\n",
+              (unsigned long)(count - reused),
+              (unsigned long)reused);
+    }
+    pthread_mutex_unlock(&packets_lock);
+
+    return status;
+}
@@ -0,0 +1,338 @@
+#include "serial.h"
+
+#include "timestamp.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#elif __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <linux/serial.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+struct serial {
+    HANDLE handle;
+    DWORD timeout;
+};
+
+static int serial_set_timeout(struct serial* serial, DWORD timeout) {
+    if (serial->timeout == timeout) return PORT_OK;
+    COMMTIMEOUTS timeouts = { 0 };
+    timeouts.ReadTotalTimeoutConstant = timeout;
+    timeouts.WriteTotalTimeoutConstant = timeout;
+    if (!SetCommTimeouts(serial->handle, &timeouts)) return PORT_ERR_IO;
+    serial->timeout = timeout;
+    return PORT_OK;
+}
+
+static int serial_write(struct port* port, const unsigned char* data, size_t size) {
+    struct serial* serial = (struct serial*)port->handle;
+    DWORD written;
+    if (!WriteFile(serial->handle, data, (DWORD)size, &written, NULL)) return PORT_ERR_IO;
+    return written == size ? PORT_OK : PORT_ERR_TIMEOUT;
+}
+
+static int serial_read(struct port* port, unsigned char* data, size_t size, unsigned int timeout) {
+    struct serial* serial = (struct serial*)port->handle;
+    DWORD received;
+    if (serial_set_timeout(serial, timeout) != PORT_OK) return PORT_ERR_IO;
+    if (!ReadFile(serial->handle, data, (DWORD)size, &received, NULL)) return PORT_ERR_IO;
+    return received == size ? PORT_OK : PORT_ERR_TIMEOUT;
+}
+
+static int serial_set_baud(struct port* port, unsigned int baud) {
+    struct serial* serial = (struct serial*)port->handle;
+    DCB dcb = { 0 };
+    dcb.DCBlength = sizeof(dcb);
+    if (!GetCommState(serial->handle, &dcb)) return PORT_ERR_IO;
+    dcb.BaudRate = baud;
+    return SetCommState(serial->handle, &dcb) ? PORT_OK : PORT_ERR_IO;
+}
+
+static int serial_set_lines(struct port* port, int dtr, int rts) {
+    // The COM port API has no call for both lines, so they change one after the other
+    HANDLE handle = ((struct serial*)port->handle)->handle;
+    if (!EscapeCommFunction(handle, dtr ? SETDTR : CLRDTR)) return PORT_ERR_IO;
+    return EscapeCommFunction(handle, rts ? SETRTS : CLRRTS) ? PORT_OK : PORT_ERR_IO;
+}
+
+static int serial_flush(struct port* port) {
+    struct serial* serial = (struct serial*)port->handle;
+    return PurgeComm(serial->handle, PURGE_RXCLEAR | PURGE_TXCLEAR) ? PORT_OK : PORT_ERR_IO;
+}
+
+static int serial_close(struct port* port) {
+    struct serial* serial = (struct serial*)port->handle;
+    int status = CloseHandle(serial->handle) ? PORT_OK : PORT_ERR_IO;
+    free(serial);
+    return status;
+}
+
+int serial_open(struct port* port, const char* path, unsigned int baud, unsigned int latency) {
+    // The VCP driver only takes its latency timer from the registry
+    (void)latency;
+    char name[16];
+    snprintf(name, sizeof(name), "\\\\.\\%s", path);
+    HANDLE handle =
+      CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (handle == INVALID_HANDLE_VALUE) return PORT_ERR_IO;
+
+    DCB dcb = { 0 };
+    dcb.DCBlength = sizeof(dcb);
+    dcb.BaudRate = baud;
+    dcb.ByteSize = 8;
+    dcb.Parity = EVENPARITY;
+    dcb.StopBits = ONESTOPBIT;
+    dcb.fBinary = TRUE;
+    dcb.fParity = TRUE;
+    if (!SetCommState(handle, &dcb)) {
+        CloseHandle(handle);
+        return PORT_ERR_IO;
+    }
+
+    struct serial* serial = (struct serial*)malloc(sizeof(struct serial));
+    serial->handle = handle;
+    serial->timeout = MAXDWORD;
+    port->handle = serial;
+    port->latency = 0;
+    port->write = serial_write;
+    port->read = serial_read;
+    port->transfer = NULL;
+    port->set_baud = serial_set_baud;
+    port->set_lines = serial_set_lines;
+    port->flush = serial_flush;
+    port->close = serial_close;
+
+    return serial_flush(port);
+}
+#elif __linux__
+// ftdi_sio recreates the tty after the kernel driver is reattached, so give udev some time to
+// create the node and apply its permissions
+#define SERIAL_OPEN_TIMEOUT 3000 // milliseconds
+#define SERIAL_OPEN_RETRY 10     // milliseconds
+
+static speed_t serial_speed(unsigned int baud) {
+    switch (baud) {
+        case 9600:
+            return B9600;
+        case 19200:
+            return B19200;
+        case 38400:
+            return B38400;
+        case 57600:
+            return B57600;
+        case 115200:
+            return B115200;
+        case 230400:
+            return B230400;
+        case 460800:
+            return B460800;
+        case 500000:
+            return B500000;
+        case 921600:
+            return B921600;
+        case 1000000:
+            return B1000000;
+        case 1500000:
+            return B1500000;
+        case 2000000:
+            return B2000000;
+        case 3000000:
+            return B3000000;
+        default:
+            return B0;
+    }
+}
+
+struct serial {
+    int fd;
+    struct serial_latency latency;
+};
+
+int serial_set_latency(
+  int fd, const char* path, unsigned int latency, struct serial_latency* saved) {
+    char real[PATH_MAX];
+    int status = PORT_ERR_IO;
+    saved->timer_path[0] = '\0';
+    saved->flags = -1;
+
+    // ftdi_sio exposes the chip's latency timer, writable by root only
+    if (realpath(path, real)) {
+        snprintf(
+          saved->timer_path,
+          sizeof(saved->timer_path),
+          "/sys/class/tty/%s/device/latency_timer",
+          basename(real));
+        FILE* file = fopen(saved->timer_path, "r+");
+        if (file && fscanf(file, "%d", &saved->timer) == 1 && fseek(file, 0, SEEK_SET) == 0 &&
+            fprintf(file, "%u", latency) > 0 && fclose(file) == 0) {
+            status = PORT_OK;
+        } else {
+            if (file) fclose(file);
+            saved->timer_path[0] = '\0';
+        }
+    }
+
+    // Also open to the dialout group, ftdi_sio drops the timer to 1 ms for low latency ports
+    struct serial_struct info;
+    if (ioctl(fd, TIOCGSERIAL, &info) == 0) {
+        int flags = info.flags;
+        info.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(fd, TIOCSSERIAL, &info) == 0) {
+            saved->flags = flags;
+            status = PORT_OK;
+        }
+    }
+
+    return status;
+}
+
+void serial_restore_latency(int fd, const struct serial_latency* saved) {
+    struct serial_struct info;
+    if (saved->flags >= 0 && ioctl(fd, TIOCGSERIAL, &info) == 0) {
+        info.flags = saved->flags;
+        ioctl(fd, TIOCSSERIAL, &info);
+    }
+    if (saved->timer_path[0]) {
+        FILE* file = fopen(saved->timer_path, "w");
+        if (file) {
+            fprintf(file, "%d", saved->timer);
+            fclose(file);
+        }
+    }
+}
+
+static int serial_write(struct port* port, const unsigned char* data, size_t size) {
+    int fd = ((struct serial*)port->handle)->fd;
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return PORT_ERR_IO;
+        }
+        data += written;
+        size -= written;
+    }
+    return tcdrain(fd) == 0 ? PORT_OK : PORT_ERR_IO;
+}
+
+static int serial_read(struct port* port, unsigned char* data, size_t size, unsigned int timeout) {
+    int fd = ((struct serial*)port->handle)->fd;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    // timeout covers the whole read, however the bytes trickle in
+    uint64_t deadline = timestamp_us() + timeout * 1000ULL;
+    while (size > 0) {
+        uint64_t now = timestamp_us();
+        // Past the deadline, bytes already received are still taken
+        int ready = poll(&pfd, 1, now < deadline ? (int)((deadline - now + 999) / 1000) : 0);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) return PORT_ERR_IO;
+        if (ready == 0) return PORT_ERR_TIMEOUT;
+        ssize_t received = read(fd, data, size);
+        if (received < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (received <= 0) return PORT_ERR_IO;
+        data += received;
+        size -= received;
+    }
+    return PORT_OK;
+}
+
+static int serial_set_baud(struct port* port, unsigned int baud) {
+    int fd = ((struct serial*)port->handle)->fd;
+    speed_t speed = serial_speed(baud);
+    struct termios tty;
+    if (speed == B0 || tcgetattr(fd, &tty) != 0) return PORT_ERR_IO;
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+    return tcsetattr(fd, TCSADRAIN, &tty) == 0 ? PORT_OK : PORT_ERR_IO;
+}
+
+static int serial_set_lines(struct port* port, int dtr, int rts) {
+    // One TIOCMSET, so ftdi_sio changes both lines with a single control request
+    int fd = ((struct serial*)port->handle)->fd;
+    int lines;
+    if (ioctl(fd, TIOCMGET, &lines) != 0) return PORT_ERR_IO;
+    lines = (lines & ~(TIOCM_DTR | TIOCM_RTS)) | (dtr ? TIOCM_DTR : 0) | (rts ? TIOCM_RTS : 0);
+    return ioctl(fd, TIOCMSET, &lines) == 0 ? PORT_OK : PORT_ERR_IO;
+}
+
+static int serial_flush(struct port* port) {
+    return tcflush(((struct serial*)port->handle)->fd, TCIOFLUSH) == 0 ? PORT_OK : PORT_ERR_IO;
+}
+
+static int serial_close(struct port* port) {
+    struct serial* serial = (struct serial*)port->handle;
+    serial_restore_latency(serial->fd, &serial->latency);
+    int status = close(serial->fd) == 0 ? PORT_OK : PORT_ERR_IO;
+    free(serial);
+    return status;
+}
+
+int serial_open_fd(const char* path, unsigned int baud, int* fd) {
+    speed_t speed = serial_speed(baud);
+    if (speed == B0) return PORT_ERR_IO;
+
+    *fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (*fd < 0) return errno == ENOENT || errno == EACCES ? PORT_ERR_TIMEOUT : PORT_ERR_IO;
+
+    struct termios tty;
+    if (tcgetattr(*fd, &tty) != 0) {
+        close(*fd);
+        return PORT_ERR_IO;
+    }
+    cfmakeraw(&tty);
+    tty.c_cflag &= ~(CSTOPB | CRTSCTS | PARODD);
+    tty.c_cflag |= CS8 | PARENB | CLOCAL | CREAD;
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY | INPCK);
+    tty.c_cc[VMIN] = 0;
+    tty.c_cc[VTIME] = 0;
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+    if (tcsetattr(*fd, TCSANOW, &tty) != 0 || tcflush(*fd, TCIOFLUSH) != 0) {
+        close(*fd);
+        return PORT_ERR_IO;
+    }
+
+    return PORT_OK;
+}
+
+int serial_open(struct port* port, const char* path, unsigned int baud, unsigned int latency) {
+    int fd;
+    int status = serial_open_fd(path, baud, &fd);
+    for (int waited = 0; status == PORT_ERR_TIMEOUT && waited < SERIAL_OPEN_TIMEOUT;
+         waited += SERIAL_OPEN_RETRY) {
+        usleep(SERIAL_OPEN_RETRY * 1000);
+        status = serial_open_fd(path, baud, &fd);
+    }
+    if (status != PORT_OK) return PORT_ERR_IO;
+
+    struct serial* serial = (struct serial*)malloc(sizeof(struct serial));
+    serial->fd = fd;
+    serial->latency.timer_path[0] = '\0';
+    serial->latency.flags = -1;
+    // Failing to shorten the latency timer only costs speed
+    port->latency =
+      latency && serial_set_latency(fd, path, latency, &serial->latency) == PORT_OK ? latency : 0;
+    port->handle = serial;
+    port->write = serial_write;
+    port->read = serial_read;
+    port->transfer = NULL;
+    port->set_baud = serial_set_baud;
+    port->set_lines = serial_set_lines;
+    port->flush = serial_flush;
+    port->close = serial_close;
+
+    return PORT_OK;
+}
+#endif
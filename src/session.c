@@ -0,0 +1,681 @@
+#include "session.h"
+
+#include "cache.h"
+#include "timestamp.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <libudev.h>
+#include <libusb.h>
+#include <limits.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// FT232R write logic:
+//
+// CBUS bits
+// 3210 3210
+// xxxx xxxx
+// |    |------ Output state:  0 -> low,   1 -> high
+// |----------- Pin direction: 0 -> input, 1 -> output
+//
+// Configuration:
+// CBUS0 -> unused
+// CBUS1 -> unused
+// CBUS2 -> BOOT0
+// CBUS3 -> RESET
+
+// NRST is held low this long, BOOT0 changes at the same time and settles well within it. The
+// target's own start-up after the release is waited for by polling it with sync bytes.
+#define RESET_PULSE CBUS_MIN_RESET_PULSE // microseconds
+
+#ifdef _WIN32
+#define BITMODE_CBUS 0x20
+#define FTDI_WRITE_TIMEOUT 1000 // milliseconds
+#define FT232_ID 0x04036001     // VID << 16 | PID
+
+static int dev_open(struct session* session) {
+    if (session->adapter && session->adapter->serial[0])
+        return FT_OpenEx(
+          (PVOID)session->adapter->serial, FT_OPEN_BY_SERIAL_NUMBER, &session->ftdi);
+    return FT_Open(0, &session->ftdi);
+}
+
+static int dev_close(struct session* session) {
+    return FT_Close(session->ftdi);
+}
+
+static int dev_get_latency(struct session* session, unsigned char* latency) {
+    return FT_GetLatencyTimer(session->ftdi, latency);
+}
+
+static int dev_set_latency(struct session* session, unsigned char latency) {
+    return FT_SetLatencyTimer(session->ftdi, latency);
+}
+
+static int dev_write(struct session* session, unsigned char data) {
+    return FT_SetBitMode(session->ftdi, data, BITMODE_CBUS);
+}
+
+static int dev_set_lines(struct session* session, int dtr, int rts) {
+    // D2XX has no call for both lines, so they change one after the other
+    FT_HANDLE ftdi = session->ftdi;
+    int status = dtr ? FT_SetDtr(ftdi) : FT_ClrDtr(ftdi);
+    if (status == FT_OK) status = rts ? FT_SetRts(ftdi) : FT_ClrRts(ftdi);
+    return status;
+}
+
+// Bootloader traffic through the D2XX handle used for CBUS control
+
+static int ftdi_port_write(struct port* port, const unsigned char* data, size_t size) {
+    struct session* session = (struct session*)port->handle;
+    DWORD written;
+    if (FT_Write(session->ftdi, (LPVOID)data, (DWORD)size, &written) != FT_OK) return PORT_ERR_IO;
+    return written == size ? PORT_OK : PORT_ERR_TIMEOUT;
+}
+
+static int ftdi_port_read(
+  struct port* port, unsigned char* data, size_t size, unsigned int timeout) {
+    struct session* session = (struct session*)port->handle;
+    DWORD received;
+    if (FT_SetTimeouts(session->ftdi, timeout, FTDI_WRITE_TIMEOUT) != FT_OK) return PORT_ERR_IO;
+    if (FT_Read(session->ftdi, data, (DWORD)size, &received) != FT_OK) return PORT_ERR_IO;
+    return received == size ? PORT_OK : PORT_ERR_TIMEOUT;
+}
+
+static int ftdi_port_set_baud(struct port* port, unsigned int baud) {
+    struct session* session = (struct session*)port->handle;
+    return FT_SetBaudRate(session->ftdi, baud) == FT_OK ? PORT_OK : PORT_ERR_IO;
+}
+
+static int ftdi_port_set_lines(struct port* port, int dtr, int rts) {
+    return dev_set_lines((struct session*)port->handle, dtr, rts) == FT_OK ? PORT_OK : PORT_ERR_IO;
+}
+
+static int ftdi_port_flush(struct port* port) {
+    struct session* session = (struct session*)port->handle;
+    return FT_Purge(session->ftdi, FT_PURGE_RX | FT_PURGE_TX) == FT_OK ? PORT_OK : PORT_ERR_IO;
+}
+
+static int ftdi_port_close(struct port* port) {
+    // The device stays open for reset control
+    return PORT_OK;
+}
+
+int session_port_open(struct session* session, struct port* port, unsigned int baud) {
+    FT_HANDLE ftdi = session->ftdi;
+    int status = FT_SetBaudRate(ftdi, baud);
+    if (status == FT_OK)
+        status = FT_SetDataCharacteristics(ftdi, FT_BITS_8, FT_STOP_BITS_1, FT_PARITY_EVEN);
+    if (status == FT_OK) status = FT_SetFlowControl(ftdi, FT_FLOW_NONE, 0, 0);
+    if (status == FT_OK) status = FT_Purge(ftdi, FT_PURGE_RX | FT_PURGE_TX);
+    if (status != FT_OK) return PORT_ERR_IO;
+
+    port->handle = session;
+    port->latency = session->saved_latency ? session->latency : 0;
+    port->write = ftdi_port_write;
+    port->read = ftdi_port_read;
+    port->transfer = NULL;
+    port->set_baud = ftdi_port_set_baud;
+    port->set_lines = ftdi_port_set_lines;
+    port->flush = ftdi_port_flush;
+    port->close = ftdi_port_close;
+
+    return PORT_OK;
+}
+#elif __linux__
+#define FT232_VID 0x0403
+#define FT232_PID 0x6001
+#define FTDI_POLL_INTERVAL 1000 // microseconds
+
+static int dev_open(struct session* session) {
+    const struct adapter* adapter = session->adapter;
+    if (adapter && adapter->serial[0])
+        return ftdi_usb_open_desc(session->ftdi, FT232_VID, FT232_PID, NULL, adapter->serial);
+    if (adapter && adapter->bus)
+        return ftdi_usb_open_bus_addr(session->ftdi, adapter->bus, adapter->addr);
+    return ftdi_usb_open(session->ftdi, FT232_VID, FT232_PID);
+}
+
+static int dev_close(struct session* session) {
+    return ftdi_usb_close(session->ftdi);
+}
+
+static int dev_get_latency(struct session* session, unsigned char* latency) {
+    return ftdi_get_latency_timer(session->ftdi, latency);
+}
+
+static int dev_set_latency(struct session* session, unsigned char latency) {
+    return ftdi_set_latency_timer(session->ftdi, latency);
+}
+
+static int dev_write(struct session* session, unsigned char data) {
+    return ftdi_set_bitmode(session->ftdi, data, BITMODE_CBUS);
+}
+
+static int dev_set_lines(struct session* session, int dtr, int rts) {
+    // Both lines in one control request
+    return ftdi_setdtr_rts(session->ftdi, dtr, rts);
+}
+
+// Bootloader traffic through the libftdi context used for CBUS control
+
+static int ftdi_port_write(struct port* port, const unsigned char* data, size_t size) {
+    struct session* session = (struct session*)port->handle;
+    return ftdi_write_data(session->ftdi, data, size) == (int)size ? PORT_OK : PORT_ERR_IO;
+}
+
+static int ftdi_port_read(
+  struct port* port, unsigned char* data, size_t size, unsigned int timeout) {
+    struct session* session = (struct session*)port->handle;
+    uint64_t deadline = timestamp_us() + timeout * 1000ULL;
+    while (size > 0) {
+        // Returns once the chip reports in, at the latest after one latency timer period
+        int received = ftdi_read_data(session->ftdi, data, size);
+        if (received < 0) return PORT_ERR_IO;
+        data += received;
+        size -= received;
+        if (size > 0 && timestamp_us() > deadline) return PORT_ERR_TIMEOUT;
+    }
+    return PORT_OK;
+}
+
+static int ftdi_port_wait(struct ftdi_transfer_control* transfer, unsigned int timeout) {
+    // ftdi_transfer_data_done() keeps resubmitting reads until they are satisfied, so bound the
+    // wait here and cancel the transfer if the target never answers
+    uint64_t deadline = timestamp_us() + timeout * 1000ULL;
+    struct timeval interval = { 0, FTDI_POLL_INTERVAL };
+    struct libusb_context* usb = transfer->ftdi->usb_ctx;
+    while (!transfer->completed && timestamp_us() < deadline) {
+        if (libusb_handle_events_timeout_completed(usb, &interval, &transfer->completed) < 0)
+            break;
+    }
+    if (!transfer->completed) {
+        ftdi_transfer_data_cancel(transfer, NULL);
+        return PORT_ERR_TIMEOUT;
+    }
+    int size = transfer->size;
+    return ftdi_transfer_data_done(transfer) == size ? PORT_OK : PORT_ERR_IO;
+}
+
+static int ftdi_port_transfer(
+  struct port* port,
+  const unsigned char* request,
+  size_t request_size,
+  unsigned char* reply,
+  size_t reply_size,
+  unsigned int timeout) {
+    struct ftdi_context* ftdi = ((struct session*)port->handle)->ftdi;
+    // Queue the bulk-in read before sending the request so the reply is collected by a transfer
+    // that is already pending, rather than by a new poll once the write has been reaped
+    struct ftdi_transfer_control* read = ftdi_read_data_submit(ftdi, reply, reply_size);
+    if (!read) return PORT_ERR_IO;
+    struct ftdi_transfer_control* write =
+      ftdi_write_data_submit(ftdi, (unsigned char*)request, request_size);
+    if (!write || ftdi_transfer_data_done(write) != (int)request_size) {
+        ftdi_transfer_data_cancel(read, NULL);
+        return PORT_ERR_IO;
+    }
+    return ftdi_port_wait(read, timeout);
+}
+
+static int ftdi_port_set_baud(struct port* port, unsigned int baud) {
+    struct session* session = (struct session*)port->handle;
+    return ftdi_set_baudrate(session->ftdi, baud) == 0 ? PORT_OK : PORT_ERR_IO;
+}
+
+static int ftdi_port_set_lines(struct port* port, int dtr, int rts) {
+    return dev_set_lines((struct session*)port->handle, dtr, rts) == FT_OK ? PORT_OK : PORT_ERR_IO;
+}
+
+static int ftdi_port_flush(struct port* port) {
+    struct session* session = (struct session*)port->handle;
+    return ftdi_usb_purge_buffers(session->ftdi) == 0 ? PORT_OK : PORT_ERR_IO;
+}
+
+static int ftdi_port_close(struct port* port) {
+    // The device stays open for reset control
+    return PORT_OK;
+}
+
+int session_port_open(struct session* session, struct port* port, unsigned int baud) {
+    struct ftdi_context* ftdi = session->ftdi;
+    int status = ftdi_set_baudrate(ftdi, baud);
+    if (status == FT_OK) status = ftdi_set_line_property(ftdi, BITS_8, STOP_BIT_1, EVEN);
+    if (status == FT_OK) status = ftdi_setflowctrl(ftdi, SIO_DISABLE_FLOW_CTRL);
+    if (status == FT_OK) status = ftdi_usb_purge_buffers(ftdi);
+    if (status != FT_OK) return PORT_ERR_IO;
+
+    port->handle = session;
+    port->latency = session->saved_latency ? session->latency : 0;
+    port->write = ftdi_port_write;
+    port->read = ftdi_port_read;
+    port->transfer = ftdi_port_transfer;
+    port->set_baud = ftdi_port_set_baud;
+    port->set_lines = ftdi_port_set_lines;
+    port->flush = ftdi_port_flush;
+    port->close = ftdi_port_close;
+
+    return PORT_OK;
+}
+#else
+#error OS not supported
+#endif
+
+const struct gpio_backend gpio_ftdi = {
+    .name = "ftdi",
+    .open = dev_open,
+    .close = dev_close,
+    .get_latency = dev_get_latency,
+    .set_latency = dev_set_latency,
+    .write = dev_write,
+};
+
+// DTR/RTS wiring: DTR asserted pulls NRST low, RTS asserted drives BOOT0 high. The lines are
+// driven through session->lines when it is set, otherwise through the FTDI handle.
+
+static int dtr_open(struct session* session) {
+    return session->lines ? FT_OK : dev_open(session);
+}
+
+static int dtr_close(struct session* session) {
+    return session->lines ? FT_OK : dev_close(session);
+}
+
+static int dtr_get_latency(struct session* session, unsigned char* latency) {
+    // The port sets its own latency timer
+    *latency = 0;
+    return session->lines ? FT_OK : dev_get_latency(session, latency);
+}
+
+static int dtr_set_latency(struct session* session, unsigned char latency) {
+    return session->lines ? FT_OK : dev_set_latency(session, latency);
+}
+
+static int dtr_write(struct session* session, unsigned char value) {
+    int dtr = !cbus_level(value, CBUS_NRST);
+    int rts = cbus_level(value, CBUS_BOOT0);
+    if (!session->lines) return dev_set_lines(session, dtr, rts);
+    return port_set_lines(session->lines, dtr, rts) == PORT_OK ? FT_OK : FT_DEVICE_NOT_FOUND;
+}
+
+const struct gpio_backend gpio_dtr = {
+    .name = "dtr",
+    .open = dtr_open,
+    .close = dtr_close,
+    .get_latency = dtr_get_latency,
+    .set_latency = dtr_set_latency,
+    .write = dtr_write,
+};
+
+int session_init(struct session* session, const struct adapter* adapter) {
+    memset(session, 0, sizeof(struct session));
+    session->adapter = adapter;
+    session->gpio = &gpio_ftdi;
+#ifdef __linux__
+    session->ftdi = ftdi_new();
+    if (!session->ftdi) return FT_DEVICE_NOT_FOUND;
+    session->ftdi->module_detach_mode = AUTO_DETACH_REATACH_SIO_MODULE;
+#endif
+    return FT_OK;
+}
+
+void session_deinit(struct session* session) {
+    if (session->open) session_release(session);
+#ifdef __linux__
+    ftdi_free(session->ftdi);
+    session->ftdi = NULL;
+#endif
+}
+
+int session_acquire(struct session* session, const char* phase) {
+    if (session->phase_count < SESSION_MAX_PHASES) {
+        struct session_phase* entry = &session->phases[session->phase_count++];
+        entry->name = phase;
+        entry->reused = session->open;
+    }
+    if (session->open) return FT_OK;
+
+    uint64_t start = timestamp_us();
+    int status = session->gpio->open(session);
+    session->open_time += timestamp_us() - start;
+    if (status == FT_OK) {
+        session->open = 1;
+        session->opens++;
+        // The chip holds back short replies such as ACKs until its latency timer expires. Failing
+        // to shorten it only costs speed.
+        session->saved_latency = 0;
+        if (session->latency &&
+            session->gpio->get_latency(session, &session->saved_latency) == FT_OK &&
+            session->gpio->set_latency(session, session->latency) != FT_OK)
+            session->saved_latency = 0;
+    }
+
+    return status;
+}
+
+int session_release(struct session* session) {
+    if (!session->open) return FT_OK;
+
+    uint64_t start = timestamp_us();
+    if (session->saved_latency) session->gpio->set_latency(session, session->saved_latency);
+    int status = session->gpio->close(session);
+    session->open_time += timestamp_us() - start;
+    session->open = 0;
+
+    return status;
+}
+
+void session_report(const struct session* session, FILE* stream) {
+    // Average cost of the open/close cycles that did happen
+    double cost = session->opens ? session->open_time / 1000.0 / session->opens : 0.0;
+    unsigned int reused = 0;
+    for (unsigned int i = 0; i < session->phase_count; i++) {
+        const struct session_phase* phase = &session->phases[i];
+        if (!phase->reused) continue;
+        fprintf(stream, "%s: reused open device, saved ~%.1f ms\n", phase->name, cost);
+        reused++;
+    }
+    fprintf(
+      stream,
+      "%u USB open(s) for %u phase(s), saved ~%.1f ms of open/close overhead\n",
+      session->opens,
+      session->phase_count,
+      reused * cost);
+}
+
+// Whether an adapter with this serial number and USB path passes filter
+static int adapter_match(
+  const struct adapter_filter* filter, const char* serial, const char* usb_path) {
+    if (!filter) return 1;
+    if (filter->serial && strcmp(filter->serial, serial) != 0) return 0;
+    if (filter->usb_path && (!usb_path || strcmp(filter->usb_path, usb_path) != 0)) return 0;
+    return 1;
+}
+
+static struct adapter* adapter_add(struct adapter** adapters, int count, size_t* capacity) {
+    if ((size_t)count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 4;
+        *adapters = (struct adapter*)realloc(*adapters, *capacity * sizeof(struct adapter));
+    }
+    struct adapter* adapter = &(*adapters)[count];
+    memset(adapter, 0, sizeof(struct adapter));
+    return adapter;
+}
+
+#ifdef __linux__
+// usb-serial ports, each a link into the USB device tree: <usb device>/<interface>/ttyUSBn
+#define USB_SERIAL_DEVICES "/sys/bus/usb-serial/devices"
+// Adapter serial number -> ttyUSB name it was last found on
+#define TTY_CACHE "tty"
+
+// Reads the first line of a sysfs attribute, empty if it cannot be read
+static void sysfs_read(const char* dir, const char* name, char* value, size_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    value[0] = '\0';
+    FILE* file = fopen(path, "r");
+    if (!file) return;
+    if (!fgets(value, (int)size, file)) value[0] = '\0';
+    value[strcspn(value, "\n")] = '\0';
+    fclose(file);
+}
+
+// Fills adapter from the usb-serial port tty, returns 0 if it is an FT232R passing filter
+static int sysfs_adapter(
+  const char* tty, const struct adapter_filter* filter, struct adapter* adapter) {
+    char path[PATH_MAX];
+    char usb[PATH_MAX];
+    char value[ADAPTER_SERIAL_LENGTH];
+    snprintf(path, sizeof(path), USB_SERIAL_DEVICES "/%s", tty);
+    if (!realpath(path, usb)) return -1;
+    // Strip the port and the interface to get to the USB device
+    for (int i = 0; i < 2; i++) {
+        char* slash = strrchr(usb, '/');
+        if (!slash || slash == usb) return -1;
+        *slash = '\0';
+    }
+    sysfs_read(usb, "idVendor", value, sizeof(value));
+    if (strtol(value, NULL, 16) != FT232_VID) return -1;
+    sysfs_read(usb, "idProduct", value, sizeof(value));
+    if (strtol(value, NULL, 16) != FT232_PID) return -1;
+
+    memset(adapter, 0, sizeof(struct adapter));
+    sysfs_read(usb, "serial", adapter->serial, sizeof(adapter->serial));
+    strncpy(adapter->usb_path, strrchr(usb, '/') + 1, ADAPTER_USB_PATH_LENGTH - 1);
+    if (!adapter_match(filter, adapter->serial, adapter->usb_path)) return -1;
+    snprintf(adapter->port, ADAPTER_PORT_LENGTH, "/dev/%s", tty);
+    sysfs_read(usb, "busnum", value, sizeof(value));
+    adapter->bus = (uint8_t)atoi(value);
+    sysfs_read(usb, "devnum", value, sizeof(value));
+    adapter->addr = (uint8_t)atoi(value);
+
+    return 0;
+}
+
+static int sysattr_int(struct udev_device* dev, const char* name) {
+    const char* value = udev_device_get_sysattr_value(dev, name);
+    return value ? atoi(value) : 0;
+}
+
+int udev_adapter(
+  struct udev_device* dev, const struct adapter_filter* filter, struct adapter* adapter) {
+    const char* path = udev_device_get_devnode(dev);
+    struct udev_device* usb = NULL;
+    if (path && strstr(path, "USB"))
+        usb = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device");
+    if (!usb) return -1;
+    const char* vid = udev_device_get_sysattr_value(usb, "idVendor");
+    const char* pid = udev_device_get_sysattr_value(usb, "idProduct");
+    if (!vid || !pid || strtol(vid, NULL, 16) != FT232_VID || strtol(pid, NULL, 16) != FT232_PID)
+        return -1;
+    const char* serial = udev_device_get_sysattr_value(usb, "serial");
+    const char* usb_path = udev_device_get_sysname(usb);
+    if (!serial) serial = "";
+    if (!adapter_match(filter, serial, usb_path)) return -1;
+
+    memset(adapter, 0, sizeof(struct adapter));
+    strncpy(adapter->serial, serial, ADAPTER_SERIAL_LENGTH - 1);
+    strncpy(adapter->port, path, ADAPTER_PORT_LENGTH - 1);
+    if (usb_path) strncpy(adapter->usb_path, usb_path, ADAPTER_USB_PATH_LENGTH - 1);
+    adapter->bus = (uint8_t)sysattr_int(usb, "busnum");
+    adapter->addr = (uint8_t)sysattr_int(usb, "devnum");
+
+    return 0;
+}
+
+// Without the usb-serial bus in sysfs, asks udev for the ttys of FTDI devices instead
+static int find_devices_udev(struct adapter** adapters, const struct adapter_filter* filter) {
+    int count = 0;
+    size_t capacity = 0;
+    struct adapter adapter;
+    struct udev* udev;
+    struct udev_enumerate* enumerate;
+    struct udev_list_entry *devices, *dev_list_entry;
+
+    udev = udev_new();
+    if (!udev) return -1;
+    enumerate = udev_enumerate_new(udev);
+    udev_enumerate_add_match_subsystem(enumerate, "tty");
+    // Leaves out every tty that is not on an FTDI chip, property matches are ORed so the product
+    // is checked by udev_adapter()
+    udev_enumerate_add_match_property(enumerate, "ID_VENDOR_ID", "0403");
+    udev_enumerate_scan_devices(enumerate);
+    devices = udev_enumerate_get_list_entry(enumerate);
+    udev_list_entry_foreach(dev_list_entry, devices) {
+        const char* path = udev_list_entry_get_name(dev_list_entry);
+        struct udev_device* dev = udev_device_new_from_syspath(udev, path);
+        if (dev && udev_adapter(dev, filter, &adapter) == 0)
+            *adapter_add(adapters, count++, &capacity) = adapter;
+        // The USB parent is owned by its child
+        udev_device_unref(dev);
+    }
+    udev_enumerate_unref(enumerate);
+    udev_unref(udev);
+
+    return count;
+}
+#endif
+
+int find_devices(struct adapter** adapters, const struct adapter_filter* filter) {
+    int count = 0;
+    size_t capacity = 0;
+    *adapters = NULL;
+#ifdef _WIN32
+    DWORD nodes;
+    if (FT_CreateDeviceInfoList(&nodes) != FT_OK) return -1;
+    if (nodes == 0) return 0;
+    FT_DEVICE_LIST_INFO_NODE* info =
+      (FT_DEVICE_LIST_INFO_NODE*)malloc(nodes * sizeof(FT_DEVICE_LIST_INFO_NODE));
+    if (FT_GetDeviceInfoList(info, &nodes) != FT_OK) {
+        free(info);
+        return -1;
+    }
+    for (DWORD i = 0; i < nodes; i++) {
+        // D2XX does not report the USB path
+        if (info[i].ID != FT232_ID || !adapter_match(filter, info[i].SerialNumber, NULL))
+            continue;
+        // The COM port number can only be queried once the device is open
+        struct adapter* adapter = adapter_add(adapters, count++, &capacity);
+        strncpy(adapter->serial, info[i].SerialNumber, ADAPTER_SERIAL_LENGTH - 1);
+    }
+    free(info);
+#elif __linux__
+    struct adapter adapter;
+    char tty[CACHE_VALUE_LENGTH];
+
+    // An adapter picked by serial number is most likely still on the tty it was last found on.
+    // The entry is checked against sysfs, so one left stale by a replug only costs the scan.
+    if (filter && filter->serial &&
+        cache_get(TTY_CACHE, filter->serial, tty, sizeof(tty)) == CACHE_OK &&
+        sysfs_adapter(tty, filter, &adapter) == 0) {
+        *adapter_add(adapters, count++, &capacity) = adapter;
+        return count;
+    }
+
+    // Only the USB serial ports, rather than every tty on the host
+    DIR* dir = opendir(USB_SERIAL_DEVICES);
+    if (!dir) return find_devices_udev(adapters, filter);
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.' || sysfs_adapter(entry->d_name, filter, &adapter) != 0)
+            continue;
+        *adapter_add(adapters, count++, &capacity) = adapter;
+    }
+    closedir(dir);
+    if (filter && filter->serial && count > 0)
+        cache_put(TTY_CACHE, filter->serial, strrchr((*adapters)[0].port, '/') + 1);
+#endif
+    return count;
+}
+
+int find_device(struct session* session, char** loc) {
+    int status;
+#ifdef _WIN32
+#define COM_PORT_MAX_LENGTH 7 // COMXYZ + null terminator
+    status = session_acquire(session, "find");
+    if (status != FT_OK) return status;
+    LONG port;
+    status = FT_GetComPortNumber(session->ftdi, &port);
+    if (status == FT_OK && port == -1) status = FT_DEVICE_NOT_FOUND;
+    if (status == FT_OK) *loc = (char*)malloc(COM_PORT_MAX_LENGTH * sizeof(char));
+    if (status == FT_OK) snprintf(*loc, COM_PORT_MAX_LENGTH, "COM%d", (int)port);
+    // The device stays open for the reset sequence
+    if (status != FT_OK) session_release(session);
+#elif __linux__
+    status = FT_DEVICE_NOT_FOUND;
+    if (session->adapter) {
+        if (session->adapter->port[0]) {
+            *loc = (char*)malloc((strlen(session->adapter->port) + 1) * sizeof(char));
+            strcpy(*loc, session->adapter->port);
+            status = FT_OK;
+        }
+    } else {
+        struct adapter* adapters;
+        int count = find_devices(&adapters, NULL);
+        if (count > 0) {
+            *loc = (char*)malloc((strlen(adapters[0].port) + 1) * sizeof(char));
+            strcpy(*loc, adapters[0].port);
+            status = FT_OK;
+        }
+        free(adapters);
+    }
+#endif
+    return status;
+}
+
+int find_tty(const struct adapter* adapter, char** loc) {
+#ifdef __linux__
+    struct adapter_filter filter = {
+        .serial = adapter->serial[0] ? adapter->serial : NULL,
+        .usb_path = adapter->usb_path[0] ? adapter->usb_path : NULL,
+    };
+    // Nothing to tell it apart by, the enumerated tty is the best guess
+    if (!filter.serial && !filter.usb_path) return FT_OK;
+    struct adapter* adapters;
+    int count = find_devices(&adapters, &filter);
+    if (count <= 0) {
+        free(adapters);
+        return FT_DEVICE_NOT_FOUND;
+    }
+    free(*loc);
+    *loc = (char*)malloc((strlen(adapters[0].port) + 1) * sizeof(char));
+    strcpy(*loc, adapters[0].port);
+    free(adapters);
+#endif
+    return FT_OK;
+}
+
+const struct cbus_step bootloader_sequence[BOOTLOADER_SEQUENCE_STEPS] = {
+    // BOOT0: 1
+    // RESET: 0
+    { 0xC7, RESET_PULSE },
+    // BOOT0: 1
+    // RESET: 1
+    { 0x4F, 0 },
+};
+
+const struct cbus_step application_sequence[APPLICATION_SEQUENCE_STEPS] = {
+    // BOOT0: 0
+    // RESET: 0
+    { 0xC3, RESET_PULSE },
+    // BOOT0: 0
+    // RESET: 1
+    { 0x4B, 0 },
+    // BOOT0 -> INPUT
+    // RESET -> INPUT
+    { 0x0F, 0 },
+};
+
+int session_write(struct session* session, unsigned char value) {
+    return session->gpio->write(session, value);
+}
+
+static int run_sequence(struct session* session, const struct cbus_step* steps, size_t count) {
+    int status = FT_OK;
+    for (size_t i = 0; status == FT_OK && i < count; i++) {
+        status = session->gpio->write(session, steps[i].value);
+        if (steps[i].delay) usleep(steps[i].delay);
+    }
+
+    return status;
+}
+
+int enter_bootloader(struct session* session) {
+    int status = session_acquire(session, "enter");
+    if (status == FT_OK)
+        status = run_sequence(session, bootloader_sequence, BOOTLOADER_SEQUENCE_STEPS);
+
+    return status;
+}
+
+int exit_bootloader(struct session* session) {
+    int status = session_acquire(session, "exit");
+    if (status == FT_OK)
+        status = run_sequence(session, application_sequence, APPLICATION_SEQUENCE_STEPS);
+
+    return status;
+}
@@ -0,0 +1,766 @@
+// Simulated STM32 system bootloader (AN3155) behind a pseudo-terminal, so the flash tool can be
+// exercised and timed without a board: stm32sim /tmp/ttySIM & flash -p /tmp/ttySIM image.bin
+//
+// Flash is an in-memory model of a part from the device table, erased to 0xFF and programmed by
+// clearing bits. Erase and program times come from the table and -w, wire time from the line rate
+// the host sets on the pty, 11 bits per byte for 8E1. Like the real bootloader, the rate is locked
+// by the first sync byte and bytes arriving at another rate are garbled. Each time the host closes
+// the pty counts as a reset back into the bootloader.
+
+#define _GNU_SOURCE
+
+#include "crc.h"
+#include "device.h"
+#include "stm32.h"
+#include "timestamp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define SIM_VERSION 0x31
+#define SIM_PID 0x410
+#define SIM_RAM_BASE 0x20000000
+#define SIM_RAM_SIZE (64 * 1024)
+#define SIM_PROGRAM_TIME 50 // microseconds per 32-bit word
+#define SIM_BITS_PER_BYTE 11 // start, 8 data, parity, stop
+// Chance of a byte being garbled when the line runs faster than -m allows
+#define SIM_NOISE_RATE 0.01
+#define SIM_HANGUP_POLL 1 // milliseconds
+// FT232R USB packet payload, sent at once when full, otherwise when the latency timer expires
+#define SIM_USB_PAYLOAD 62
+
+#define SIM_OK 0
+// The host closed the pty
+#define SIM_HANGUP 1
+#define SIM_ERR_IO 2
+
+#define SIM_MEMORY_FLASH 0
+#define SIM_MEMORY_RAM 1
+// Unique ID, read only
+#define SIM_MEMORY_ROM 2
+
+struct sim_options {
+    uint16_t pid;
+    const char* load_path;
+    const char* dump_path;
+    unsigned char uid[DEVICE_UID_LENGTH];
+    int legacy_erase;
+    int checksum;
+    // Multiplies every modeled delay, 0 for none
+    double time_scale;
+    // Latency timer of the modeled adapter, 0 for a direct UART
+    unsigned int latency; // milliseconds
+    unsigned int program_time; // microseconds per 32-bit word
+    // Start-up time of the bootloader, counted from the host opening the pty
+    unsigned int boot_time; // milliseconds
+    // Highest rate the link carries cleanly, 0 for any
+    unsigned int max_baud;
+    // Fault injection: chance of NACKing a frame / dropping a reply byte
+    double nack_rate;
+    double drop_rate;
+    unsigned int seed;
+    int verbose;
+};
+
+struct sim_stats {
+    unsigned long commands;
+    unsigned long nacks;
+    unsigned long dropped;
+    unsigned long garbled;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+};
+
+struct sim {
+    const struct sim_options* options;
+    const struct device* device;
+    int master;
+    unsigned char* flash;
+    uint32_t flash_size;
+    unsigned char ram[SIM_RAM_SIZE];
+    unsigned char uid[DEVICE_UID_LENGTH];
+    unsigned char commands[16];
+    size_t command_count;
+    // Rate locked by the sync byte, 0 before sync
+    unsigned int baud;
+    // Set once Go has handed over to the application
+    int running;
+    // When the host opened the pty, 0 while it is closed
+    uint64_t opened;
+    // Received bytes whose wire time has not been waited for yet
+    size_t unpaced;
+    uint32_t random;
+    struct sim_stats stats;
+};
+
+// xorshift32, so fault injection repeats with the same -s
+static double sim_random(struct sim* sim) {
+    uint32_t x = sim->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sim->random = x;
+    return x / 4294967296.0;
+}
+
+static void sim_delay(const struct sim* sim, uint64_t us) {
+    us = (uint64_t)(us * sim->options->time_scale);
+    if (us) usleep(us);
+}
+
+static unsigned int sim_line_baud(const struct sim* sim) {
+    struct termios tty;
+    // On the master side this reads the settings the host made on the slave
+    if (tcgetattr(sim->master, &tty) != 0) return 0;
+    switch (cfgetospeed(&tty)) {
+        case B9600:
+            return 9600;
+        case B19200:
+            return 19200;
+        case B38400:
+            return 38400;
+        case B57600:
+            return 57600;
+        case B115200:
+            return 115200;
+        case B230400:
+            return 230400;
+        case B460800:
+            return 460800;
+        case B500000:
+            return 500000;
+        case B921600:
+            return 921600;
+        case B1000000:
+            return 1000000;
+        case B1500000:
+            return 1500000;
+        case B2000000:
+            return 2000000;
+        case B3000000:
+            return 3000000;
+        default:
+            return 0;
+    }
+}
+
+static void sim_pace(struct sim* sim, size_t size) {
+    unsigned int baud = sim->baud ? sim->baud : sim_line_baud(sim);
+    if (baud) sim_delay(sim, (uint64_t)size * SIM_BITS_PER_BYTE * 1000000 / baud);
+}
+
+static int sim_receive(struct sim* sim, unsigned char* data, size_t size) {
+    struct pollfd pfd = { .fd = sim->master, .events = POLLIN };
+    size_t received = 0;
+    while (received < size) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            return SIM_ERR_IO;
+        }
+        if (pfd.revents & POLLHUP) return SIM_HANGUP;
+        ssize_t count = read(sim->master, data + received, size - received);
+        if (count < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (count < 0 && errno == EIO) return SIM_HANGUP;
+        if (count <= 0) return SIM_ERR_IO;
+        received += count;
+    }
+    sim->stats.bytes_in += size;
+    sim->unpaced += size;
+
+    // Sampled at the wrong rate, or on a line too fast for the wiring
+    unsigned int line = sim_line_baud(sim);
+    const struct sim_options* options = sim->options;
+    for (size_t i = 0; sim->baud && i < size; i++) {
+        if (line != sim->baud ||
+            (options->max_baud && line > options->max_baud && sim_random(sim) < SIM_NOISE_RATE)) {
+            data[i] ^= 0x55;
+            sim->stats.garbled++;
+        }
+    }
+
+    return SIM_OK;
+}
+
+static int sim_send(struct sim* sim, const unsigned char* data, size_t size) {
+    unsigned char kept[1 + STM32_MAX_TRANSFER + 1];
+    size_t count = 0;
+    // The reply cannot start before the request has arrived in full
+    sim_pace(sim, sim->unpaced + size);
+    sim->unpaced = 0;
+    // A reply that does not fill the adapter's last USB packet waits for its latency timer
+    if (sim->options->latency && size % SIM_USB_PAYLOAD)
+        sim_delay(sim, sim->options->latency * 1000ULL);
+    for (size_t i = 0; i < size; i++) {
+        if (sim->options->drop_rate && sim_random(sim) < sim->options->drop_rate)
+            sim->stats.dropped++;
+        else
+            kept[count++] = data[i];
+    }
+    for (size_t offset = 0; offset < count;) {
+        ssize_t written = write(sim->master, kept + offset, count - offset);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0) return SIM_ERR_IO;
+        offset += written;
+    }
+    sim->stats.bytes_out += count;
+    return SIM_OK;
+}
+
+static int sim_reply(struct sim* sim, unsigned char reply) {
+    if (reply == STM32_NACK) sim->stats.nacks++;
+    return sim_send(sim, &reply, 1);
+}
+
+static unsigned char sim_checksum(const unsigned char* data, size_t size) {
+    unsigned char checksum = 0;
+    for (size_t i = 0; i < size; i++) checksum ^= data[i];
+    return checksum;
+}
+
+// Receives size bytes after the have bytes already in frame, then their checksum, which covers
+// the whole frame. Returns SIM_OK with *valid cleared when the checksum is wrong or fault injection
+// picked the frame.
+static int sim_receive_frame(
+  struct sim* sim, unsigned char* frame, size_t have, size_t size, int* valid) {
+    unsigned char checksum;
+    int status = sim_receive(sim, frame + have, size);
+    if (status == SIM_OK) status = sim_receive(sim, &checksum, 1);
+    *valid = status == SIM_OK && sim_checksum(frame, have + size) == checksum &&
+             !(sim->options->nack_rate && sim_random(sim) < sim->options->nack_rate);
+    return status;
+}
+
+static int sim_receive_word(struct sim* sim, uint32_t* word, int* valid) {
+    unsigned char frame[4];
+    int status = sim_receive_frame(sim, frame, 0, sizeof(frame), valid);
+    *word = (uint32_t)frame[0] << 24 | frame[1] << 16 | frame[2] << 8 | frame[3];
+    return status;
+}
+
+// Memory behind size bytes at addr, NULL unless they lie within flash, SRAM or the unique ID
+static unsigned char* sim_memory(struct sim* sim, uint32_t addr, size_t size, int* kind) {
+    uint32_t base = sim->device->flash_base;
+    uint32_t uid = sim->device->uid_addr;
+    if (addr >= base && addr - base < sim->flash_size && size <= sim->flash_size - (addr - base)) {
+        *kind = SIM_MEMORY_FLASH;
+        return sim->flash + (addr - base);
+    }
+    if (addr >= SIM_RAM_BASE && addr - SIM_RAM_BASE < SIM_RAM_SIZE &&
+        size <= SIM_RAM_SIZE - (addr - SIM_RAM_BASE)) {
+        *kind = SIM_MEMORY_RAM;
+        return sim->ram + (addr - SIM_RAM_BASE);
+    }
+    if (addr >= uid && addr - uid < DEVICE_UID_LENGTH && size <= DEVICE_UID_LENGTH - (addr - uid)) {
+        *kind = SIM_MEMORY_ROM;
+        return sim->uid + (addr - uid);
+    }
+    return NULL;
+}
+
+static int sim_get(struct sim* sim) {
+    unsigned char reply[4 + sizeof(sim->commands)];
+    reply[0] = STM32_ACK;
+    reply[1] = sim->command_count;
+    reply[2] = SIM_VERSION;
+    memcpy(reply + 3, sim->commands, sim->command_count);
+    reply[3 + sim->command_count] = STM32_ACK;
+    return sim_send(sim, reply, 4 + sim->command_count);
+}
+
+static int sim_get_version(struct sim* sim) {
+    unsigned char reply[] = { STM32_ACK, SIM_VERSION, 0, 0, STM32_ACK };
+    return sim_send(sim, reply, sizeof(reply));
+}
+
+static int sim_get_id(struct sim* sim) {
+    unsigned char reply[] = { STM32_ACK, 1, sim->device->pid >> 8, sim->device->pid, STM32_ACK };
+    return sim_send(sim, reply, sizeof(reply));
+}
+
+// ACKs the command and receives the address that follows, replying to it as well
+static int sim_receive_address(struct sim* sim, uint32_t* addr, int* valid) {
+    int status = sim_reply(sim, STM32_ACK);
+    if (status == SIM_OK) status = sim_receive_word(sim, addr, valid);
+    if (status == SIM_OK) status = sim_reply(sim, *valid ? STM32_ACK : STM32_NACK);
+    return status;
+}
+
+static int sim_read_memory(struct sim* sim) {
+    unsigned char length[2];
+    uint32_t addr;
+    int valid;
+    int status = sim_receive_address(sim, &addr, &valid);
+    if (status != SIM_OK || !valid) return status;
+    status = sim_receive(sim, length, sizeof(length));
+    if (status != SIM_OK) return status;
+
+    int kind;
+    size_t size = length[0] + 1;
+    unsigned char* memory = sim_memory(sim, addr, size, &kind);
+    if ((length[0] ^ length[1]) != 0xFF || !memory) return sim_reply(sim, STM32_NACK);
+    unsigned char reply[1 + STM32_MAX_TRANSFER];
+    reply[0] = STM32_ACK;
+    memcpy(reply + 1, memory, size);
+    return sim_send(sim, reply, 1 + size);
+}
+
+static int sim_write_memory(struct sim* sim) {
+    unsigned char frame[1 + STM32_MAX_TRANSFER];
+    uint32_t addr;
+    int valid;
+    int status = sim_receive_address(sim, &addr, &valid);
+    if (status != SIM_OK || !valid) return status;
+    status = sim_receive(sim, frame, 1);
+    if (status == SIM_OK) status = sim_receive_frame(sim, frame, 1, frame[0] + 1, &valid);
+    if (status != SIM_OK) return status;
+
+    int kind;
+    size_t size = frame[0] + 1;
+    unsigned char* memory = sim_memory(sim, addr, size, &kind);
+    // Flash takes whole words only
+    if (!valid || !memory || kind == SIM_MEMORY_ROM ||
+        (kind == SIM_MEMORY_FLASH && (addr % 4 || size % 4)))
+        return sim_reply(sim, STM32_NACK);
+    if (kind == SIM_MEMORY_FLASH) {
+        // Programming can only clear bits
+        for (size_t i = 0; i < size; i++) memory[i] &= frame[1 + i];
+        sim_delay(sim, (uint64_t)size / 4 * sim->options->program_time);
+    } else {
+        memcpy(memory, frame + 1, size);
+    }
+    return sim_reply(sim, STM32_ACK);
+}
+
+static void sim_erase_page(struct sim* sim, size_t page) {
+    uint32_t offset = device_page_addr(sim->device, page) - sim->device->flash_base;
+    memset(sim->flash + offset, 0xFF, device_page_size(sim->device, page));
+    sim_delay(sim, device_page_erase_time(sim->device, page) * 1000ULL);
+}
+
+static void sim_erase_all(struct sim* sim) {
+    memset(sim->flash, 0xFF, sim->flash_size);
+    sim_delay(sim, sim->device->mass_erase_time * 1000ULL);
+}
+
+// Erase: page count minus one and single byte page numbers, or 0xFF for a global erase
+static int sim_erase(struct sim* sim) {
+    unsigned char frame[STM32_MAX_FRAME];
+    size_t count = device_page_count(sim->device);
+    int valid;
+    int status = sim_reply(sim, STM32_ACK);
+    if (status == SIM_OK) status = sim_receive(sim, frame, 1);
+    if (status != SIM_OK) return status;
+
+    if (frame[0] == 0xFF) {
+        // Complemented rather than checksummed
+        status = sim_receive(sim, frame + 1, 1);
+        if (status != SIM_OK) return status;
+        if (frame[1] != 0x00) return sim_reply(sim, STM32_NACK);
+        sim_erase_all(sim);
+        return sim_reply(sim, STM32_ACK);
+    }
+    status = sim_receive_frame(sim, frame, 1, frame[0] + 1, &valid);
+    if (status != SIM_OK) return status;
+    for (size_t i = 0; valid && i <= frame[0]; i++) valid = frame[1 + i] < count;
+    if (!valid) return sim_reply(sim, STM32_NACK);
+    for (size_t i = 0; i <= frame[0]; i++) sim_erase_page(sim, frame[1 + i]);
+    return sim_reply(sim, STM32_ACK);
+}
+
+// Extended Erase: big endian page count minus one and page numbers, or 0xFFFF / 0xFFFE / 0xFFFD
+// for a mass / bank 1 / bank 2 erase, all treated as a mass erase here
+static int sim_extended_erase(struct sim* sim) {
+    unsigned char frame[STM32_MAX_FRAME];
+    size_t count = device_page_count(sim->device);
+    int valid;
+    int status = sim_reply(sim, STM32_ACK);
+    if (status == SIM_OK) status = sim_receive(sim, frame, 2);
+    if (status != SIM_OK) return status;
+
+    size_t pages = (frame[0] << 8 | frame[1]) + 1;
+    if (frame[0] == 0xFF && frame[1] >= 0xFD) {
+        status = sim_receive_frame(sim, frame, 2, 0, &valid);
+        if (status != SIM_OK) return status;
+        if (!valid) return sim_reply(sim, STM32_NACK);
+        sim_erase_all(sim);
+        return sim_reply(sim, STM32_ACK);
+    }
+    if (pages > STM32_EXTENDED_ERASE_PAGES) return sim_reply(sim, STM32_NACK);
+    status = sim_receive_frame(sim, frame, 2, pages * 2, &valid);
+    if (status != SIM_OK) return status;
+    for (size_t i = 0; valid && i < pages; i++)
+        valid = (size_t)(frame[2 + i * 2] << 8 | frame[3 + i * 2]) < count;
+    if (!valid) return sim_reply(sim, STM32_NACK);
+    for (size_t i = 0; i < pages; i++)
+        sim_erase_page(sim, frame[2 + i * 2] << 8 | frame[3 + i * 2]);
+    return sim_reply(sim, STM32_ACK);
+}
+
+static int sim_get_checksum(struct sim* sim) {
+    uint32_t addr, size, polynomial, init;
+    int valid;
+    int status = sim_receive_address(sim, &addr, &valid);
+    if (status != SIM_OK || !valid) return status;
+    status = sim_receive_word(sim, &size, &valid);
+    if (status == SIM_OK) status = sim_reply(sim, valid ? STM32_ACK : STM32_NACK);
+    if (status != SIM_OK || !valid) return status;
+    status = sim_receive_word(sim, &polynomial, &valid);
+    // Only the CRC unit's own polynomial
+    valid = valid && polynomial == CRC_POLYNOMIAL;
+    if (status == SIM_OK) status = sim_reply(sim, valid ? STM32_ACK : STM32_NACK);
+    if (status != SIM_OK || !valid) return status;
+    status = sim_receive_word(sim, &init, &valid);
+    if (status != SIM_OK) return status;
+
+    int kind;
+    const unsigned char* memory = sim_memory(sim, addr, size, &kind);
+    if (!valid || !memory || size == 0 || size % 4) return sim_reply(sim, STM32_NACK);
+    uint32_t crc = crc_update(init, memory, size);
+    // The CRC unit takes a clock cycle per word, negligible next to the wire
+    unsigned char reply[] = { STM32_ACK, crc >> 24, crc >> 16, crc >> 8, crc, 0 };
+    reply[5] = sim_checksum(reply + 1, 4);
+    return sim_send(sim, reply, sizeof(reply));
+}
+
+static int sim_go(struct sim* sim) {
+    uint32_t addr;
+    int valid;
+    int status = sim_receive_address(sim, &addr, &valid);
+    // Whatever runs now does not speak the bootloader protocol
+    if (status == SIM_OK && valid) sim->running = 1;
+    if (status == SIM_OK && valid && sim->options->verbose)
+        fprintf(stderr, "go 0x%08X\n", (unsigned int)addr);
+    return status;
+}
+
+static int sim_supports(const struct sim* sim, unsigned char command) {
+    return memchr(sim->commands, command, sim->command_count) != NULL;
+}
+
+static int sim_command(struct sim* sim, unsigned char command) {
+    switch (command) {
+        case STM32_CMD_GET:
+            return sim_get(sim);
+        case STM32_CMD_GET_VERSION:
+            return sim_get_version(sim);
+        case STM32_CMD_GET_ID:
+            return sim_get_id(sim);
+        case STM32_CMD_READ_MEMORY:
+            return sim_read_memory(sim);
+        case STM32_CMD_GO:
+            return sim_go(sim);
+        case STM32_CMD_WRITE_MEMORY:
+            return sim_write_memory(sim);
+        case STM32_CMD_ERASE:
+            return sim_erase(sim);
+        case STM32_CMD_EXTENDED_ERASE:
+            return sim_extended_erase(sim);
+        case STM32_CMD_GET_CHECKSUM:
+            return sim_get_checksum(sim);
+        default:
+            return sim_reply(sim, STM32_NACK);
+    }
+}
+
+// Serves one host session, from the sync byte until the pty is closed
+static int sim_session(struct sim* sim) {
+    unsigned char frame[2];
+    int status = SIM_OK;
+    while (status == SIM_OK) {
+        status = sim_receive(sim, frame, 1);
+        if (status != SIM_OK || sim->running) continue;
+        if (!sim->baud) {
+            // Autobaud: anything but the sync byte goes unnoticed, as does everything before the
+            // bootloader is up
+            const struct sim_options* options = sim->options;
+            uint64_t boot_time = (uint64_t)(options->boot_time * 1000 * options->time_scale);
+            if (frame[0] != STM32_SYNC || timestamp_us() - sim->opened < boot_time) continue;
+            sim->baud = sim_line_baud(sim);
+            if (sim->options->verbose) fprintf(stderr, "sync at %u baud\n", sim->baud);
+            status = sim_reply(sim, STM32_ACK);
+            continue;
+        }
+        // Further sync bytes are NACKed like a command whose complement does not match
+        if (frame[0] != STM32_SYNC) status = sim_receive(sim, frame + 1, 1);
+        if (status != SIM_OK) break;
+        sim->stats.commands++;
+        if (frame[0] == STM32_SYNC || (frame[0] ^ frame[1]) != 0xFF ||
+            !sim_supports(sim, frame[0]) ||
+            (sim->options->nack_rate && sim_random(sim) < sim->options->nack_rate)) {
+            status = sim_reply(sim, STM32_NACK);
+            continue;
+        }
+        if (sim->options->verbose) fprintf(stderr, "command 0x%02X\n", frame[0]);
+        status = sim_command(sim, frame[0]);
+    }
+    return status;
+}
+
+static int sim_load(struct sim* sim, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return SIM_ERR_IO;
+    // A shorter file leaves the rest of flash erased
+    fread(sim->flash, 1, sim->flash_size, file);
+    fclose(file);
+    return SIM_OK;
+}
+
+static int sim_dump(const struct sim* sim, const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (!file) return SIM_ERR_IO;
+    int status = SIM_OK;
+    if (fwrite(sim->flash, 1, sim->flash_size, file) != sim->flash_size) status = SIM_ERR_IO;
+    if (fclose(file) != 0) status = SIM_ERR_IO;
+    return status;
+}
+
+// Back to the state of a freshly opened tty and a freshly reset part
+static void sim_reset(struct sim* sim) {
+    struct termios tty;
+    if (tcgetattr(sim->master, &tty) == 0) {
+        cfsetispeed(&tty, B9600);
+        cfsetospeed(&tty, B9600);
+        tcsetattr(sim->master, TCSANOW, &tty);
+    }
+    tcflush(sim->master, TCIOFLUSH);
+    sim->baud = 0;
+    sim->running = 0;
+    sim->opened = 0;
+    sim->unpaced = 0;
+}
+
+static void sim_report(const struct sim* sim, double elapsed) {
+    const struct sim_stats* stats = &sim->stats;
+    fprintf(
+      stderr,
+      "session: %.3f s, %lu commands, %llu bytes in, %llu bytes out, %lu NACKs, %lu bytes "
+      "dropped, %lu garbled\n",
+      elapsed,
+      stats->commands,
+      (unsigned long long)stats->bytes_in,
+      (unsigned long long)stats->bytes_out,
+      stats->nacks,
+      stats->dropped,
+      stats->garbled);
+}
+
+static int sim_open(struct sim* sim, const char* link) {
+    sim->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (sim->master < 0) return SIM_ERR_IO;
+    const char* name = NULL;
+    if (grantpt(sim->master) == 0 && unlockpt(sim->master) == 0) name = ptsname(sim->master);
+    // The master only reports a hangup once the slave has been opened and closed again, which
+    // is how the host opening it is told apart
+    int slave = name ? open(name, O_RDWR | O_NOCTTY) : -1;
+    if (slave < 0) name = NULL;
+    if (name) {
+        close(slave);
+        unlink(link);
+        if (symlink(name, link) != 0) name = NULL;
+    }
+    if (!name) {
+        close(sim->master);
+        return SIM_ERR_IO;
+    }
+    printf("%s -> %s\n", link, name);
+    fflush(stdout);
+    return SIM_OK;
+}
+
+// Symlink to the pty, removed again on SIGINT / SIGTERM
+static const char* sim_link;
+
+static void sim_terminate(int signal) {
+    unlink(sim_link);
+    _exit(0);
+}
+
+// Default unique ID, derived from the link path so that several simulators differ
+static void sim_default_uid(const char* link, unsigned char* uid) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < DEVICE_UID_LENGTH; i++) {
+        for (const char* c = link; *c; c++) hash = (hash ^ (unsigned char)*c) * 16777619u;
+        hash = (hash ^ i) * 16777619u;
+        uid[i] = hash >> 24;
+    }
+}
+
+static int parse_uid(const char* hex, unsigned char* uid) {
+    if (strlen(hex) != DEVICE_UID_LENGTH * 2) return -1;
+    for (int i = 0; i < DEVICE_UID_LENGTH; i++) {
+        unsigned int byte;
+        if (sscanf(hex + i * 2, "%2x", &byte) != 1) return -1;
+        uid[i] = byte;
+    }
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(
+      stderr,
+      "usage: [-a ms] [-b ms] [-d rate] [-k] [-l file] [-L] [-m baud] [-n rate] [-o file] "
+      "[-p pid] [-s seed] [-t scale] [-u uid] [-v] [-w us] <link>\n");
+    fprintf(stderr, "  -a  latency timer of a modeled FT232R in between (default none)\n");
+    fprintf(stderr, "  -b  bootloader start-up time after the host opens the pty (default 0)\n");
+    fprintf(stderr, "  -d  chance of dropping each reply byte (default 0)\n");
+    fprintf(stderr, "  -k  leave Get Checksum out of the command set\n");
+    fprintf(stderr, "  -l  initial flash contents\n");
+    fprintf(stderr, "  -L  offer the legacy Erase command instead of Extended Erase\n");
+    fprintf(stderr, "  -m  highest line rate carried without errors (default any)\n");
+    fprintf(stderr, "  -n  chance of NACKing each command and frame (default 0)\n");
+    fprintf(stderr, "  -o  file to write flash contents to after every session\n");
+    fprintf(stderr, "  -p  product ID from the device table (default 0x%03X)\n", SIM_PID);
+    fprintf(stderr, "  -s  seed for fault injection (default 1)\n");
+    fprintf(stderr, "  -t  scale of modeled erase, program and wire times, 0 for none\n");
+    fprintf(stderr, "  -u  unique device ID as 24 hex digits (default derived from link)\n");
+    fprintf(stderr, "  -v  log commands and per-session statistics\n");
+    fprintf(stderr, "  -w  program time per word in microseconds (default %d)\n", SIM_PROGRAM_TIME);
+    fprintf(stderr, "  link is created as a symlink to the pty\n");
+}
+
+int main(int argc, char** argv) {
+    struct sim_options options = {
+        .pid = SIM_PID,
+        .checksum = 1,
+        .time_scale = 1.0,
+        .program_time = SIM_PROGRAM_TIME,
+        .seed = 1,
+    };
+    int uid = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:b:d:kl:Lm:n:o:p:s:t:u:vw:")) != -1) {
+        switch (opt) {
+            case 'a':
+                options.latency = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                options.boot_time = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                options.drop_rate = strtod(optarg, NULL);
+                break;
+            case 'k':
+                options.checksum = 0;
+                break;
+            case 'l':
+                options.load_path = optarg;
+                break;
+            case 'L':
+                options.legacy_erase = 1;
+                break;
+            case 'm':
+                options.max_baud = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                options.nack_rate = strtod(optarg, NULL);
+                break;
+            case 'o':
+                options.dump_path = optarg;
+                break;
+            case 'p':
+                options.pid = (uint16_t)strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                options.seed = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                options.time_scale = strtod(optarg, NULL);
+                break;
+            case 'u':
+                if (parse_uid(optarg, options.uid) != 0) {
+                    usage();
+                    return -1;
+                }
+                uid = 1;
+                break;
+            case 'v':
+                options.verbose = 1;
+                break;
+            case 'w':
+                options.program_time = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+                return -1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return -1;
+    }
+    const char* link = argv[optind];
+    if (!uid) sim_default_uid(link, options.uid);
+
+    struct sim* sim = (struct sim*)calloc(1, sizeof(struct sim));
+    sim->options = &options;
+    sim->device = device_find(options.pid);
+    if (!sim->device) {
+        fprintf(stderr, "Unknown product ID 0x%03X\n", options.pid);
+        free(sim);
+        return -1;
+    }
+    sim->flash_size = device_flash_size(sim->device);
+    sim->flash = (unsigned char*)malloc(sim->flash_size);
+    memset(sim->flash, 0xFF, sim->flash_size);
+    memcpy(sim->uid, options.uid, sizeof(sim->uid));
+    sim->random = options.seed ? options.seed : 1;
+    const unsigned char commands[] = {
+        STM32_CMD_GET,
+        STM32_CMD_GET_VERSION,
+        STM32_CMD_GET_ID,
+        STM32_CMD_READ_MEMORY,
+        STM32_CMD_GO,
+        STM32_CMD_WRITE_MEMORY,
+        options.legacy_erase ? STM32_CMD_ERASE : STM32_CMD_EXTENDED_ERASE,
+    };
+    memcpy(sim->commands, commands, sizeof(commands));
+    sim->command_count = sizeof(commands);
+    if (options.checksum) sim->commands[sim->command_count++] = STM32_CMD_GET_CHECKSUM;
+
+    if (options.load_path && sim_load(sim, options.load_path) != SIM_OK) {
+        fprintf(stderr, "Failed to load %s\n", options.load_path);
+        return -1;
+    }
+    if (sim_open(sim, link) != SIM_OK) {
+        fprintf(stderr, "Failed to create %s\n", link);
+        return -1;
+    }
+    sim_link = link;
+    signal(SIGINT, sim_terminate);
+    signal(SIGTERM, sim_terminate);
+
+    // While nobody holds the pty open, the master reports a hangup
+    int status = SIM_OK;
+    while (status != SIM_ERR_IO) {
+        struct pollfd pfd = { .fd = sim->master, .events = POLLIN };
+        if (poll(&pfd, 1, SIM_HANGUP_POLL) < 0 && errno != EINTR) break;
+        if (pfd.revents & POLLHUP) {
+            usleep(SIM_HANGUP_POLL * 1000);
+            continue;
+        }
+        if (!sim->opened) sim->opened = timestamp_us();
+        if (!(pfd.revents & POLLIN)) continue;
+
+        uint64_t start = timestamp_us();
+        memset(&sim->stats, 0, sizeof(sim->stats));
+        status = sim_session(sim);
+        if (options.verbose) sim_report(sim, (timestamp_us() - start) / 1e6);
+        if (options.dump_path && sim_dump(sim, options.dump_path) != SIM_OK)
+            fprintf(stderr, "Failed to write %s\n", options.dump_path);
+        sim_reset(sim);
+    }
+
+    unlink(link);
+    close(sim->master);
+    free(sim->flash);
+    free(sim);
+    return status == SIM_ERR_IO ? -1 : 0;
+}
@@ -0,0 +1,352 @@
+#include "stm32.h"
+
+#include "timestamp.h"
+
+#include <string.h>
+
+static int stm32_port_status(int status) {
+    switch (status) {
+        case PORT_OK:
+            return STM32_OK;
+        case PORT_ERR_TIMEOUT:
+            return STM32_ERR_TIMEOUT;
+        default:
+            return STM32_ERR_IO;
+    }
+}
+
+static int stm32_receive(
+  struct stm32* stm, unsigned char* data, size_t size, unsigned int timeout) {
+    return stm32_port_status(port_read(stm->port, data, size, timeout));
+}
+
+static int stm32_check_ack(unsigned char reply) {
+    if (reply == STM32_ACK) return STM32_OK;
+    return reply == STM32_NACK ? STM32_ERR_NACK : STM32_ERR_PROTOCOL;
+}
+
+static int stm32_read_ack(struct stm32* stm, unsigned int timeout) {
+    unsigned char reply;
+    int status = stm32_receive(stm, &reply, 1, timeout);
+    if (status == STM32_OK) status = stm32_check_ack(reply);
+    return status;
+}
+
+static int stm32_send(
+  struct stm32* stm, const unsigned char* data, size_t size, unsigned int timeout) {
+    unsigned char reply;
+    uint64_t start = timestamp_us();
+    int status = stm32_port_status(port_transfer(stm->port, data, size, &reply, 1, timeout));
+    if (status == STM32_OK) {
+        struct stm32_stats* stats = &stm->stats;
+        uint64_t elapsed = timestamp_us() - start;
+        if (stats->count == 0 || elapsed < stats->min) stats->min = elapsed;
+        if (elapsed > stats->max) stats->max = elapsed;
+        stats->total += elapsed;
+        stats->count++;
+        status = stm32_check_ack(reply);
+    }
+    return status;
+}
+
+static int stm32_send_command(struct stm32* stm, unsigned char command) {
+    unsigned char frame[2];
+    size_t size = stm32_encode_command(command, frame);
+    return stm32_send(stm, frame, size, STM32_TIMEOUT);
+}
+
+static int stm32_send_address(struct stm32* stm, uint32_t addr) {
+    unsigned char frame[STM32_ADDRESS_FRAME];
+    size_t size = stm32_encode_address(addr, frame);
+    return stm32_send(stm, frame, size, STM32_TIMEOUT);
+}
+
+static unsigned char stm32_checksum(const unsigned char* data, size_t size) {
+    unsigned char checksum = 0;
+    for (size_t i = 0; i < size; i++) checksum ^= data[i];
+    return checksum;
+}
+
+size_t stm32_encode_command(unsigned char command, unsigned char* frame) {
+    frame[0] = command;
+    frame[1] = command ^ 0xFF;
+    return 2;
+}
+
+size_t stm32_encode_address(uint32_t addr, unsigned char* frame) {
+    frame[0] = addr >> 24;
+    frame[1] = addr >> 16;
+    frame[2] = addr >> 8;
+    frame[3] = addr;
+    frame[4] = stm32_checksum(frame, 4);
+    return 5;
+}
+
+size_t stm32_encode_length(size_t size, unsigned char* frame) {
+    frame[0] = size - 1;
+    frame[1] = (size - 1) ^ 0xFF;
+    return 2;
+}
+
+size_t stm32_encode_data(const unsigned char* data, size_t size, unsigned char* frame) {
+    // Length byte, data and checksum
+    frame[0] = size - 1;
+    memcpy(frame + 1, data, size);
+    frame[size + 1] = stm32_checksum(frame, size + 1);
+    return size + 2;
+}
+
+unsigned char stm32_erase_command(const struct stm32* stm) {
+    if (stm32_supports(stm, STM32_CMD_EXTENDED_ERASE)) return STM32_CMD_EXTENDED_ERASE;
+    if (stm32_supports(stm, STM32_CMD_ERASE)) return STM32_CMD_ERASE;
+    return 0;
+}
+
+size_t stm32_encode_erase(
+  unsigned char command, const uint16_t* pages, size_t count, unsigned char* frame) {
+    size_t size = 0;
+    if (command == STM32_CMD_EXTENDED_ERASE) {
+        if (!pages) {
+            // Mass erase
+            frame[size++] = 0xFF;
+            frame[size++] = 0xFF;
+        } else {
+            // Page count minus one and page numbers as big endian half words
+            frame[size++] = (count - 1) >> 8;
+            frame[size++] = count - 1;
+            for (size_t i = 0; i < count; i++) {
+                frame[size++] = pages[i] >> 8;
+                frame[size++] = pages[i];
+            }
+        }
+    } else {
+        if (!pages) {
+            // Global erase
+            frame[size++] = 0xFF;
+        } else {
+            // Page count minus one and page numbers as bytes
+            frame[size++] = count - 1;
+            for (size_t i = 0; i < count; i++) {
+                if (pages[i] > 0xFF) return 0;
+                frame[size++] = pages[i];
+            }
+        }
+    }
+    // A single byte global erase frame is complemented rather than checksummed
+    frame[size] = size == 1 ? frame[0] ^ 0xFF : stm32_checksum(frame, size);
+    size++;
+
+    return size;
+}
+
+int stm32_init(struct stm32* stm, struct port* port) {
+    memset(stm, 0, sizeof(struct stm32));
+    stm->port = port;
+
+    int status = stm32_sync(stm);
+    if (status == STM32_OK) status = stm32_get(stm);
+    if (status == STM32_OK) status = stm32_get_id(stm);
+
+    return status;
+}
+
+unsigned int stm32_sync_timeout(unsigned int attempt) {
+    unsigned int timeout = STM32_SYNC_POLL;
+    unsigned int elapsed = 0;
+    for (unsigned int i = 0; i < attempt; i++) {
+        elapsed += timeout;
+        timeout = timeout * 2 < STM32_SYNC_TIMEOUT ? timeout * 2 : STM32_SYNC_TIMEOUT;
+    }
+    return elapsed < STM32_SYNC_DEADLINE ? timeout : 0;
+}
+
+unsigned int stm32_sync_quiet(unsigned int latency, unsigned int timeout) {
+    return (latency ? latency : STM32_SYNC_LATENCY) + timeout;
+}
+
+int stm32_sync(struct stm32* stm) {
+    unsigned char sync = STM32_SYNC;
+    int status = STM32_ERR_PROTOCOL;
+    unsigned int attempt = 0;
+    unsigned int timeout = 0;
+    // Whatever the target sent before it was ready is not the answer. A late ACK to an earlier
+    // sync byte is, so the input is only flushed again after noise.
+    while ((status == STM32_ERR_TIMEOUT || status == STM32_ERR_PROTOCOL) &&
+           (timeout = stm32_sync_timeout(attempt))) {
+        if (status == STM32_ERR_PROTOCOL) port_flush(stm->port);
+        status = stm32_send(stm, &sync, 1, timeout);
+        attempt++;
+    }
+    // The bootloader NACKs further sync bytes once it has locked onto the baud rate
+    if (status == STM32_ERR_NACK) status = STM32_OK;
+    // A reply slower than the wait means that a later sync byte draws a NACK of its own, which
+    // the adapter's latency timer holds back on top of the target's reply time
+    if (status == STM32_OK && attempt > 1) {
+        unsigned int quiet = stm32_sync_quiet(stm->port->latency, timeout);
+        unsigned char stale;
+        while (stm32_receive(stm, &stale, 1, quiet) == STM32_OK) continue;
+    }
+
+    return status;
+}
+
+int stm32_get(struct stm32* stm) {
+    unsigned char count;
+    unsigned char reply[STM32_MAX_TRANSFER];
+    int status = stm32_send_command(stm, STM32_CMD_GET);
+    if (status == STM32_OK) status = stm32_receive(stm, &count, 1, STM32_TIMEOUT);
+    // Version byte followed by count supported commands
+    if (status == STM32_OK) status = stm32_receive(stm, reply, count + 1, STM32_TIMEOUT);
+    if (status == STM32_OK) status = stm32_read_ack(stm, STM32_TIMEOUT);
+    if (status == STM32_OK) {
+        stm->version = reply[0];
+        stm->command_count = count;
+        memcpy(stm->commands, reply + 1, count);
+    }
+
+    return status;
+}
+
+int stm32_get_id(struct stm32* stm) {
+    unsigned char count;
+    unsigned char reply[STM32_MAX_TRANSFER];
+    int status = stm32_send_command(stm, STM32_CMD_GET_ID);
+    if (status == STM32_OK) status = stm32_receive(stm, &count, 1, STM32_TIMEOUT);
+    if (status == STM32_OK) status = stm32_receive(stm, reply, count + 1, STM32_TIMEOUT);
+    if (status == STM32_OK) status = stm32_read_ack(stm, STM32_TIMEOUT);
+    if (status == STM32_OK && count != 1) status = STM32_ERR_PROTOCOL;
+    if (status == STM32_OK) stm->pid = (reply[0] << 8) | reply[1];
+
+    return status;
+}
+
+int stm32_supports(const struct stm32* stm, unsigned char command) {
+    return memchr(stm->commands, command, stm->command_count) != NULL;
+}
+
+int stm32_read_memory(struct stm32* stm, uint32_t addr, unsigned char* data, size_t size) {
+    if (size == 0 || size > STM32_MAX_TRANSFER) return STM32_ERR_PROTOCOL;
+    unsigned char frame[2];
+    stm32_encode_length(size, frame);
+    int status = stm32_send_command(stm, STM32_CMD_READ_MEMORY);
+    if (status == STM32_OK) status = stm32_send_address(stm, addr);
+    if (status == STM32_OK) status = stm32_send(stm, frame, sizeof(frame), STM32_TIMEOUT);
+    if (status == STM32_OK) status = stm32_receive(stm, data, size, STM32_TIMEOUT);
+
+    return status;
+}
+
+int stm32_write_memory(struct stm32* stm, uint32_t addr, const unsigned char* data, size_t size) {
+    if (size == 0 || size > STM32_MAX_TRANSFER) return STM32_ERR_PROTOCOL;
+    unsigned char frame[STM32_MAX_TRANSFER + 2];
+    size_t frame_size = stm32_encode_data(data, size, frame);
+
+    int status = stm32_send_command(stm, STM32_CMD_WRITE_MEMORY);
+    if (status == STM32_OK) status = stm32_send_address(stm, addr);
+    if (status == STM32_OK) status = stm32_send(stm, frame, frame_size, STM32_WRITE_TIMEOUT);
+
+    return status;
+}
+
+int stm32_write_encoded(struct stm32* stm, const unsigned char* frames, size_t size) {
+    if (size == 0 || size > STM32_MAX_TRANSFER) return STM32_ERR_PROTOCOL;
+    const unsigned char* data = frames + STM32_ADDRESS_FRAME;
+
+    int status = stm32_send_command(stm, STM32_CMD_WRITE_MEMORY);
+    if (status == STM32_OK) status = stm32_send(stm, frames, STM32_ADDRESS_FRAME, STM32_TIMEOUT);
+    if (status == STM32_OK) status = stm32_send(stm, data, size + 2, STM32_WRITE_TIMEOUT);
+
+    return status;
+}
+
+static int stm32_erase(
+  struct stm32* stm, const uint16_t* pages, size_t count, unsigned int timeout) {
+    unsigned char frame[STM32_MAX_FRAME];
+    unsigned char command = stm32_erase_command(stm);
+    if (!command) return STM32_ERR_UNSUPPORTED;
+    size_t size = stm32_encode_erase(command, pages, count, frame);
+    if (!size) return STM32_ERR_UNSUPPORTED;
+
+    int status = stm32_send_command(stm, command);
+    if (status == STM32_OK) status = stm32_send(stm, frame, size, timeout);
+
+    return status;
+}
+
+int stm32_erase_all(struct stm32* stm) {
+    return stm32_erase(stm, NULL, 0, STM32_MASS_ERASE_TIMEOUT);
+}
+
+int stm32_erase_pages(struct stm32* stm, const uint16_t* pages, size_t count) {
+    size_t max = stm32_erase_command(stm) == STM32_CMD_EXTENDED_ERASE ?
+                   STM32_EXTENDED_ERASE_PAGES :
+                   STM32_ERASE_PAGES;
+    int status = STM32_OK;
+    while (status == STM32_OK && count > 0) {
+        size_t n = count < max ? count : max;
+        status = stm32_erase(stm, pages, n, STM32_PAGE_ERASE_TIMEOUT * n);
+        pages += n;
+        count -= n;
+    }
+
+    return status;
+}
+
+static int stm32_send_word(struct stm32* stm, uint32_t word, unsigned int timeout) {
+    unsigned char frame[5];
+    // Same layout as an address
+    size_t size = stm32_encode_address(word, frame);
+    return stm32_send(stm, frame, size, timeout);
+}
+
+int stm32_get_checksum(
+  struct stm32* stm,
+  uint32_t addr,
+  uint32_t size,
+  uint32_t polynomial,
+  uint32_t init,
+  uint32_t* crc) {
+    unsigned char reply[5];
+    if (size == 0 || size % 4) return STM32_ERR_PROTOCOL;
+    int status = stm32_send_command(stm, STM32_CMD_GET_CHECKSUM);
+    if (status == STM32_OK) status = stm32_send_address(stm, addr);
+    if (status == STM32_OK) status = stm32_send_word(stm, size, STM32_TIMEOUT);
+    if (status == STM32_OK) status = stm32_send_word(stm, polynomial, STM32_TIMEOUT);
+    // The target computes the CRC before acknowledging the initial value
+    if (status == STM32_OK) status = stm32_send_word(stm, init, STM32_CHECKSUM_TIMEOUT);
+    // CRC, most significant byte first, and its XOR checksum
+    if (status == STM32_OK) status = stm32_receive(stm, reply, sizeof(reply), STM32_TIMEOUT);
+    if (status == STM32_OK && stm32_checksum(reply, 4) != reply[4]) status = STM32_ERR_PROTOCOL;
+    if (status == STM32_OK)
+        *crc = (uint32_t)reply[0] << 24 | reply[1] << 16 | reply[2] << 8 | reply[3];
+
+    return status;
+}
+
+int stm32_go(struct stm32* stm, uint32_t addr) {
+    int status = stm32_send_command(stm, STM32_CMD_GO);
+    if (status == STM32_OK) status = stm32_send_address(stm, addr);
+
+    return status;
+}
+
+const char* stm32_strerror(int status) {
+    switch (status) {
+        case STM32_OK:
+            return "success";
+        case STM32_ERR_IO:
+            return "port I/O error";
+        case STM32_ERR_TIMEOUT:
+            return "timed out waiting for bootloader";
+        case STM32_ERR_NACK:
+            return "command rejected by bootloader";
+        case STM32_ERR_PROTOCOL:
+            return "unexpected bootloader response";
+        case STM32_ERR_UNSUPPORTED:
+            return "command not supported by bootloader";
+        case STM32_ERR_VERIFY:
+            return "verification failed";
+        default:
+            return "unknown error";
+    }
+}
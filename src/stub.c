@@ -0,0 +1,194 @@
+#include "stub.h"
+
+#include "crc.h"
+#include "lz4.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STUB_MAX_FRAME \
+    (STUB_FRAME_HEADER + ((LZ4_BOUND(STUB_MAX_CHUNK) + 3) & ~3) + STUB_FRAME_CRC)
+
+static uint32_t stub_word(const unsigned char* data) {
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 |
+           (uint32_t)data[3] << 24;
+}
+
+static void stub_put_word(unsigned char* data, uint32_t value) {
+    data[0] = value;
+    data[1] = value >> 8;
+    data[2] = value >> 16;
+    data[3] = value >> 24;
+}
+
+int stub_load(struct stub* stub, const char* path) {
+    memset(stub, 0, sizeof(struct stub));
+    FILE* file = fopen(path, "rb");
+    if (!file) return STM32_ERR_IO;
+    int status = fseek(file, 0, SEEK_END) == 0 ? STM32_OK : STM32_ERR_IO;
+    long size = status == STM32_OK ? ftell(file) : -1;
+    if (size < STUB_HEADER_SIZE) status = STM32_ERR_PROTOCOL;
+    // Whole words, as the bootloader writes them
+    if (status == STM32_OK) stub->data = (unsigned char*)malloc((size + 3) & ~3);
+    if (status == STM32_OK && !stub->data) status = STM32_ERR_IO;
+    if (status == STM32_OK && (fseek(file, 0, SEEK_SET) != 0 ||
+                               fread(stub->data, 1, size, file) != (size_t)size))
+        status = STM32_ERR_IO;
+    fclose(file);
+    if (status != STM32_OK) {
+        stub_free(stub);
+        return status;
+    }
+
+    stub->size = size;
+    while (stub->size % 4) stub->data[stub->size++] = 0xFF;
+    stub->load = stub_word(stub->data + STUB_OFFSET_LOAD);
+    stub->chunk = stub_word(stub->data + STUB_OFFSET_CHUNK);
+    for (int i = 0; i < STUB_MAX_PIDS; i++) {
+        const unsigned char* pid = stub->data + STUB_OFFSET_PIDS + i * 2;
+        stub->pids[i] = pid[0] | pid[1] << 8;
+    }
+    // At least one bootloader block per chunk
+    if (stub_word(stub->data + STUB_OFFSET_MAGIC) != STUB_MAGIC ||
+        stub->chunk < STM32_MAX_TRANSFER || stub->chunk > STUB_MAX_CHUNK || stub->chunk % 4) {
+        stub_free(stub);
+        return STM32_ERR_PROTOCOL;
+    }
+
+    return STM32_OK;
+}
+
+void stub_free(struct stub* stub) {
+    free(stub->data);
+    stub->data = NULL;
+    stub->size = 0;
+}
+
+int stub_supports(const struct stub* stub, uint16_t pid) {
+    for (int i = 0; i < STUB_MAX_PIDS && stub->pids[i]; i++) {
+        if (stub->pids[i] == pid) return 1;
+    }
+    return 0;
+}
+
+static int stub_port_status(int status) {
+    switch (status) {
+        case PORT_OK:
+            return STM32_OK;
+        case PORT_ERR_TIMEOUT:
+            return STM32_ERR_TIMEOUT;
+        default:
+            return STM32_ERR_IO;
+    }
+}
+
+// Sends one frame, again while the stub reports a CRC mismatch, and reads reply_size bytes
+// following its ACK
+static int stub_request(
+  struct stm32* stm,
+  unsigned char command,
+  unsigned char flags,
+  uint32_t addr,
+  uint32_t size,
+  const unsigned char* payload,
+  size_t length,
+  unsigned char* reply,
+  size_t reply_size,
+  unsigned int timeout) {
+    unsigned char frame[STUB_MAX_FRAME];
+    size_t padded = (length + 3) & ~(size_t)3;
+    frame[0] = command;
+    frame[1] = flags;
+    frame[2] = length;
+    frame[3] = length >> 8;
+    stub_put_word(frame + 4, addr);
+    stub_put_word(frame + 8, size);
+    if (length) memcpy(frame + STUB_FRAME_HEADER, payload, length);
+    memset(frame + STUB_FRAME_HEADER + length, 0xFF, padded - length);
+    size_t frame_size = STUB_FRAME_HEADER + padded;
+    stub_put_word(frame + frame_size, crc_update(CRC_INIT, frame, frame_size));
+    frame_size += STUB_FRAME_CRC;
+
+    int status = STM32_ERR_NACK;
+    for (int attempt = 0; status == STM32_ERR_NACK && attempt < STUB_RETRIES; attempt++) {
+        unsigned char ack;
+        status = stub_port_status(port_transfer(stm->port, frame, frame_size, &ack, 1, timeout));
+        if (status != STM32_OK) break;
+        if (ack == STUB_NACK)
+            status = STM32_ERR_NACK;
+        else if (ack == STUB_ERROR)
+            // The chunk before this one did not program
+            status = STM32_ERR_VERIFY;
+        else if (ack != STUB_ACK)
+            status = STM32_ERR_PROTOCOL;
+    }
+    if (status == STM32_OK && reply_size)
+        status = stub_port_status(port_read(stm->port, reply, reply_size, timeout));
+
+    return status;
+}
+
+int stub_start(struct stm32* stm, const struct stub* stub, unsigned int line, unsigned int baud) {
+    unsigned char* data = (unsigned char*)malloc(stub->size);
+    if (!data) return STM32_ERR_IO;
+    memcpy(data, stub->data, stub->size);
+    stub_put_word(data + STUB_OFFSET_BAUD, line);
+
+    int status = STM32_OK;
+    for (size_t offset = 0; status == STM32_OK && offset < stub->size;
+         offset += STM32_MAX_TRANSFER) {
+        size_t size = stub->size - offset;
+        if (size > STM32_MAX_TRANSFER) size = STM32_MAX_TRANSFER;
+        status = stm32_write_memory(stm, stub->load + offset, data + offset, size);
+    }
+    free(data);
+    if (status == STM32_OK) status = stm32_go(stm, stub->load);
+
+    unsigned char ready;
+    if (status == STM32_OK)
+        status = stub_port_status(port_read(stm->port, &ready, 1, STM32_TIMEOUT));
+    if (status == STM32_OK && ready != STUB_READY) status = STM32_ERR_PROTOCOL;
+    if (status != STM32_OK || baud == line || !stm->port->set_baud) return status;
+
+    // The ACK still comes at the old rate, the stub switches right after sending it
+    status = stub_request(stm, STUB_CMD_BAUD, 0, 0, baud, NULL, 0, NULL, 0, STM32_TIMEOUT);
+    if (status == STM32_OK) status = stub_port_status(port_set_baud(stm->port, baud));
+    if (status == STM32_OK) status = stub_port_status(port_flush(stm->port));
+    if (status == STM32_OK) status = stub_ping(stm);
+
+    return status;
+}
+
+int stub_write(struct stm32* stm, uint32_t addr, const unsigned char* data, size_t size) {
+    unsigned char compressed[LZ4_BOUND(STUB_MAX_CHUNK)];
+    if (size > STUB_MAX_CHUNK) return STM32_ERR_PROTOCOL;
+    // Sent as is when compression does not pay off, e.g. for already dense data
+    size_t length = lz4_compress(data, size, compressed);
+    if (length < size)
+        return stub_request(
+          stm,
+          STUB_CMD_WRITE,
+          STUB_FLAG_LZ4,
+          addr,
+          size,
+          compressed,
+          length,
+          NULL,
+          0,
+          STM32_WRITE_TIMEOUT);
+    return stub_request(
+      stm, STUB_CMD_WRITE, 0, addr, size, data, size, NULL, 0, STM32_WRITE_TIMEOUT);
+}
+
+int stub_ping(struct stm32* stm) {
+    return stub_request(stm, STUB_CMD_PING, 0, 0, 0, NULL, 0, NULL, 0, STM32_WRITE_TIMEOUT);
+}
+
+int stub_checksum(struct stm32* stm, uint32_t addr, uint32_t size, uint32_t* crc) {
+    unsigned char reply[4];
+    int status = stub_request(
+      stm, STUB_CMD_CRC, 0, addr, size, NULL, 0, reply, sizeof(reply), STM32_CHECKSUM_TIMEOUT);
+    if (status == STM32_OK) *crc = stub_word(reply);
+    return status;
+}
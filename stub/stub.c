@@ -0,0 +1,292 @@
+// Programming stub for STM32F1 medium and high density parts, loaded into SRAM by the host and
+// started with the system bootloader's Go command. It talks to the host over USART1 (PA9/PA10,
+// 8E1 like the bootloader), receives through DMA into a ring so that the next chunk arrives while
+// the current one is programmed, and runs from the HSI PLL at 64 MHz, good for up to 4 Mbaud.
+// See include/stub_protocol.h for the wire protocol.
+
+#include "stub_protocol.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REG(addr) (*(volatile uint32_t*)(addr))
+
+#define RCC_CR REG(0x40021000)
+#define RCC_CFGR REG(0x40021004)
+#define RCC_AHBENR REG(0x40021014)
+#define RCC_APB2ENR REG(0x40021018)
+
+#define FLASH_ACR REG(0x40022000)
+#define FLASH_KEYR REG(0x40022004)
+#define FLASH_SR REG(0x4002200C)
+#define FLASH_CR REG(0x40022010)
+
+#define GPIOA_CRH REG(0x40010804)
+
+#define USART1_SR REG(0x40013800)
+#define USART1_DR REG(0x40013804)
+#define USART1_BRR REG(0x40013808)
+#define USART1_CR1 REG(0x4001380C)
+#define USART1_CR3 REG(0x40013814)
+
+// USART1 RX is DMA1 channel 5
+#define DMA1_CCR5 REG(0x40020058)
+#define DMA1_CNDTR5 REG(0x4002005C)
+#define DMA1_CPAR5 REG(0x40020060)
+#define DMA1_CMAR5 REG(0x40020064)
+
+#define CRC_DR REG(0x40023000)
+#define CRC_CR REG(0x40023008)
+
+#define CLOCK 64000000 // Hz, HSI / 2 * 16, USART1 sits on APB2 at the same rate
+
+#define CHUNK 1024
+// Room for one compressed chunk frame and the start of the next
+#define RING_SIZE 2048
+#define FRAME_SIZE (STUB_FRAME_HEADER + CHUNK + CHUNK / 255 + 20 + STUB_FRAME_CRC)
+
+#define FLASH_KEY1 0x45670123
+#define FLASH_KEY2 0xCDEF89AB
+#define FLASH_SR_BSY 0x01
+#define FLASH_SR_PGERR 0x04
+#define FLASH_SR_WRPRTERR 0x10
+#define FLASH_SR_EOP 0x20
+#define FLASH_CR_PG 0x01
+#define FLASH_CR_LOCK 0x80
+
+extern uint32_t __stack_top;
+extern uint32_t __bss_start;
+extern uint32_t __bss_end;
+
+void stub_main(void);
+
+struct header {
+    uint32_t stack;
+    void (*entry)(void);
+    uint32_t magic;
+    uint32_t load;
+    // Patched by the host with the line rate in use when Go is sent
+    uint32_t baud;
+    uint32_t chunk;
+    uint16_t pids[STUB_MAX_PIDS];
+};
+
+__attribute__((section(".header"), used)) struct header header = {
+    (uint32_t)&__stack_top,
+    stub_main,
+    STUB_MAGIC,
+    (uint32_t)&header,
+    115200,
+    CHUNK,
+    // F101/F102/F103 medium and high density
+    { 0x410, 0x414 },
+};
+
+static volatile unsigned char ring[RING_SIZE];
+static size_t ring_tail;
+static uint32_t frame[FRAME_SIZE / 4 + 1];
+static unsigned char chunk[CHUNK];
+
+static void clock_init(void) {
+    // Back to the HSI with the PLL off, whatever the bootloader left behind
+    RCC_CR |= 1 << 0;
+    while (!(RCC_CR & (1 << 1)))
+        ;
+    RCC_CFGR &= ~3u;
+    while (RCC_CFGR & (3 << 2))
+        ;
+    RCC_CR &= ~(1u << 24);
+    while (RCC_CR & (1 << 25))
+        ;
+
+    // Two wait states above 48 MHz, APB1 limited to 36 MHz
+    FLASH_ACR = (FLASH_ACR & ~7u) | 2;
+    RCC_CFGR = (14 << 18) | (4 << 8);
+    RCC_CR |= 1 << 24;
+    while (!(RCC_CR & (1 << 25)))
+        ;
+    RCC_CFGR |= 2;
+    while ((RCC_CFGR & (3 << 2)) != (2 << 2))
+        ;
+}
+
+static void usart_baud(uint32_t baud) {
+    USART1_BRR = (CLOCK + baud / 2) / baud;
+}
+
+static void usart_init(uint32_t baud) {
+    // DMA1, CRC, GPIOA and USART1 clocks
+    RCC_AHBENR |= (1 << 0) | (1 << 6);
+    RCC_APB2ENR |= (1 << 2) | (1 << 14);
+    // PA9 alternate function push-pull 50 MHz, PA10 floating input
+    GPIOA_CRH = (GPIOA_CRH & ~0xFF0u) | (0xB << 4) | (0x4 << 8);
+
+    USART1_CR1 = 0;
+    usart_baud(baud);
+    USART1_CR3 = 1 << 6; // DMAR
+    // 9 bit words carrying 8 data bits and even parity, transmitter and receiver on
+    USART1_CR1 = (1 << 13) | (1 << 12) | (1 << 10) | (1 << 3) | (1 << 2);
+
+    DMA1_CCR5 = 0;
+    DMA1_CPAR5 = (uint32_t)&USART1_DR;
+    DMA1_CMAR5 = (uint32_t)ring;
+    DMA1_CNDTR5 = RING_SIZE;
+    // Memory increment, circular, enabled
+    DMA1_CCR5 = (1 << 7) | (1 << 5) | (1 << 0);
+}
+
+static void usart_send(const unsigned char* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        while (!(USART1_SR & (1 << 7)))
+            ;
+        USART1_DR = data[i];
+    }
+    // Transmission complete, so the line rate can change
+    while (!(USART1_SR & (1 << 6)))
+        ;
+}
+
+static void usart_reply(unsigned char reply) {
+    usart_send(&reply, 1);
+}
+
+static void ring_read(unsigned char* data, size_t size) {
+    while (size > 0) {
+        size_t head = RING_SIZE - DMA1_CNDTR5;
+        if (head == RING_SIZE) head = 0;
+        while (ring_tail != head && size > 0) {
+            *data++ = ring[ring_tail];
+            ring_tail = (ring_tail + 1) % RING_SIZE;
+            size--;
+        }
+    }
+}
+
+static uint32_t word(const unsigned char* data) {
+    return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16 |
+           (uint32_t)data[3] << 24;
+}
+
+// The CRC unit shifts each 32-bit word in most significant bit first, like the host does
+static uint32_t crc(const uint32_t* words, size_t count) {
+    CRC_CR = 1;
+    for (size_t i = 0; i < count; i++) CRC_DR = words[i];
+    return CRC_DR;
+}
+
+// LZ4 block format, returns the decompressed size or -1 if it would overflow the chunk
+static int lz4_decompress(const unsigned char* src, size_t size, unsigned char* dst) {
+    const unsigned char* end = src + size;
+    unsigned char* out = dst;
+    while (src < end) {
+        unsigned int token = *src++;
+        size_t length = token >> 4;
+        if (length == 15) {
+            unsigned char extra;
+            do {
+                extra = *src++;
+                length += extra;
+            } while (extra == 255 && src < end);
+        }
+        if (length > (size_t)(end - src) || length > (size_t)(dst + CHUNK - out)) return -1;
+        for (size_t i = 0; i < length; i++) *out++ = *src++;
+        // The last sequence has no match
+        if (src >= end) break;
+
+        size_t offset = src[0] | src[1] << 8;
+        src += 2;
+        length = (token & 15) + 4;
+        if ((token & 15) == 15) {
+            unsigned char extra;
+            do {
+                extra = *src++;
+                length += extra;
+            } while (extra == 255 && src < end);
+        }
+        if (offset == 0 || offset > (size_t)(out - dst) || length > (size_t)(dst + CHUNK - out))
+            return -1;
+        for (size_t i = 0; i < length; i++, out++) *out = out[-(long)offset];
+    }
+    return out - dst;
+}
+
+static int flash_program(uint32_t addr, const unsigned char* data, size_t size) {
+    int failed = 0;
+    if (FLASH_CR & FLASH_CR_LOCK) {
+        FLASH_KEYR = FLASH_KEY1;
+        FLASH_KEYR = FLASH_KEY2;
+    }
+    FLASH_CR = FLASH_CR_PG;
+    for (size_t i = 0; !failed && i < size; i += 2) {
+        volatile uint16_t* target = (volatile uint16_t*)(addr + i);
+        uint16_t value = data[i] | data[i + 1] << 8;
+        *target = value;
+        while (FLASH_SR & FLASH_SR_BSY)
+            ;
+        failed = (FLASH_SR & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)) || *target != value;
+        FLASH_SR = FLASH_SR_EOP | FLASH_SR_PGERR | FLASH_SR_WRPRTERR;
+    }
+    FLASH_CR = 0;
+    return failed;
+}
+
+__attribute__((noreturn)) void stub_main(void) {
+    int failed = 0;
+    __asm volatile("cpsid i");
+    for (uint32_t* bss = &__bss_start; bss < &__bss_end; bss++) *bss = 0;
+
+    clock_init();
+    usart_init(header.baud);
+    usart_reply(STUB_READY);
+
+    for (;;) {
+        unsigned char* bytes = (unsigned char*)frame;
+        ring_read(bytes, STUB_FRAME_HEADER);
+        unsigned char command = bytes[0];
+        unsigned char flags = bytes[1];
+        size_t length = bytes[2] | bytes[3] << 8;
+        uint32_t addr = word(bytes + 4);
+        uint32_t size = word(bytes + 8);
+        size_t padded = (length + 3) & ~3u;
+        if (STUB_FRAME_HEADER + padded + STUB_FRAME_CRC > sizeof(frame)) {
+            // Lost track of the frames, nothing sensible to do but report it
+            usart_reply(STUB_NACK);
+            continue;
+        }
+        ring_read(bytes + STUB_FRAME_HEADER, padded + STUB_FRAME_CRC);
+        size_t words = (STUB_FRAME_HEADER + padded) / 4;
+        if (crc(frame, words) != frame[words]) {
+            usart_reply(STUB_NACK);
+            continue;
+        }
+        // The previous chunk has been programmed by the time the next frame is answered
+        usart_reply(failed ? STUB_ERROR : STUB_ACK);
+        if (failed) continue;
+
+        switch (command) {
+            case STUB_CMD_BAUD:
+                usart_baud(size);
+                break;
+            case STUB_CMD_WRITE: {
+                const unsigned char* data = bytes + STUB_FRAME_HEADER;
+                if (flags & STUB_FLAG_LZ4) {
+                    int decompressed = lz4_decompress(data, length, chunk);
+                    if (decompressed != (int)size) {
+                        failed = 1;
+                        break;
+                    }
+                    data = chunk;
+                }
+                failed = size > CHUNK || size % 2 || flash_program(addr, data, size);
+                break;
+            }
+            case STUB_CMD_CRC: {
+                // Whole words, as the host pads segments
+                uint32_t value = crc((const uint32_t*)addr, size / 4);
+                unsigned char reply[4] = { value, value >> 8, value >> 16, value >> 24 };
+                usart_send(reply, sizeof(reply));
+                break;
+            }
+        }
+    }
+}